@@ -6,7 +6,8 @@
 #include "schema.h"
 #include "mailbox.h"
 #include "granter.h"
-#include "postgres.h"
+#include "injector.h"
+#include "blobstore.h"
 #include "selector.h"
 #include "recipient.h"
 #include "transaction.h"
@@ -32,7 +33,8 @@ static const char * versions[] = {
     "2.12", "2.13", "2.13", "2.14", "3.0.6", "3.1.0", // 76-81
     "3.1.0", "3.1.0", "3.1.0", "3.1.0", "3.1.0", "3.1.0", // 82-87
     "3.1.1", "3.1.3", "3.1.3", "3.1.3", "3.1.3", "3.2.0", // 88-93
-    "3.2.0", "3.2.0", "3.2.0", "3.2.0"
+    "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0", // 94-98
+    "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0", "3.2.0" // 99-104
 };
 static int nv = sizeof( versions ) / sizeof( versions[0] );
 
@@ -144,7 +146,8 @@ f3( "vacuum", "", "Perform routine maintenance.",
     "    Synopsis: aox vacuum\n\n"
     "    Permanently deletes messages that were marked for deletion\n"
     "    more than a certain number of days ago (cf. undelete-time)\n"
-    "    and removes any bodyparts that are no longer used.\n\n"
+    "    and removes any bodyparts, stored message texts and files in\n"
+    "    the blob-directory that are no longer used.\n\n"
     "    This is not a replacement for running VACUUM ANALYSE on the\n"
     "    database (either with vaccumdb or via autovacuum).\n\n"
     "    This command should be run (we suggest daily) via crontab.\n" );
@@ -154,7 +157,7 @@ f3( "vacuum", "", "Perform routine maintenance.",
 */
 
 Vacuum::Vacuum( EStringList * args )
-    : AoxCommand( args ), t( 0 ), r( 0 ), s( 0 )
+    : AoxCommand( args ), t( 0 ), r( 0 ), s( 0 ), b( 0 )
 {
 }
 
@@ -204,6 +207,12 @@ void Vacuum::execute()
                        "(b.id=p.bodypart) where bodypart is null)", 0 );
         t->enqueue( q );
 
+        q = new Query( "delete from raw_messages where hash in "
+                       "(select r.hash from raw_messages r "
+                       "left join messages m on (r.hash=m.raw) "
+                       "where m.raw is null)", 0 );
+        t->enqueue( q );
+
         if ( opt( 'a' ) > 0 ) {
             // delete the unnecessary addresses rows. this locks the
             // database for quite a while (seconds, perhaps even a
@@ -244,6 +253,8 @@ void Vacuum::execute()
             t->enqueue(
                 "delete from addresses where id in "
                 "(select address from au where not used)" );
+            // the servers may have cached the IDs we just deleted
+            t->enqueue( "notify addresses_removed" );
             // the index has to go away again
             t->enqueue( "drop table au" );
             t->enqueue( "drop index af_a" );
@@ -331,6 +342,27 @@ void Vacuum::execute()
     if ( t->failed() )
         error( "Vacuuming failed" );
 
+    if ( BlobStore::enabled() ) {
+        if ( !b ) {
+            b = new Query( "select hash from bodyparts where external",
+                           this );
+            b->execute();
+        }
+
+        if ( !b->done() )
+            return;
+
+        if ( b->failed() )
+            error( "Couldn't read the external bodyparts: " + b->error() );
+
+        Dict<void> used;
+        while ( b->hasResults() )
+            used.insert( b->nextRow()->getEString( "hash" ), (void*)1 );
+
+        // a day should be enough for any injection to commit
+        BlobStore::removeUnused( used, 86400 );
+    }
+
     finish();
 }
 
@@ -442,10 +474,51 @@ struct TunableIndex {
       "USING gin (to_tsvector('simple'::regconfig, value)) "
       "WHERE (octet_length(value) < (640000) and field=20)",
       false, false, true },
+    { "hf_trgm", "header_fields",
+      "CREATE INDEX hf_trgm ON header_fields "
+      "USING gin (value gin_trgm_ops)",
+      false, false, true },
+    { "a_name_trgm", "addresses",
+      "CREATE INDEX a_name_trgm ON addresses "
+      "USING gin (lower(name) gin_trgm_ops)",
+      false, false, true },
+    { "a_lp_trgm", "addresses",
+      "CREATE INDEX a_lp_trgm ON addresses "
+      "USING gin (lower(localpart) gin_trgm_ops)",
+      false, false, true },
+    { "a_dom_trgm", "addresses",
+      "CREATE INDEX a_dom_trgm ON addresses "
+      "USING gin (lower(domain) gin_trgm_ops)",
+      false, false, true },
     { 0, 0, 0, false, false, false }
 };
 
 
+/*! Returns the definition of tunableIndices[\a i], using the
+    text-search-configuration instead of 'simple' for the full-text
+    indexes.
+*/
+
+static EString tunableDefinition( uint i )
+{
+    EString def( tunableIndices[i].definition );
+    EString c = Configuration::text(
+        Configuration::TextSearchConfiguration ).lower();
+    def.replace( "'simple'::regconfig", "'" + c + "'::regconfig" );
+    return def;
+}
+
+
+/*! Returns true if tunableIndices[\a i] needs the pg_trgm
+    extension.
+*/
+
+static bool needsTrigrams( uint i )
+{
+    return EString( tunableIndices[i].definition ).contains( "gin_trgm_ops" );
+}
+
+
 class TuneDatabaseData
     : public Garbage
 {
@@ -471,7 +544,10 @@ f5( "tune", "database", "Adds or removes indices.",
     "    Mode mostly-reading tunes the database for message reading,\n"
     "    but without full-text indexing.\n"
     "    Mode advanced-reading tunes the database for fast message\n"
-    "    searching and reading, at the cost of injection speed.\n" );
+    "    searching and reading, at the cost of injection speed. It\n"
+    "    creates full-text indexes using text-search-configuration, and\n"
+    "    trigram indexes for substring searches on header fields and\n"
+    "    addresses, which need the pg_trgm extension.\n" );
 
 /*! \class TuneDatabase db.h
     This class handles the "aox tune database" command.
@@ -499,6 +575,10 @@ void TuneDatabase::execute()
             error( "Unknown database mode.\n"
                    "Supported: mostly-writing, mostly-reading and "
                    "advanced-reading" );
+        EString c = Configuration::text(
+            Configuration::TextSearchConfiguration );
+        if ( c.isEmpty() || !c.boring() )
+            error( "Bad text-search-configuration: " + c );
         database( true );
 
         d->t = new Transaction( this );
@@ -509,7 +589,8 @@ void TuneDatabase::execute()
             indexnames.append( tunableIndices[i].name );
             ++i;
         }
-        d->find = new Query( "select indexname::text from pg_indexes where "
+        d->find = new Query( "select indexname::text, indexdef::text "
+                             "from pg_indexes where "
                              "schemaname=$1 and indexname=any($2::text[])",
                              this );
         d->find->bind( 1, Configuration::text( Configuration::DbSchema ) );
@@ -527,6 +608,7 @@ void TuneDatabase::execute()
 
     if ( !d->set ) {
         EStringList present;
+        EStringList outdated;
         while ( d->find->hasResults() ) {
             Row * r = d->find->nextRow();
             EString name = r->getEString( "indexname" );
@@ -534,9 +616,23 @@ void TuneDatabase::execute()
             while ( tunableIndices[i].name &&
                     name != tunableIndices[i].name )
                 i++;
-            if ( tunableIndices[i].name )
+            if ( tunableIndices[i].name ) {
                 present.append( tunableIndices[i].name );
+                // a full-text index built for another configuration
+                // has to be rebuilt, and so does a trigram index on
+                // another expression.
+                EString c = tunableDefinition( i );
+                EString def = r->getEString( "indexdef" );
+                int n = c.find( "to_tsvector(" );
+                if ( n >= 0 &&
+                     !def.contains( c.mid( n, c.find( "::regconfig" ) - n ) ) )
+                    outdated.append( tunableIndices[i].name );
+                else if ( needsTrigrams( i ) &&
+                          !def.contains( c.mid( c.find( "USING " ) ) ) )
+                    outdated.append( tunableIndices[i].name );
+            }
         }
+        bool trigrams = false;
         uint i = 0;
         while ( tunableIndices[i].name ) {
             bool wanted = false;
@@ -552,16 +648,25 @@ void TuneDatabase::execute()
                 break;
             }
             Query * q = 0;
+            if ( wanted && outdated.find( tunableIndices[i].name ) ) {
+                d->t->enqueue( new Query( EString( "drop index " ) +
+                                          tunableIndices[i].name, 0 ) );
+                printf( "Dropping index %s (outdated definition).\n",
+                        tunableIndices[i].name );
+                present.take( present.find( tunableIndices[i].name ) );
+            }
             if ( wanted && !present.find( tunableIndices[i].name ) ) {
-                if ( EString( tunableIndices[i].name ) == "b_text" &&
-                     Postgres::version() < 80300 ) {
-                    printf( "Error: "
-                            "Full-text indexing needs PostgreSQL 8.3\n" );
-                }
-                else {
-                    q = new Query( tunableIndices[i].definition, 0 );
-                    printf( "Executing %s;\n", tunableIndices[i].definition );
+                if ( needsTrigrams( i ) && !trigrams ) {
+                    // pg_trgm is a trusted extension as of PostgreSQL
+                    // 13. before that, schema/fts.pg has to be run by
+                    // a superuser.
+                    d->t->enqueue( new Query( "create extension if not "
+                                              "exists pg_trgm", 0 ) );
+                    trigrams = true;
                 }
+                EString def = tunableDefinition( i );
+                q = new Query( def, 0 );
+                printf( "Executing %s;\n", def.cstr() );
             }
             else if ( present.find( tunableIndices[i].name ) && !wanted ) {
                 q = new Query( EString("drop index ") + tunableIndices[i].name,
@@ -581,10 +686,28 @@ void TuneDatabase::execute()
     if ( !d->t->done() )
         return;
 
+    if ( d->t->failed() )
+        error( "Cannot tune database: " + d->t->error() );
+
     finish();
 }
 
 
+/*! Returns a query which computes what mailbox_counters should
+    contain for each nonempty mailbox.
+*/
+
+static EString countersQuery()
+{
+    return "select mm.mailbox, count(*)::int as messages, "
+        "sum(case when mm.seen then 0 else 1 end)::int as unseen, "
+        "coalesce(sum(m.rfc822size),0)::bigint as size "
+        "from mailbox_messages mm "
+        "join messages m on (mm.message=m.id) "
+        "group by mm.mailbox";
+}
+
+
 static AoxFactory<CheckDatabase>
 f6( "check", "database", "Check database contents.",
     "    Synopsis: aox check database\n\n"
@@ -662,6 +785,18 @@ void CheckDatabase::execute()
                  "group by message, part, position "
                  "having count(*) > 1" );
 
+    // the mailbox counters should agree with mailbox_messages
+    expectEmpty( "select mb.id, mb.name "
+                 "from mailboxes mb "
+                 "left join mailbox_counters c on (mb.id=c.mailbox) "
+                 "where c.mailbox is null" );
+    expectEmpty( "select c.mailbox, c.messages, c.unseen, c.size "
+                 "from mailbox_counters c "
+                 "left join (" + countersQuery() + ") x using (mailbox) "
+                 "where c.messages<>coalesce(x.messages,0) "
+                 "or c.unseen<>coalesce(x.unseen,0) "
+                 "or c.size<>coalesce(x.size,0)" );
+
     t->commit();
     finish();
 }
@@ -684,7 +819,7 @@ public:
 
 /*! Sends \a query and complains if the results are anything but empty. */
 
-void CheckDatabase::expectEmpty( const char * query )
+void CheckDatabase::expectEmpty( const EString & query )
 {
     EmptinessChecker * x = new EmptinessChecker;
     x->c = this;
@@ -742,3 +877,211 @@ void CheckDatabase::scream( class Query * q )
     error( "Unexpected row in the database. Contact info@aox.org. "
            "Query: " + q->string() + " Result row: " + rowSummary( q ) );
 }
+
+
+static AoxFactory<RebuildCounters>
+f7( "rebuild", "counters", "Recompute the mailbox counters.",
+    "    Synopsis: aox rebuild counters\n\n"
+    "    Recomputes the number of messages, unseen messages and total\n"
+    "    size of each mailbox from scratch. The server keeps these\n"
+    "    up to date as messages are added, changed and removed, so\n"
+    "    this should only be necessary if \"aox check database\"\n"
+    "    reports that they are wrong.\n\n"
+    "    Changes to the mailboxes are blocked while this runs.\n" );
+
+
+/*! \class RebuildCounters db.h
+    This class handles the "aox rebuild counters" command.
+*/
+
+RebuildCounters::RebuildCounters( EStringList * args )
+    : AoxCommand( args ), t( 0 )
+{
+}
+
+
+void RebuildCounters::execute()
+{
+    if ( !t ) {
+        end();
+
+        database( true );
+        t = new Transaction( this );
+        t->enqueue( "lock mailbox_messages in share mode" );
+        t->enqueue( "insert into mailbox_counters (mailbox) "
+                    "select id from mailboxes where id not in "
+                    "(select mailbox from mailbox_counters)" );
+        t->enqueue( "update mailbox_counters "
+                    "set messages=0, unseen=0, size=0" );
+        t->enqueue( "update mailbox_counters c set "
+                    "messages=x.messages, unseen=x.unseen, size=x.size "
+                    "from (" + countersQuery() + ") x "
+                    "where c.mailbox=x.mailbox" );
+        t->commit();
+    }
+
+    if ( !t->done() )
+        return;
+
+    if ( t->failed() )
+        error( "Couldn't rebuild the counters: " + t->error() );
+
+    finish();
+}
+
+
+class RecompressData
+    : public Garbage
+{
+public:
+    RecompressData()
+        : find( 0 ), t( 0 ), last( 0 ), seen( 0 ), changed( 0 )
+    {}
+
+    Query * find;
+    Transaction * t;
+    uint last;
+    uint seen;
+    uint changed;
+};
+
+
+static AoxFactory<Recompress>
+f8( "recompress", "", "Compress or uncompress stored bodyparts.",
+    "    Synopsis: aox recompress [-v]\n\n"
+    "    Compresses the stored bodyparts that compress well, if\n"
+    "    compress-bodyparts is enabled, or uncompresses all of them\n"
+    "    if it is not. Bodyparts larger than blob-minimum-size are\n"
+    "    moved to the blob-directory, and others are moved back into\n"
+    "    the database. New messages are stored according to those\n"
+    "    settings anyway, so this only affects older messages.\n\n"
+    "    The work is done in small batches, so this can run while\n"
+    "    the server is running, and be interrupted and restarted.\n"
+    "    The -v flag reports progress after each batch.\n" );
+
+
+/*! \class Recompress db.h
+    This class handles the "aox recompress" command.
+
+    It reads the bodyparts a batch at a time, in order of id, and
+    updates those whose bodyparts.compression or bodyparts.external
+    doesn't match what the Injector would now store.
+*/
+
+Recompress::Recompress( EStringList * args )
+    : AoxCommand( args ), d( new RecompressData )
+{
+}
+
+
+void Recompress::execute()
+{
+    if ( !d->find ) {
+        parseOptions();
+        end();
+        database( true );
+    }
+
+    while ( true ) {
+        if ( !d->find ) {
+            d->find = new Query( "select id, hash, data, compression, "
+                                 "external from bodyparts "
+                                 "where id>$1 "
+                                 "and (data is not null or external) "
+                                 "order by id limit 256", this );
+            d->find->bind( 1, d->last );
+            d->find->execute();
+        }
+
+        if ( !d->find->done() )
+            return;
+
+        if ( d->find->failed() )
+            error( "Couldn't read bodyparts: " + d->find->error() );
+
+        if ( !d->t ) {
+            if ( !d->find->rows() )
+                break;
+
+            d->t = new Transaction( this );
+            while ( d->find->hasResults() ) {
+                Row * r = d->find->nextRow();
+                d->last = r->getInt( "id" );
+                d->seen++;
+
+                EString hash = r->getEString( "hash" );
+                bool external = !r->isNull( "external" ) &&
+                                r->getBoolean( "external" );
+                bool compressed = !r->isNull( "compression" );
+                EString data;
+                bool ok = true;
+                if ( external )
+                    data = BlobStore::fetch( hash, &ok );
+                else if ( compressed )
+                    data = r->getEString( "data" ).uncompressed( &ok );
+                else
+                    data = r->getEString( "data" );
+                if ( !ok ) {
+                    fprintf( stderr, "Cannot read bodypart %d\n",
+                             d->last );
+                    continue;
+                }
+
+                EString c;
+                if ( BlobStore::wants( data ) ) {
+                    if ( external )
+                        continue;
+                    if ( !BlobStore::store( hash, data ) ) {
+                        fprintf( stderr, "Cannot store bodypart %d "
+                                 "in the blob directory\n", d->last );
+                        continue;
+                    }
+                }
+                else {
+                    c = Injector::compressedBodypart( data );
+                    if ( !external && compressed != c.isEmpty() )
+                        continue;
+                }
+
+                Query * q =
+                    new Query( "update bodyparts set data=$1, "
+                               "compression=$2, external=$3 "
+                               "where id=$4", 0 );
+                if ( BlobStore::wants( data ) ) {
+                    q->bindNull( 1 );
+                    q->bindNull( 2 );
+                    q->bind( 3, true );
+                }
+                else if ( c.isEmpty() ) {
+                    q->bind( 1, data, Query::Binary );
+                    q->bindNull( 2 );
+                    q->bindNull( 3 );
+                }
+                else {
+                    q->bind( 1, c, Query::Binary );
+                    q->bind( 2, 1 );
+                    q->bindNull( 3 );
+                }
+                q->bind( 4, d->last );
+                d->t->enqueue( q );
+                d->changed++;
+            }
+            d->t->commit();
+        }
+
+        if ( !d->t->done() )
+            return;
+
+        if ( d->t->failed() )
+            error( "Couldn't update bodyparts: " + d->t->error() );
+
+        if ( opt( 'v' ) )
+            printf( "Processed %d bodyparts, changed %d\n",
+                    d->seen, d->changed );
+        d->find = 0;
+        d->t = 0;
+    }
+
+    printf( "Changed %d of %d bodyparts.\n", d->changed, d->seen );
+    finish();
+}
@@ -41,6 +41,7 @@ private:
     class Transaction * t;
     class RetentionSelector * r;
     class Selector * s;
+    class Query * b;
 };
 
 
@@ -75,7 +76,7 @@ class CheckDatabase
 public:
     CheckDatabase( EStringList * );
     void execute();
-    void expectEmpty( const char * );
+    void expectEmpty( const EString & );
     void scream( class Query * );
 
 private:
@@ -83,4 +84,28 @@ private:
 };
 
 
+class RebuildCounters
+    : public AoxCommand
+{
+public:
+    RebuildCounters( EStringList * );
+    void execute();
+
+private:
+    class Transaction * t;
+};
+
+
+class Recompress
+    : public AoxCommand
+{
+public:
+    Recompress( EStringList * );
+    void execute();
+
+private:
+    class RecompressData * d;
+};
+
+
 #endif
@@ -6,9 +6,12 @@
 #include "query.h"
 #include "message.h"
 #include "mailbox.h"
+#include "fetcher.h"
 #include "injector.h"
+#include "blobstore.h"
 #include "integerset.h"
 #include "transaction.h"
+#include "imapstructure.h"
 
 #include <stdio.h>
 #include <sys/stat.h> // mkdir
@@ -21,11 +24,21 @@ class ReparseData
 {
 public:
     ReparseData()
-        : q( 0 ), t( 0 )
+        : q( 0 ), t( 0 ),
+          backfilling( false ), find( 0 ), fetcher( 0 ), store( 0 ),
+          stored( 0 )
     {}
 
     Query * q;
     Transaction * t;
+
+    bool backfilling;
+    Query * find;
+    IntegerSet unstructured;
+    List<Message> batch;
+    Fetcher * fetcher;
+    Query * store;
+    uint stored;
 };
 
 
@@ -34,7 +47,9 @@ f( "reparse", "", "Retry previously-stored unparsable messages.",
    "    Synopsis: aox reparse\n\n"
    "    Looks for messages that \"arrived but could not be stored\",\n"
    "    and tries to reparse them with parsing workarounds added more\n"
-   "    recently. If it succeeds, the new messages are injected.\n" );
+   "    recently. If it succeeds, the new messages are injected.\n\n"
+   "    Then computes and stores the IMAP ENVELOPE and BODYSTRUCTURE\n"
+   "    of any messages stored before the server began doing that.\n" );
 
 
 /*! \class Reparse reparse.h
@@ -49,6 +64,11 @@ Reparse::Reparse( EStringList * args )
 
 void Reparse::execute()
 {
+    if ( d->backfilling ) {
+        backfill();
+        return;
+    }
+
     if ( !d->q && !d->t ) {
         parseOptions();
         end();
@@ -62,7 +82,8 @@ void Reparse::execute()
         d->q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
                           "mm.message as wrapper, "
                           "mb.nextmodseq, "
-                          "b.id as bodypart, b.text, b.data "
+                          "b.id as bodypart, b.text, b.data, "
+                          "b.compression, b.hash, b.external "
                           "from unparsed_messages u "
                           "join bodyparts b on (u.bodypart=b.id) "
                           "join part_numbers p on (p.bodypart=b.id) "
@@ -88,10 +109,14 @@ void Reparse::execute()
         Row * r = d->q->nextRow();
 
         EString text;
-        if ( r->isNull( "data" ) )
+        if ( !r->isNull( "external" ) && r->getBoolean( "external" ) )
+            text = BlobStore::fetch( r->getEString( "hash" ) );
+        else if ( r->isNull( "data" ) )
             text = r->getEString( "text" );
-        else
+        else if ( r->isNull( "compression" ) )
             text = r->getEString( "data" );
+        else
+            text = r->getEString( "data" ).uncompressed();
         Mailbox * mb = Mailbox::find( r->getInt( "mailbox" ) );
         Injectee * im = new Injectee;
         im->parse( text );
@@ -150,7 +175,86 @@ void Reparse::execute()
 
     if ( d->t->failed() )
         error( "Reparsing failed: " + d->t->error() );
-    finish();
+
+    d->backfilling = true;
+    backfill();
+}
+
+
+/*! Stores the ENVELOPE, BODY and BODYSTRUCTURE of each message that
+    doesn't have them in message_structures yet, a batch at a time, and
+    finishes when there are no more.
+*/
+
+void Reparse::backfill()
+{
+    if ( !d->find ) {
+        printf( "Looking for messages without a stored BODYSTRUCTURE\n" );
+        d->find = new Query( "select id from messages m where not exists "
+                             "(select 1 from message_structures s "
+                             "where s.message=m.id)", this );
+        d->find->execute();
+    }
+
+    if ( !d->find->done() )
+        return;
+
+    while ( d->find->hasResults() )
+        d->unstructured.add( d->find->nextRow()->getInt( "id" ) );
+
+    if ( d->fetcher ) {
+        if ( !d->fetcher->done() )
+            return;
+
+        d->store = new Query( "copy message_structures "
+                              "(message,envelope,body,bodystructure) "
+                              "from stdin with binary", this );
+        List<Message>::Iterator m( d->batch );
+        while ( m ) {
+            d->store->bind( 1, m->databaseId() );
+            d->store->bind( 2, ImapStructure::envelope( m, false ) );
+            d->store->bind( 3, ImapStructure::bodyStructure( m, false,
+                                                             false ) );
+            d->store->bind( 4, ImapStructure::bodyStructure( m, true,
+                                                             false ) );
+            d->store->submitLine();
+            ++m;
+        }
+        d->store->execute();
+        d->stored += d->batch.count();
+        d->batch.clear();
+        d->fetcher = 0;
+    }
+
+    if ( d->store ) {
+        if ( !d->store->done() )
+            return;
+        if ( d->store->failed() )
+            error( "Couldn't store message structures: " +
+                   d->store->error() );
+        d->store = 0;
+        printf( "- %d done, %d to go\n",
+                d->stored, d->unstructured.count() );
+    }
+
+    if ( d->unstructured.isEmpty() ) {
+        finish();
+        return;
+    }
+
+    while ( d->batch.count() < 1024 && !d->unstructured.isEmpty() ) {
+        uint id = d->unstructured.smallest();
+        d->unstructured.remove( id );
+        Message * m = new Message;
+        m->setDatabaseId( id );
+        d->batch.append( m );
+    }
+
+    d->fetcher = new Fetcher( &d->batch, this, 0 );
+    d->fetcher->fetch( Fetcher::Addresses );
+    d->fetcher->fetch( Fetcher::OtherHeader );
+    d->fetcher->fetch( Fetcher::PartNumbers );
+    d->fetcher->execute();
 }
 
 
@@ -16,6 +16,8 @@ public:
     EString writeErrorCopy( const EString & );
 
 private:
+    void backfill();
+
     class ReparseData * d;
 };
 
@@ -3,6 +3,11 @@
 #include "stats.h"
 
 #include "query.h"
+#include "buffer.h"
+#include "endpoint.h"
+#include "resolver.h"
+#include "eventloop.h"
+#include "connection.h"
 #include "configuration.h"
 
 #include <stdio.h>
@@ -138,7 +143,8 @@ void ShowCounts::execute()
         d->query =
             new Query( "select count(*)::int as bodyparts,"
                        "coalesce(sum(length(text))::bigint,0) as textsize,"
-                       "coalesce(sum(length(data))::bigint,0) as datasize "
+                       "coalesce(sum(length(data))::bigint,0) as datasize,"
+                       "count(compression)::int as compressed "
                        "from bodyparts", this );
         d->query->execute();
         d->state = 3;
@@ -152,10 +158,12 @@ void ShowCounts::execute()
         if ( d->query->failed() || !r )
             error( "Couldn't fetch bodyparts counts." );
 
-        printf( "Bodyparts: %d (text size: %s, data size: %s)\n",
+        printf( "Bodyparts: %d (text size: %s, data size: %s, "
+                "%d compressed)\n",
                 r->getInt( "bodyparts" ),
                 EString::humanNumber( r->getBigint( "textsize" ) ).cstr(),
-                EString::humanNumber( r->getBigint( "datasize" ) ).cstr() );
+                EString::humanNumber( r->getBigint( "datasize" ) ).cstr(),
+                r->getInt( "compressed" ) );
 
         d->query =
             new Query( "select count(*)::int as addresses "
@@ -178,3 +186,143 @@ void ShowCounts::execute()
 
     finish();
 }
+
+
+
+class StatisticsReader
+    : public Connection
+{
+public:
+    StatisticsReader( EventHandler * owner )
+        : Connection(), done( false ), o( owner ) {
+        EString addr;
+        EStringList::Iterator it( Resolver::resolve(
+            Configuration::text( Configuration::StatisticsAddress ) ) );
+        if ( it )
+            addr = *it;
+        if ( addr.isEmpty() ) {
+            done = true;
+            return;
+        }
+        connect( Endpoint( addr, Configuration::scalar(
+                               Configuration::StatisticsPort ) ) );
+        EventLoop::global()->addConnection( this );
+        setTimeoutAfter( 10 );
+    }
+
+    void react( Event e ) {
+        switch ( e ) {
+        case Connect:
+        case Shutdown:
+            break;
+
+        case Read:
+            text.append( readBuffer()->string( readBuffer()->size() ) );
+            readBuffer()->remove( readBuffer()->size() );
+            break;
+
+        case Timeout:
+        case Error:
+        case Close:
+            setState( Closing );
+            done = true;
+            o->execute();
+            break;
+        }
+    }
+
+    bool done;
+    EString text;
+    EventHandler * o;
+};
+
+
+class ShowMemoryData
+    : public Garbage
+{
+public:
+    ShowMemoryData(): reader( 0 ) {}
+
+    StatisticsReader * reader;
+};
+
+
+static AoxFactory<ShowMemory>
+f2( "show", "memory", "Show the server's memory use.",
+    "    Synopsis: aox show memory\n\n"
+    "    Displays how much memory the running archiveopteryx server\n"
+    "    uses, in total and for the buffers of each idle IMAP\n"
+    "    connection, as reported on its statistics port (see\n"
+    "    use-statistics).\n" );
+
+
+/*! \class ShowMemory stats.h
+    This class handles the "aox show memory" command.
+
+    It reads the current values from the server's statistics port
+    (see GraphDumper) and prints the ones that concern memory.
+*/
+
+ShowMemory::ShowMemory( EStringList * args )
+    : AoxCommand( args ), d( new ShowMemoryData )
+{
+}
+
+
+void ShowMemory::execute()
+{
+    if ( !d->reader ) {
+        parseOptions();
+        end();
+
+        if ( !Configuration::toggle( Configuration::UseStatistics ) )
+            error( "use-statistics is disabled" );
+
+        d->reader = new StatisticsReader( this );
+    }
+
+    if ( !d->reader->done )
+        return;
+
+    if ( d->reader->text.isEmpty() )
+        error( "Couldn't read the server's statistics" );
+
+    static const char * names[] = {
+        "memory-used", "imap-connections",
+        "imap-hibernating-connections", "imap-idle-connection-memory",
+        0
+    };
+    static const char * descriptions[] = {
+        "Memory used", "IMAP connections",
+        "Hibernating IMAP connections", "Buffers per idle IMAP connection",
+        0
+    };
+
+    EStringList * lines = EStringList::split( '\n', d->reader->text );
+    uint i = 0;
+    while ( names[i] ) {
+        EStringList::Iterator l( lines );
+        while ( l ) {
+            EString line = l->simplified();
+            ++l;
+            int last = -1;
+            int n = line.find( ':' );
+            while ( n >= 0 ) {
+                last = n;
+                n = line.find( ':', n + 1 );
+            }
+            if ( last > 0 && line.section( " ", 1 ) == names[i] ) {
+                EString v = line.mid( last + 1 );
+                if ( EString( names[i] ).endsWith( "connections" ) )
+                    printf( "%s: %s\n", descriptions[i], v.cstr() );
+                else
+                    printf( "%s: %s\n", descriptions[i],
+                            EString::humanNumber( v.number( 0 ) ).cstr() );
+            }
+        }
+        i++;
+    }
+
+    finish();
+}
+
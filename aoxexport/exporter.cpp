@@ -21,13 +21,14 @@ class ExporterData
 {
 public:
     ExporterData()
-        : find( 0 ), fetcher( 0 ),
+        : find( 0 ), fetcher( 0 ), fallback( 0 ),
           mailbox( 0 ), selector( 0 ),
           messages( new List<Message> )
         {}
 
     Query * find;
     Fetcher * fetcher;
+    Fetcher * fallback;
     UString sourceName;
     Mailbox * mailbox;
     Selector * selector;
@@ -98,21 +99,39 @@ void Exporter::execute()
         }
         d->fetcher = new Fetcher( d->messages, this, 0 );
         d->fetcher->fetch( Fetcher::Addresses );
-        d->fetcher->fetch( Fetcher::OtherHeader );
-        d->fetcher->fetch( Fetcher::Body );
         d->fetcher->fetch( Fetcher::Trivia );
+        d->fetcher->fetch( Fetcher::RawText );
         d->fetcher->execute();
     }
 
+    if ( !d->fallback ) {
+        // messages whose original text isn't stored have to be
+        // reassembled, so fetch their headers and bodies too.
+        if ( !d->fetcher->done() )
+            return;
+        List<Message> * l = new List<Message>;
+        List<Message>::Iterator i( d->messages );
+        while ( i ) {
+            if ( i->rawText().isEmpty() )
+                l->append( i );
+            ++i;
+        }
+        d->fallback = new Fetcher( l, this, 0 );
+        d->fallback->fetch( Fetcher::OtherHeader );
+        d->fallback->fetch( Fetcher::Body );
+        d->fallback->execute();
+    }
+
     while ( !d->messages->isEmpty() ) {
         Message * m = d->messages->firstElement();
+        EString raw = m->rawText();
         if ( !m->hasAddresses() )
             return;
-        if ( !m->hasHeaders() )
+        if ( !m->hasTrivia() )
             return;
-        if ( !m->hasBodies() )
+        if ( raw.isEmpty() && !m->hasHeaders() )
             return;
-        if ( !m->hasTrivia() )
+        if ( raw.isEmpty() && !m->hasBodies() )
             return;
         d->messages->shift();
         EString from = "From ";
@@ -133,7 +152,7 @@ void Exporter::execute()
         Date id;
         if ( m->internalDate() )
             id.setUnixTime( m->internalDate() );
-        else if ( m->header()->date() )
+        else if ( m->hasHeaders() && m->header()->date() )
             id = *m->header()->date();
         // Tue Jul 23 19:39:23 2002
         from.append( weekdays[id.weekday()] );
@@ -154,7 +173,9 @@ void Exporter::execute()
         from.append( " " );
         from.appendNumber( id.year() );
         from.append( "\r\n" );
-        EString rfc822 = m->rfc822( false );
+        EString rfc822 = raw;
+        if ( rfc822.isEmpty() )
+            rfc822 = m->rfc822( false );
         int r = ::write( 1, from.data(), from.length() ) +
                 ::write( 1, rfc822.data(), rfc822.length() );
         // we don't really care whether the write succeeds or not, so
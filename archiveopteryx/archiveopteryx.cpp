@@ -105,6 +105,10 @@ void ArchiveopteryxEventLoop::freeMemory()
         fine = false;
     }
 
+    // drop even the caches that are meant to survive GC, and hope
+    // that the next GC brings us back within the limit.
+    Cache::clearAllCaches( true );
+
     // how long have we been in a faq-inducing state?
     if ( time( 0 ) < unhappinessStarted + 60 )
         return;
@@ -72,6 +72,8 @@ void Buffer::append( const char * s, uint l, bool f )
 
     switch ( filter ) {
     case Compressing:
+        if ( !zs )
+            setCompression( Compressing );
         zs->avail_in = l;
         zs->next_in = (Bytef*)s;
         while ( zs->avail_in && progress && r == Z_OK ) {
@@ -409,9 +411,11 @@ Buffer::Compression Buffer::compression() const
 
 void Buffer::close()
 {
-    if ( !zs )
+    if ( !zs ) {
+        filter = None;
         return;
-    
+    }
+
     if ( filter == Compressing )
         ::deflateEnd( zs );
     else if ( filter == Decompressing )
@@ -419,3 +423,48 @@ void Buffer::close()
     zs = 0;
     filter = None;
 }
+
+
+/*! Releases the memory this Buffer keeps for later use: the vector
+    kept for reuse when the Buffer is empty, and the compressor's
+    state, if any. Used when a connection hibernates.
+
+    Every append() ends with a zlib sync flush, so the peer has seen
+    all the compressed output so far, and a new compressor can
+    continue the raw deflate stream without referring back to older
+    data. append() starts one when needed. The decompressor's state
+    includes the peer's window, so it has to be kept.
+*/
+
+void Buffer::shrink()
+{
+    if ( !bytes ) {
+        vecs.clear();
+        firstused = firstfree = 0;
+    }
+    if ( filter == Compressing && zs ) {
+        ::deflateEnd( zs );
+        zs = 0;
+    }
+}
+
+
+/*! Returns the approximate number of bytes this Buffer uses, counting
+    both the vectors and zlib's state (according to the formulae in
+    zconf.h).
+*/
+
+uint Buffer::memoryUsed() const
+{
+    uint n = 0;
+    List<Vector>::Iterator i( vecs );
+    while ( i ) {
+        n += i->len;
+        ++i;
+    }
+    if ( zs && filter == Compressing )
+        n += ( 1 << ( 15 + 2 ) ) + ( 1 << ( 9 + 9 ) );
+    else if ( zs && filter == Decompressing )
+        n += ( 1 << 15 ) + 7168;
+    return n;
+}
@@ -45,6 +45,9 @@ public:
 
     void close();
 
+    void shrink();
+    uint memoryUsed() const;
+
 private:
     char at( uint ) const;
 
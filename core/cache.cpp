@@ -5,6 +5,8 @@
 #include "list.h"
 #include "allocator.h"
 
+#include <limits.h>
+
 
 static List<Cache> * caches;
 
@@ -33,7 +35,9 @@ static List<Cache> * caches;
     \a f is the duration factor of this cache; it will be cleared once
     every \a f garbage collections. It should be low for expensive
     caches and for ones whose objects will stale quickly, large (say
-    5-10) for cheap ones whose objects stale slowly.
+    5-10) for cheap ones whose objects stale slowly. If \a f is
+    UINT_MAX, the cache is only cleared when the process is short of
+    memory, ie. by clearAllCaches( true ).
 */
 
 Cache::Cache( uint f )
@@ -70,7 +74,8 @@ void Cache::clearAllCaches( bool harder)
     while ( i ) {
         Cache * c = i;
         ++i;
-        c->n++;
+        if ( c->factor < UINT_MAX )
+            c->n++;
         if ( harder || c->n > c->factor ) {
             c->n = 0;
             c->clear(); // careful: no iterator pointing to c meanwhile
@@ -164,7 +164,18 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "message-cache-size", Configuration::MessageCacheSize, 16 },
+    { "shared-cache-size", Configuration::SharedCacheSize, 0 },
+    { "injection-group-size", Configuration::InjectionGroupSize, 100 },
+    { "injection-groups", Configuration::InjectionGroups, 2 },
+    { "address-cache-size", Configuration::AddressCacheSize, 10000 },
+    { "blob-minimum-size", Configuration::BlobMinimumSize, 512 },
+    { "search-concurrency", Configuration::SearchConcurrency, 3 },
+    { "delivery-concurrency", Configuration::DeliveryConcurrency, 2 },
+    { "smarthost-connections", Configuration::SmartHostConnections, 2 },
+    { "domain-connections", Configuration::DomainConnections, 2 },
+    { "mx-port", Configuration::MxPort, 25 }
 };
 
 
@@ -211,7 +222,10 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "blob-directory", Configuration::BlobDirectory, "" },
+    { "text-search-configuration", Configuration::TextSearchConfiguration,
+      "simple" }
 };
 
 
@@ -244,7 +258,10 @@ static struct {
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
     { "use-imap-quota", Configuration::UseImapQuota, true },
-    { "use-xtaxftc", Configuration::UseXTAXFTC, false }
+    { "use-xtaxftc", Configuration::UseXTAXFTC, false },
+    { "store-raw-messages", Configuration::StoreRawMessages, false },
+    { "compress-bodyparts", Configuration::CompressBodyparts, true },
+    { "use-smarthost", Configuration::UseSmartHost, true }
 };
 
 
@@ -57,6 +57,17 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        MessageCacheSize,
+        SharedCacheSize,
+        InjectionGroupSize,
+        InjectionGroups,
+        AddressCacheSize,
+        BlobMinimumSize,
+        SearchConcurrency,
+        DeliveryConcurrency,
+        SmartHostConnections,
+        DomainConnections,
+        MxPort,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -102,6 +113,8 @@ public:
         AddressSeparator,
         StatisticsAddress,
         LdapServerAddress,
+        BlobDirectory,
+        TextSearchConfiguration,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -135,6 +148,9 @@ public:
         CheckSenderAddresses,
         UseImapQuota,
         UseXTAXFTC,
+        StoreRawMessages,
+        CompressBodyparts,
+        UseSmartHost,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
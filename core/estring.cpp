@@ -8,6 +8,8 @@
 #include <stdio.h>
 // strlen
 #include <string.h>
+// deflate, inflate
+#include <zlib.h>
 
 
 /*! \class EStringData estring.h
@@ -1511,6 +1513,76 @@ bool EString::needsQP() const
 }
 
 
+/*! Returns a zlib-compressed (RFC 1950) copy of this string, suitable
+    for uncompressed().
+*/
+
+EString EString::compressed() const
+{
+    EString r;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if ( ::deflateInit( &zs, Z_DEFAULT_COMPRESSION ) != Z_OK )
+        return r;
+
+    r.reserve( ::deflateBound( &zs, length() ) );
+    zs.next_in = (Bytef*)data();
+    zs.avail_in = length();
+    zs.next_out = (Bytef*)r.d->str;
+    zs.avail_out = r.d->max;
+    int e = ::deflate( &zs, Z_FINISH );
+    if ( e == Z_STREAM_END )
+        r.d->len = zs.total_out;
+    ::deflateEnd( &zs );
+    return r;
+}
+
+
+/*! Returns an uncompressed copy of this string, which must have been
+    created by compressed(). If \a ok is non-null, *\a ok is set to
+    true if the string could be uncompressed and to false if not. In
+    the latter case, an empty string is returned.
+*/
+
+EString EString::uncompressed( bool * ok ) const
+{
+    if ( ok )
+        *ok = false;
+
+    EString r;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = (Bytef*)data();
+    zs.avail_in = length();
+    if ( ::inflateInit( &zs ) != Z_OK )
+        return r;
+
+    uint size = length() * 4;
+    if ( size < 1024 )
+        size = 1024;
+    int e = Z_OK;
+    while ( e == Z_OK ) {
+        r.reserve( size );
+        zs.next_out = (Bytef*)r.d->str + zs.total_out;
+        zs.avail_out = r.d->max - zs.total_out;
+        e = ::inflate( &zs, Z_NO_FLUSH );
+        r.d->len = zs.total_out;
+        size = size * 2;
+    }
+    ::inflateEnd( &zs );
+
+    if ( e != Z_STREAM_END )
+        return EString();
+    if ( ok )
+        *ok = true;
+    return r;
+}
+
+
 /*! Returns -1 if this string is lexicographically before \a other, 0
     if they are the same, and 1 if this string is lexicographically
     after \a other.
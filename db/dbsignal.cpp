@@ -16,10 +16,12 @@ class DatabaseSignalData
     : public Garbage
 {
 public:
-    DatabaseSignalData(): o( 0 ), l( new Log ) {}
+    DatabaseSignalData(): o( 0 ), l( new Log ), keep( false ) {}
     EString n;
     EventHandler * o;
     Log * l;
+    bool keep;
+    EStringList payloads;
 };
 
 
@@ -57,21 +59,55 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name. \a payload is the notification's payload, which is empty
+    unless the sender supplied one.
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
+        if ( name == s->d->n && s->d->o ) {
+            if ( s->d->keep )
+                s->d->payloads.append( payload );
             s->d->o->notify();
+        }
     }
 }
 
 
+/*! Instructs this DatabaseSignal to remember the payload of each
+    notification if \a keep is true, and to discard them if \a keep
+    is false (the default). Remembered payloads are returned (once)
+    by payloads().
+*/
+
+void DatabaseSignal::setKeepingPayloads( bool keep )
+{
+    d->keep = keep;
+    if ( !keep )
+        d->payloads.clear();
+}
+
+
+/*! Returns a non-null pointer to a list of the payloads received
+    since the last call, and forgets them. An empty string in the list
+    means that a notification arrived without a payload. The list is
+    always empty unless setKeepingPayloads() has been called.
+*/
+
+EStringList * DatabaseSignal::payloads()
+{
+    EStringList * r = new EStringList;
+    r->append( d->payloads );
+    d->payloads.clear();
+    return r;
+}
+
+
 /*! This destructor is private, so noone can ever call it. Objects of
     this class are indestructible by nature.
 */
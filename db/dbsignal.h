@@ -14,10 +14,13 @@ class DatabaseSignal
 public:
     DatabaseSignal( const EString &, EventHandler * );
 
-    static void notifyAll( const EString & );
+    static void notifyAll( const EString &, const EString & = "" );
 
     static EStringList * names();
 
+    void setKeepingPayloads( bool );
+    EStringList * payloads();
+
 private: // noone can destroy this
     ~DatabaseSignal();
 
@@ -590,6 +590,20 @@ bool Schema::singleStep()
         c = stepTo96(); break;
     case 96:
         c = stepTo97(); break;
+    case 97:
+        c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4408,3 +4422,327 @@ bool Schema::stepTo97()
     d->t->enqueue( "drop table views" );
     return true;
 }
+
+
+/*! Add mailbox_counters, maintained by triggers on mailbox_messages,
+    so that STATUS can avoid counting messages. On PostgreSQL 10 and
+    later, the triggers are per statement and use transition tables.
+*/
+
+bool Schema::stepTo98()
+{
+    describeStep( "Adding per-mailbox message counters." );
+    d->t->enqueue( "create table mailbox_counters ("
+                   "mailbox integer primary key references mailboxes(id) "
+                   "on delete cascade, "
+                   "messages integer not null default 0, "
+                   "unseen integer not null default 0, "
+                   "size bigint not null default 0)" );
+    d->t->enqueue( "create function create_mailbox_counters() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "insert into mailbox_counters (mailbox) values (NEW.id); "
+                   "return NULL; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create trigger mailbox_counters_create_trigger "
+                   "after insert on mailboxes "
+                   "for each row execute procedure create_mailbox_counters()" );
+    d->t->enqueue( "create function count_mailbox_messages() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "if TG_OP = 'UPDATE' then "
+                   "if NEW.mailbox = OLD.mailbox and NEW.seen = OLD.seen then "
+                   "return NULL; "
+                   "end if; "
+                   "end if; "
+                   "if TG_OP <> 'INSERT' then "
+                   "update mailbox_counters set "
+                   "messages=messages-1, "
+                   "unseen=unseen-(case when OLD.seen then 0 else 1 end), "
+                   "size=size-coalesce((select rfc822size from messages "
+                   "where id=OLD.message),0) "
+                   "where mailbox=OLD.mailbox; "
+                   "end if; "
+                   "if TG_OP <> 'DELETE' then "
+                   "update mailbox_counters set "
+                   "messages=messages+1, "
+                   "unseen=unseen+(case when NEW.seen then 0 else 1 end), "
+                   "size=size+coalesce((select rfc822size from messages "
+                   "where id=NEW.message),0) "
+                   "where mailbox=NEW.mailbox; "
+                   "end if; "
+                   "return NULL; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create function count_added_messages() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "update mailbox_counters c set "
+                   "messages=c.messages+n.messages, "
+                   "unseen=c.unseen+n.unseen, "
+                   "size=c.size+n.size "
+                   "from (select a.mailbox, count(*) as messages, "
+                   "sum(case when a.seen then 0 else 1 end) as unseen, "
+                   "coalesce(sum(m.rfc822size),0) as size "
+                   "from added_messages a "
+                   "left join messages m on (a.message=m.id) "
+                   "group by a.mailbox) n "
+                   "where c.mailbox=n.mailbox; "
+                   "return NULL; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create function count_removed_messages() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "update mailbox_counters c set "
+                   "messages=c.messages-o.messages, "
+                   "unseen=c.unseen-o.unseen, "
+                   "size=c.size-o.size "
+                   "from (select r.mailbox, count(*) as messages, "
+                   "sum(case when r.seen then 0 else 1 end) as unseen, "
+                   "coalesce(sum(m.rfc822size),0) as size "
+                   "from removed_messages r "
+                   "left join messages m on (r.message=m.id) "
+                   "group by r.mailbox) o "
+                   "where c.mailbox=o.mailbox; "
+                   "return NULL; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "create function count_changed_messages() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "update mailbox_counters c set "
+                   "messages=c.messages+x.messages, "
+                   "unseen=c.unseen+x.unseen, "
+                   "size=c.size+x.size "
+                   "from (select d.mailbox, sum(d.messages) as messages, "
+                   "sum(d.unseen) as unseen, "
+                   "coalesce(sum(d.sign*m.rfc822size),0) as size "
+                   "from (select o.mailbox, o.message, "
+                   "-1 as sign, -1 as messages, "
+                   "case when o.seen then 0 else -1 end as unseen "
+                   "from removed_messages o "
+                   "where not exists "
+                   "(select 1 from added_messages n "
+                   "where n.mailbox=o.mailbox and n.uid=o.uid "
+                   "and n.seen=o.seen) "
+                   "union all "
+                   "select n.mailbox, n.message, 1, 1, "
+                   "case when n.seen then 0 else 1 end "
+                   "from added_messages n "
+                   "where not exists "
+                   "(select 1 from removed_messages o "
+                   "where o.mailbox=n.mailbox and o.uid=n.uid "
+                   "and o.seen=n.seen)) d "
+                   "left join messages m on (d.message=m.id) "
+                   "group by d.mailbox) x "
+                   "where c.mailbox=x.mailbox; "
+                   "return NULL; "
+                   "end;$$ language plpgsql security definer" );
+    d->t->enqueue( "lock mailbox_messages in share mode" );
+    d->t->enqueue( "insert into mailbox_counters "
+                   "(mailbox, messages, unseen, size) "
+                   "select mb.id, count(mm.uid), "
+                   "coalesce(sum(case when mm.seen then 0 else 1 end),0), "
+                   "coalesce(sum(m.rfc822size),0) "
+                   "from mailboxes mb "
+                   "left join mailbox_messages mm on (mb.id=mm.mailbox) "
+                   "left join messages m on (mm.message=m.id) "
+                   "group by mb.id" );
+    if ( Postgres::version() >= 100000 ) {
+        d->t->enqueue( "create trigger mailbox_counters_insert_trigger "
+                       "after insert on mailbox_messages "
+                       "referencing new table as added_messages "
+                       "for each statement "
+                       "execute procedure count_added_messages()" );
+        d->t->enqueue( "create trigger mailbox_counters_delete_trigger "
+                       "after delete on mailbox_messages "
+                       "referencing old table as removed_messages "
+                       "for each statement "
+                       "execute procedure count_removed_messages()" );
+        d->t->enqueue( "create trigger mailbox_counters_update_trigger "
+                       "after update on mailbox_messages "
+                       "referencing old table as removed_messages "
+                       "new table as added_messages "
+                       "for each statement "
+                       "execute procedure count_changed_messages()" );
+    }
+    else {
+        d->t->enqueue( "create trigger mailbox_counters_trigger "
+                       "after insert or delete or update of mailbox, seen "
+                       "on mailbox_messages "
+                       "for each row "
+                       "execute procedure count_mailbox_messages()" );
+    }
+    d->t->enqueue( "grant select on mailbox_counters to " + d->dbuser );
+    return true;
+}
+
+
+/*! Adds store_bodyparts(), so that the Injector can store bodyparts
+    with one statement.
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding a function to store bodyparts." );
+    d->t->enqueue( "create function store_bodyparts() "
+                   "returns setof integer as $$ "
+                   "declare "
+                   "r integer; "
+                   "begin "
+                   "update bp set bid=b.id from bodyparts b "
+                   "where bp.hash=b.hash "
+                   "and not bp.text is distinct from b.text "
+                   "and not bp.data is distinct from b.data; "
+                   "update bp set bid=nextval('bodypart_ids')::int, n='t' "
+                   "where bid is null; "
+                   "insert into bodyparts (id,bytes,hash,text,data) "
+                   "select bid,bytes,hash,text,data from bp where n; "
+                   "for r in select bid from bp order by i loop "
+                   "return next r; "
+                   "end loop; "
+                   "return; "
+                   "end;$$ language plpgsql" );
+    return true;
+}
+
+
+/*! Adds the message_structures table. "aox reparse" fills it in for
+    existing messages.
+*/
+
+bool Schema::stepTo100()
+{
+    describeStep( "Adding stored ENVELOPE/BODYSTRUCTURE for each message." );
+    d->t->enqueue( "create table message_structures ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "envelope text not null, "
+                   "body text not null, "
+                   "bodystructure text not null)" );
+    d->t->enqueue( "grant select, insert on message_structures to " +
+                   d->dbuser );
+    return true;
+}
+
+
+/*! Adds the raw_messages table, in which the original text of each
+    message can be stored.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Adding optional storage for raw messages." );
+    d->t->enqueue( "create table raw_messages ("
+                   "hash text primary key, "
+                   "data bytea not null)" );
+    d->t->enqueue( "grant select, insert on raw_messages to " +
+                   d->dbuser );
+    d->t->enqueue( "alter table messages add "
+                   "raw text references raw_messages(hash)" );
+    d->t->enqueue( "create index m_raw on messages(raw)" );
+    return true;
+}
+
+
+/*! Adds bodyparts.compression, so that bodyparts.data can be stored
+    compressed, and teaches store_bodyparts() about it.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding compression of bodyparts." );
+    d->t->enqueue( "alter table bodyparts add compression integer" );
+    d->t->enqueue( "create or replace function store_bodyparts() "
+                   "returns setof integer as $$ "
+                   "declare "
+                   "r integer; "
+                   "begin "
+                   "update bp set bid=b.id from bodyparts b "
+                   "where bp.hash=b.hash "
+                   "and not bp.text is distinct from b.text "
+                   "and not bp.data is distinct from b.data "
+                   "and not bp.compression is distinct from b.compression; "
+                   "update bp set bid=nextval('bodypart_ids')::int, n='t' "
+                   "where bid is null; "
+                   "insert into bodyparts "
+                   "(id,bytes,hash,text,data,compression) "
+                   "select bid,bytes,hash,text,data,compression "
+                   "from bp where n; "
+                   "for r in select bid from bp order by i loop "
+                   "return next r; "
+                   "end loop; "
+                   "return; "
+                   "end;$$ language plpgsql" );
+    return true;
+}
+
+
+/*! Adds bodyparts.external, so that large bodyparts can be stored in
+    the blob-directory, and teaches store_bodyparts() about it.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Adding external storage of bodyparts." );
+    d->t->enqueue( "alter table bodyparts add external boolean" );
+    d->t->enqueue( "create or replace function store_bodyparts() "
+                   "returns setof integer as $$ "
+                   "declare "
+                   "r integer; "
+                   "begin "
+                   "update bp set bid=b.id from bodyparts b "
+                   "where bp.hash=b.hash "
+                   "and not bp.text is distinct from b.text "
+                   "and not bp.data is distinct from b.data "
+                   "and not bp.compression is distinct from b.compression "
+                   "and not bp.external is distinct from b.external; "
+                   "update bp set bid=nextval('bodypart_ids')::int, n='t' "
+                   "where bid is null; "
+                   "insert into bodyparts "
+                   "(id,bytes,hash,text,data,compression,external) "
+                   "select bid,bytes,hash,text,data,compression,external "
+                   "from bp where n; "
+                   "for r in select bid from bp order by i loop "
+                   "return next r; "
+                   "end loop; "
+                   "return; "
+                   "end;$$ language plpgsql" );
+    return true;
+}
+
+
+/*! Replaces store_bodyparts() with a function which takes the
+    bodyparts as arrays, so that the Injector needn't create, fill and
+    drop a temporary table for each injection.
+*/
+
+bool Schema::stepTo104()
+{
+    describeStep( "Passing bodyparts to store_bodyparts() as arrays." );
+    d->t->enqueue( "drop function store_bodyparts()" );
+    d->t->enqueue( "create function store_bodyparts("
+                   "integer[], text[], text[], bytea[], integer[], "
+                   "boolean[]) "
+                   "returns setof integer as $$ "
+                   "with p as (select i, $1[i] as bytes, $2[i] as hash, "
+                   "$3[i] as text, $4[i] as data, $5[i] as compression, "
+                   "$6[i] as external "
+                   "from generate_subscripts($2,1) i), "
+                   "e as (select p.i, (select b.id from bodyparts b "
+                   "where b.hash=p.hash "
+                   "and not b.text is distinct from p.text "
+                   "and not b.data is distinct from p.data "
+                   "and not b.compression is distinct from p.compression "
+                   "and not b.external is distinct from p.external "
+                   "limit 1) as id from p), "
+                   "n as (select i, nextval('bodypart_ids')::int as id "
+                   "from e where id is null), "
+                   "s as (insert into bodyparts "
+                   "(id,bytes,hash,text,data,compression,external) "
+                   "select n.id,p.bytes,p.hash,p.text,p.data,"
+                   "p.compression,p.external "
+                   "from n join p on (n.i=p.i)) "
+                   "select coalesce(e.id,n.id) from e "
+                   "left join n on (e.i=n.i) order by e.i "
+                   "$$ language sql" );
+    return true;
+}
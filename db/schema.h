@@ -122,6 +122,13 @@ private:
     bool stepTo95();
     bool stepTo96();
     bool stepTo97();
+    bool stepTo98();
+    bool stepTo99();
+    bool stepTo100();
+    bool stepTo101();
+    bool stepTo102();
+    bool stepTo103();
+    bool stepTo104();
 
     void describeStep( const EString & );
 };
@@ -13,11 +13,13 @@
 #include "transaction.h"
 #include "imapsession.h"
 #include "mailboxgroup.h"
+#include "imapstructure.h"
 
 // Keep these alphabetical.
 #include "handlers/acl.h"
 #include "handlers/append.h"
 #include "handlers/authenticate.h"
+#include "handlers/cancelupdate.h"
 #include "handlers/capability.h"
 #include "handlers/close.h"
 #include "handlers/compress.h"
@@ -35,6 +37,7 @@
 #include "handlers/logout.h"
 #include "handlers/lsub.h"
 #include "handlers/move.h"
+#include "handlers/multisearch.h"
 #include "handlers/namespace.h"
 #include "handlers/notify.h"
 #include "handlers/noop.h"
@@ -262,6 +265,8 @@ Command * Command::create( IMAP * imap,
             c = new GetQuotaRoot();
         else if ( n == "setquotaroot" )
             c = new SetQuotaRoot();
+        else if ( n == "esearch" )
+            c = new MultiSearch;
 
         if ( c ) {
             authenticated = true;
@@ -292,6 +297,8 @@ Command * Command::create( IMAP * imap,
             c = new Sort( uid );
         else if ( n == "move" )
             c = new Move( uid );
+        else if ( n == "cancelupdate" )
+            c = new CancelUpdate;
 
         if ( c )
             selected = true;
@@ -1146,41 +1153,17 @@ const EString Command::following() const
     recover \a s. The quoted string fits the IMAP productions astring,
     nstring or string, depending on \a mode. The default is string.
 
-    We avoid using the escape characters and unusual atoms. "\"" is a
-    legal one-character string. But we're easy on the poor client
-    parser, and we make life easy for ourselves too.
+    ImapStructure::quoted() does the work, except for astring.
 */
 
 EString Command::imapQuoted( const EString & s, const QuoteMode mode )
 {
-    // if we're asked for an nstring, NIL may do
-    if ( mode == NString && s.isEmpty() )
-        return "NIL";
-
     // if the string is really boring and we can send an atom, we do
     if ( mode == AString && s.boring() &&
          !( s.length() == 3 && s.lower() == "nil" ) )
         return s;
 
-    // will quoted do?
-    uint i = 0;
-    while ( i < s.length() &&
-            s[i] >= ' ' && s[i] < 128 &&
-            s[i] != '\\' && s[i] != '"' )
-        i++;
-    if ( i >= s.length() ) // yes
-        return s.quoted( '"' );
-
-    EString r;
-    r.reserve( s.length() + 20 );
-    // if there's a null byte, we need to send a literal8
-    if ( s.contains( 0 ) )
-        r.append( '~' );
-    r.append( '{' );
-    r.appendNumber( s.length() );
-    r.append( "}\r\n" );
-    r.append( s );
-    return r;
+    return ImapStructure::quoted( s, mode == NString );
 }
 
 
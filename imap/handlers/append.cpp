@@ -328,6 +328,8 @@ void Append::execute()
         return;
 
     if ( d->injector->failed() ) {
+        if ( d->injector->overQuota() )
+            setRespTextCode( "OVERQUOTA" );
         error( No, "Could not append to " + d->mailbox->name().ascii() );
         return;
     }
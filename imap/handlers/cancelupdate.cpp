@@ -0,0 +1,39 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "cancelupdate.h"
+
+#include "imapsession.h"
+
+
+/*! \class CancelUpdate cancelupdate.h
+
+    The CancelUpdate class implements the CANCELUPDATE command from
+    RFC 5267, which tells the server to stop sending updates about a
+    SEARCH RETURN (UPDATE). See SearchContext.
+*/
+
+
+void CancelUpdate::parse()
+{
+    while ( ok() && nextChar() == ' ' ) {
+        space();
+        tags.append( string() );
+    }
+    if ( tags.isEmpty() )
+        error( Bad, "Need at least one tag" );
+    end();
+}
+
+
+void CancelUpdate::execute()
+{
+    if ( state() != Executing )
+        return;
+
+    EStringList::Iterator t( tags );
+    while ( t ) {
+        session()->removeSearchContext( *t );
+        ++t;
+    }
+    finish();
+}
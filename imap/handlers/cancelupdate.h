@@ -0,0 +1,22 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef CANCELUPDATE_H
+#define CANCELUPDATE_H
+
+#include "command.h"
+#include "estringlist.h"
+
+
+class CancelUpdate
+    : public Command
+{
+public:
+    void parse();
+    void execute();
+
+private:
+    EStringList tags;
+};
+
+
+#endif
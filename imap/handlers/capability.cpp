@@ -43,9 +43,12 @@
     RFC 5256: SORT,
     RFC 5257: ANNOTATE-EXPERIMENT-1,
     RFC 5258: LISTEXT,
+    RFC 5267: CONTEXT=SEARCH, CONTEXT=SORT, ESORT,
     RFC 5465: NOTIFY,
     RFC 6855: UTF=ACCEPT,
-    RFC 7162: QRESYNC.
+    RFC 7162: QRESYNC,
+    RFC 7377: MULTISEARCH,
+    RFC 9394: PARTIAL.
 */
 
 void Capability::execute()
@@ -86,11 +89,15 @@ EString Capability::capabilities( IMAP * i, bool all )
     }
     if ( i->readBuffer()->compression() == Buffer::None )
         c.append( "COMPRESS=DEFLATE" );
-    if ( all || login )
+    if ( all || login ) {
         c.append( "CONDSTORE" );
+        c.append( "CONTEXT=SEARCH" );
+        c.append( "CONTEXT=SORT" );
+    }
     c.append( "ENABLE" );
     if ( all || login ) {
         c.append( "ESEARCH" );
+        c.append( "ESORT" );
         c.append( "I18NLEVEL=1" );
     }
     c.append( "ID" );
@@ -105,8 +112,10 @@ EString Capability::capabilities( IMAP * i, bool all )
     if ( all || login ) {
         c.append( "MOVE" );
         c.append( "MULTIAPPEND" );
+        c.append( "MULTISEARCH" );
         c.append( "NAMESPACE" );
         //c.append( "NOTIFY" );
+        c.append( "PARTIAL" );
     }
     if ( all || login ) {
         if ( Configuration::toggle( Configuration::UseImapQuota ) )
@@ -123,6 +132,7 @@ EString Capability::capabilities( IMAP * i, bool all )
     if ( Configuration::toggle( Configuration::UseTls ) && !i->hasTls() )
         c.append( "STARTTLS" );
     if ( all || login ) {
+        c.append( "STATUS=SIZE" );
         c.append( "THREAD=ORDEREDSUBJECT" );
         c.append( "THREAD=REFS" );
         c.append( "THREAD=REFERENCES" );
@@ -134,90 +134,67 @@ void Copy::execute()
         if ( !d->toMs )
             error( No, "Could not allocate UID and modseq in target mailbox" );
 
-        Query * q;
-
-        q = new Query( "create temporary table t ("
-                       "mailbox integer,"
-                       "uid integer,"
-                       "message integer,"
-                       "nuid integer,"
-                       "seen boolean"
-                       ")", 0 );
-        transaction()->enqueue( q );
-
-        q = new Query( "create temporary sequence s start " + fn( d->toUid ),
-                       0 );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into t "
-                       "(mailbox, uid, message, nuid, seen) "
-                       "select mailbox, uid, message, nextval('s'), seen "
-                       "from mailbox_messages "
-                       "where mailbox=$1 and uid=any($2) order by uid", 0 );
-        q->bind( 1, session()->mailbox()->id() );
-        q->bind( 2, d->set );
-        transaction()->enqueue( q );
-
-        q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
-                       "where id=$2",
-                       this );
-        q->bind( 1, d->toMs+1 );
-        q->bind( 2, d->mailbox->id() );
-        transaction()->enqueue( q );
-
-        transaction()->enqueue( new Query( "drop sequence s", 0 ) );
-
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox, uid, message, modseq, seen, deleted) "
-                       "select $1, t.nuid, message, $2, t.seen, false "
-                       "from t", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, d->toMs );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into flags "
-                       "(mailbox, uid, flag) "
-                       "select $1, t.nuid, f.flag "
-                       "from flags f join t using (mailbox, uid)", 0 );
-        q->bind( 1, d->mailbox->id() );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into annotations "
-                       "(mailbox, uid, owner, name, value) "
-                       "select $1, t.nuid, a.owner, a.name, a.value "
-                       "from annotations a join t using (mailbox, uid) "
-                       "where a.owner is null or a.owner=$2", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, imap()->user()->id() );
-        transaction()->enqueue( q );
-
-        d->report = new Query( "select uid, nuid from t", 0 );
+        // a single statement, so that every part sees the same
+        // source rows and no temporary table or sequence is needed.
+        // t assigns consecutive UIDs from uidnext in source order,
+        // and the other parts are executed whether used or not.
+        EString s( "with t as ("
+                   "select mailbox, uid, message, seen, "
+                   "($3::integer+row_number() over (order by uid)-1)::integer "
+                   "as nuid "
+                   "from mailbox_messages "
+                   "where mailbox=$1 and uid=any($2)), "
+                   "mm as ("
+                   "insert into mailbox_messages "
+                   "(mailbox, uid, message, modseq, seen, deleted) "
+                   "select $4, nuid, message, $5, seen, false from t), "
+                   "fl as ("
+                   "insert into flags (mailbox, uid, flag) "
+                   "select $4, t.nuid, f.flag "
+                   "from flags f join t using (mailbox, uid)), "
+                   "an as ("
+                   "insert into annotations "
+                   "(mailbox, uid, owner, name, value) "
+                   "select $4, t.nuid, a.owner, a.name, a.value "
+                   "from annotations a join t using (mailbox, uid) "
+                   "where a.owner is null or a.owner=$6), "
+                   "mb as ("
+                   "update mailboxes "
+                   "set uidnext=$3::integer+(select count(*) from t)::integer, "
+                   "nextmodseq=$5+1 "
+                   "where id=$4) " );
+        if ( d->move )
+            s.append( ", dm as ("
+                      "insert into deleted_messages "
+                      "(mailbox,uid,message,modseq,deleted_by,reason) "
+                      "select $1, t.uid, t.message, $7, $6, "
+                      " 'moved to mailbox '||$8||' uid '||t.nuid "
+                      "from t) " );
+        s.append( "select uid, nuid from t" );
+
+        d->report = new Query( s, 0 );
+        d->report->bind( 1, session()->mailbox()->id() );
+        d->report->bind( 2, d->set );
+        d->report->bind( 3, d->toUid );
+        d->report->bind( 4, d->mailbox->id() );
+        d->report->bind( 5, d->toMs );
+        d->report->bind( 6, imap()->user()->id() );
+        if ( d->move ) {
+            d->report->bind( 7, d->fromMs );
+            d->report->bind( 8, d->mailbox->name() );
+        }
         transaction()->enqueue( d->report );
 
         if ( d->move ) {
-            q = new Query(
-                "insert into deleted_messages "
-                "(mailbox,uid,message,modseq,deleted_by,reason) "
-                "select $1, t.uid, t.message, $2, $3, "
-                " 'moved to mailbox '||$4||' uid '||t.nuid "
-                "from t", 0 );
-            q->bind( 1, session()->mailbox()->id() );
-            q->bind( 2, d->fromMs );
-            q->bind( 3, imap()->user()->id() );
-            q->bind( 4, d->mailbox->name() );
-            transaction()->enqueue( q );
-            q = new Query( "update mailboxes "
-                           "set nextmodseq=$1 "
-                           "where id=$2",
-                           0 );
+            Query * q = new Query( "update mailboxes "
+                                   "set nextmodseq=$1 "
+                                   "where id=$2",
+                                   0 );
             q->bind( 1, d->fromMs+1 );
             q->bind( 2, session()->mailbox()->id() );
             transaction()->enqueue( q );
         }
 
-        transaction()->enqueue( new Query( "drop table t", 0 ) );
-
         Mailbox::refreshMailboxes( transaction() );
 
         transaction()->commit();
@@ -18,6 +18,7 @@
 #include "section.h"
 #include "listext.h"
 #include "fetcher.h"
+#include "imapstructure.h"
 #include "iso8859.h"
 #include "codec.h"
 #include "query.h"
@@ -33,6 +34,16 @@
 
 
 
+// section data at least this large is sent as a separate literal,
+// see ImapFetchResponse::nextPiece().
+static const uint largeLiteral = 16384;
+
+// EString::e64() puts 18 groups of four characters on each line, so
+// each base64 line is 72 characters plus CRLF and encodes 54 bytes.
+static const uint base64Line = 74;
+static const uint base64Bytes = 54;
+
+
 static const char * legalAnnotationAttributes[] = {
     "value",
     "value.priv",
@@ -60,8 +71,12 @@ public:
           databaseId( false ), threadId( false ), vanished( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          needsStructures( false ), needsRawText( false ),
+          headerPrefix( false ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
-          annotationFetcher( 0 ), modseqFetcher( 0 )
+          annotationFetcher( 0 ), modseqFetcher( 0 ),
+          pushedDown( false ), fallbackChecked( false ),
+          sessionChecked( false ), fromSession( false )
     {}
 
     int state;
@@ -98,6 +113,20 @@ public:
     bool needsBody;
     bool needsPartNumbers;
 
+    // envelope/body[structure] from message_structures, and the
+    // messages for which nothing is stored there
+    bool needsStructures;
+    IntegerSet unstructured;
+
+    // the whole text from raw_messages, and the messages for which
+    // nothing is stored there
+    bool needsRawText;
+    IntegerSet unraw;
+
+    // BODY[]<offset.length> from the header alone, if the range lies
+    // within it. the messages for which it doesn't go in fallback.
+    bool headerPrefix;
+
     EStringList entries;
     EStringList attribs;
 
@@ -109,12 +138,34 @@ public:
         int64 modseq;
         Dict<EString> flags;
         List<Annotation> annotations;
+        Map<EString> sections;
     };
     Map<DynamicData> dynamics;
     Query * seenDeletedFetcher;
     Query * flagFetcher;
     Query * annotationFetcher;
     Query * modseqFetcher;
+    List<Fetcher> fetchers;
+
+    // sections answered directly from the bodyparts table
+    class PartialFetch
+        : public Garbage
+    {
+    public:
+        PartialFetch( Section * section, uint n, Query * query )
+            : s( section ), index( n ), q( query ) {}
+        Section * s;
+        uint index;
+        Query * q;
+    };
+    bool pushedDown;
+    List<PartialFetch> partialFetches;
+    bool fallbackChecked;
+    IntegerSet fallback;
+
+    // flags and modseq answered from the Session's copy
+    bool sessionChecked;
+    bool fromSession;
 };
 
 
@@ -240,11 +291,48 @@ void Fetch::parse()
         require( ")" );
     }
     end();
-    if ( d->envelope ) {
+    List<Section>::Iterator it( d->sections );
+    while ( it && canUseRawText( it ) )
+        ++it;
+    if ( !d->sections.isEmpty() && !it ) {
+        // every section is the whole message or its header/text, so
+        // we can send the stored original. see sendRawTextQueries().
+        d->needsRawText = true;
+    }
+    it = d->sections.first();
+    while ( it ) {
+        if ( canPushDown( it ) ) {
+            d->pushedDown = true;
+        }
+        else if ( d->needsRawText ) {
+            // nothing needed unless the original isn't stored
+        }
+        else if ( canUseHeader( it ) ) {
+            d->headerPrefix = true;
+            d->needsAddresses = true;
+            d->needsHeader = true;
+        }
+        else {
+            if ( it->needsAddresses )
+                d->needsAddresses = true;
+            if ( it->needsHeader )
+                d->needsHeader = true;
+            if ( it->needsBody )
+                d->needsBody = true;
+        }
+        ++it;
+    }
+    if ( ( d->envelope || d->body || d->bodystructure ) &&
+         !imap()->clientSupports( IMAP::Unicode ) ) {
+        // the Injector stores these, so we usually needn't look at
+        // the header fields and bodyparts. see sendStructureQueries().
+        d->needsStructures = true;
+    }
+    else if ( d->envelope ) {
         d->needsHeader = true;
         d->needsAddresses = true;
     }
-    if ( d->body || d->bodystructure ) {
+    if ( ( d->body || d->bodystructure ) && !d->needsStructures ) {
         // message/rfc822 body[structure] includes envelope in some
         // cases, so we need both here too.
         d->needsHeader = true;
@@ -270,8 +358,12 @@ void Fetch::parse()
         l.append( "trivia" );
     if ( d->needsPartNumbers )
         l.append( "bytes/lines" );
+    if ( d->needsRawText )
+        l.append( "raw" );
     if ( d->annotation )
         l.append( "annotations" );
+    if ( d->pushedDown )
+        l.append( "partial" );
     log( l.join( " " ) );
 }
 
@@ -316,18 +408,18 @@ void Fetch::parseAttribute( bool alsoMacro )
     }
     else if ( keyword == "rfc822" ) {
         d->peek = false;
-        d->needsAddresses = true;
-        d->needsHeader = true;
-        d->needsBody = true;
         Section * s = new Section;
         s->id = keyword;
+        s->needsAddresses = true;
+        s->needsHeader = true;
+        s->needsBody = true;
         d->sections.append( s );
     }
     else if ( keyword == "rfc822.header" ) {
-        d->needsAddresses = true;
-        d->needsHeader = true;
         Section * s = new Section;
         s->id = keyword;
+        s->needsAddresses = true;
+        s->needsHeader = true;
         d->sections.append( s );
     }
     else if ( keyword == "rfc822.size" ) {
@@ -340,10 +432,10 @@ void Fetch::parseAttribute( bool alsoMacro )
     }
     else if ( keyword == "rfc822.text" ) {
         d->peek = false;
-        d->needsHeader = true;
-        d->needsBody = true;
         Section * s = new Section;
         s->id = keyword;
+        s->needsHeader = true;
+        s->needsBody = true;
         d->sections.append( s );
     }
     else if ( keyword == "body.peek" && nextChar() == '[' ) {
@@ -545,12 +637,62 @@ void Fetch::parseBody( bool binary )
     }
 
     d->sections.append( s );
-    if ( s->needsAddresses )
-        d->needsAddresses = true;
-    if ( s->needsHeader )
-        d->needsHeader = true;
-    if ( s->needsBody )
-        d->needsBody = true;
+}
+
+
+/*! Returns true if \a s can be answered by selecting (part of) a
+    single bodyparts row instead of fetching and reassembling the
+    entire message, and false if not.
+
+    That's the case for BINARY[part], BINARY[part]<offset.length>,
+    BINARY.SIZE[part] and BODY[part]<offset.length> when the part is a
+    leaf whose decoded content is stored verbatim and uncompressed, so
+    the database can cut out the requested range. For BODY, the part
+    must also not be quoted-printable, since the length of its
+    encoded form cannot be predicted.
+    sendPartialQueries() checks the latter conditions, the rest is
+    checked here.
+*/
+
+bool Fetch::canPushDown( Section * s )
+{
+    if ( s->part.isEmpty() )
+        return false;
+    if ( s->partial && s->offset >= INT_MAX )
+        return false;
+    if ( !s->binary )
+        return s->partial && s->id.isEmpty();
+    return s->id.isEmpty() || s->id == "size";
+}
+
+
+/*! Returns true if \a s is BODY[]<offset.length>, which can be
+    answered from the message's header alone if the requested range
+    lies within the header, and false if not.
+*/
+
+bool Fetch::canUseHeader( Section * s )
+{
+    return !s->binary && s->part.isEmpty() && s->id.isEmpty() &&
+        s->partial;
+}
+
+
+/*! Returns true if \a s can be answered from the original text of
+    the message, as stored in raw_messages, and false if not.
+
+    That's the case for the entire message (BODY[] and RFC822), its
+    header (BODY[HEADER] and RFC822.HEADER) and its text (BODY[TEXT]
+    and RFC822.TEXT), partial or not.
+*/
+
+bool Fetch::canUseRawText( Section * s )
+{
+    if ( s->binary || !s->part.isEmpty() )
+        return false;
+    return s->id.isEmpty() ||
+        s->id == "rfc822" || s->id == "rfc822.header" ||
+        s->id == "rfc822.text" || s->id == "header" || s->id == "text";
 }
 
 
@@ -669,9 +811,16 @@ void Fetch::execute()
         d->peek = true;
 
     if ( d->state == 0 ) {
+        if ( !d->sessionChecked ) {
+            d->sessionChecked = true;
+            d->fromSession = sessionKnowsFlags();
+        }
+
         if ( !transaction() &&
              ( !d->peek ||
-               ( d->modseq && ( d->flags || d->annotation || d->vanished ) ) ) )
+               ( d->modseq &&
+                 ( ( !d->fromSession && ( d->flags || d->annotation ) ) ||
+                   d->vanished ) ) ) )
             setTransaction( new Transaction( this ) );
 
         if ( d->vanished && d->changedSince > 0 && !d->deleted ) {
@@ -690,7 +839,16 @@ void Fetch::execute()
         Mailbox * mb = s->mailbox();
         if ( !d->those ) {
             d->set = d->set.intersection( session()->messages() );
-            if ( d->changedSince ) {
+            if ( d->changedSince && d->fromSession ) {
+                IntegerSet r( d->set );
+                while ( !r.isEmpty() ) {
+                    uint uid = r.smallest();
+                    r.remove( uid );
+                    if ( s->modSeq( uid ) <= d->changedSince )
+                        d->set.remove( uid );
+                }
+            }
+            if ( d->changedSince && !d->fromSession ) {
                 d->those = new Query( "select uid, message "
                                       "from mailbox_messages "
                                       "where mailbox=$1 and uid=any($2) "
@@ -699,7 +857,8 @@ void Fetch::execute()
                 d->those->bind( 1, s->mailbox()->id() );
                 d->those->bind( 2, d->set );
             }
-            else if ( d->modseq ||
+            else if ( ( d->modseq && !d->fromSession ) || d->pushedDown ||
+                      d->needsRawText ||
                       d->needsAddresses || d->needsHeader ||
                       d->needsBody || d->needsPartNumbers ||
                       d->rfc822size || d->internaldate ||
@@ -709,10 +868,10 @@ void Fetch::execute()
                 while ( !s.isEmpty() ) {
                     uint uid = s.smallest();
                     s.remove( uid );
-                    Message * m = MessageCache::find( mb, uid );
-                    if ( m )
-                        d->messages.insert( uid, m );
-                    if ( !m || !m->databaseId() || d->modseq )
+                    Message * m = MessageCache::provide( mb, uid );
+                    d->messages.insert( uid, m );
+                    if ( !m->databaseId() ||
+                         ( d->modseq && !d->fromSession ) )
                         r.add( uid );
                 }
                 if ( !r.isEmpty() ) {
@@ -725,9 +884,9 @@ void Fetch::execute()
                 }
             }
             if ( d->those ) {
-                if ( d->changedSince )
+                if ( d->changedSince && !d->fromSession )
                     d->those->bind( 3, d->changedSince );
-                if ( d->modseq ) {
+                if ( d->modseq && !d->fromSession ) {
                     if ( !d->peek ) {
                         // if we aren't peeking, then we have to lock
                         // the mailbox before we lock the messages,
@@ -797,6 +956,7 @@ void Fetch::execute()
             d->expunged = s->expunged().intersection( d->set );
         shrink( &d->set );
         d->remaining = d->set;
+        MessageCache::protect( s->mailbox(), d->set );
         d->state = 2;
         if ( d->set.isEmpty() ) {
             d->state = 5;
@@ -830,12 +990,16 @@ void Fetch::execute()
 
     if ( d->state == 3 ) {
         d->state = 4;
+        if ( d->pushedDown )
+            sendPartialQueries();
         sendFetchQueries();
-        if ( d->flags )
+        if ( d->fromSession )
+            copySessionFlags();
+        else if ( d->flags )
             sendFlagQuery();
         if ( d->annotation )
             sendAnnotationsQuery();
-        if ( d->modseq )
+        if ( d->modseq && !d->fromSession )
             sendModSeqQuery();
         if ( transaction() )
             transaction()->commit();
@@ -844,11 +1008,31 @@ void Fetch::execute()
     if ( d->state < 4 )
         return;
 
+    List<Fetcher>::Iterator f( d->fetchers );
+    while ( f && !f->failed() )
+        ++f;
+    if ( f ) {
+        // the messages are marked as fetched, but aren't complete, so
+        // make sure the next command doesn't use what's cached
+        uint i = 1;
+        while ( i <= d->set.count() ) {
+            uint uid = d->set.value( i );
+            ++i;
+            if ( d->messages.find( uid ) )
+                MessageCache::insert( s->mailbox(), uid, new Message );
+        }
+        MessageCache::release( s->mailbox(), d->set );
+        error( No, f->error() );
+        return;
+    }
+
     pickup();
 
     if ( d->processed < d->set.largest() )
         return;
 
+    MessageCache::release( s->mailbox(), d->set );
+
     if ( !d->expunged.isEmpty() ) {
         s->recordExpungedFetch( d->expunged );
         error( No, "UID(s) " + d->expunged.set() + " has/have been expunged" );
@@ -867,6 +1051,8 @@ void Fetch::sendFetchQueries()
     bool haveBody = true;
     bool havePartNumbers = true;
     bool haveTrivia = true;
+    bool haveStructures = true;
+    bool haveRawText = true;
 
     List<Message> * l = new List<Message>;
 
@@ -884,6 +1070,10 @@ void Fetch::sendFetchQueries()
             haveBody = false;
         if ( !m->hasTrivia() )
             haveTrivia = false;
+        if ( !m->hasImapStructures() )
+            haveStructures = false;
+        if ( !m->hasRawText() )
+            haveRawText = false;
         l->append( m );
     }
 
@@ -899,6 +1089,235 @@ void Fetch::sendFetchQueries()
         f->fetch( Fetcher::Trivia );
     if ( d->needsPartNumbers && !havePartNumbers )
         f->fetch( Fetcher::PartNumbers );
+    if ( d->needsStructures && !haveStructures )
+        f->fetch( Fetcher::Structures );
+    if ( d->needsRawText && !haveRawText )
+        f->fetch( Fetcher::RawText );
+    d->fetchers.append( f );
+    f->execute();
+}
+
+
+/*! Looks for messages for which no ENVELOPE and BODYSTRUCTURE are
+    stored (e.g. because they were injected before the server stored
+    those, and haven't been backfilled by "aox reparse"), and starts
+    fetching what's needed to compute them.
+*/
+
+void Fetch::sendStructureQueries()
+{
+    List<Message> * l = new List<Message>;
+    uint i = 1;
+    uint n = d->remaining.count();
+    while ( i <= n ) {
+        uint uid = d->remaining.value( i );
+        ++i;
+        Message * m = d->messages.find( uid );
+        if ( m && m->hasImapStructures() &&
+             m->imapEnvelope().isEmpty() &&
+             !d->unstructured.contains( uid ) ) {
+            d->unstructured.add( uid );
+            if ( !m->hasAddresses() || !m->hasHeaders() ||
+                 !m->hasBytesAndLines() )
+                l->append( m );
+        }
+    }
+
+    if ( l->isEmpty() )
+        return;
+
+    log( "Computing ENVELOPE/BODYSTRUCTURE for " + fn( l->count() ) +
+         " messages", Log::Debug );
+    Fetcher * f = new Fetcher( l, this, imap() );
+    f->fetch( Fetcher::Addresses );
+    f->fetch( Fetcher::OtherHeader );
+    f->fetch( Fetcher::PartNumbers );
+    d->fetchers.append( f );
+    f->execute();
+}
+
+
+/*! Looks for messages whose original text isn't stored (because
+    they were injected before store-raw-messages was enabled, or could
+    not be stored as they were), and starts fetching what's needed to
+    reassemble them instead.
+*/
+
+void Fetch::sendRawTextQueries()
+{
+    List<Message> * l = new List<Message>;
+    uint i = 1;
+    uint n = d->remaining.count();
+    while ( i <= n ) {
+        uint uid = d->remaining.value( i );
+        ++i;
+        Message * m = d->messages.find( uid );
+        if ( m && m->hasRawText() && m->rawText().isEmpty() &&
+             !d->unraw.contains( uid ) ) {
+            d->unraw.add( uid );
+            if ( !m->hasAddresses() || !m->hasHeaders() ||
+                 !m->hasBodies() )
+                l->append( m );
+        }
+    }
+
+    if ( l->isEmpty() )
+        return;
+
+    Fetcher * f = new Fetcher( l, this, imap() );
+    f->fetch( Fetcher::Addresses );
+    f->fetch( Fetcher::OtherHeader );
+    f->fetch( Fetcher::Body );
+    d->fetchers.append( f );
+    f->execute();
+}
+
+
+/*! Issues one query for each section which canPushDown(), to
+    retrieve just the requested bytes (or the size) from the bodyparts
+    table. Messages for which that isn't possible, e.g. because the
+    part is text or has children, are fetched in full afterwards.
+*/
+
+void Fetch::sendPartialQueries()
+{
+    uint n = 0;
+    List<Section>::Iterator s( d->sections );
+    while ( s ) {
+        if ( canPushDown( s ) ) {
+            EString from(
+                "from mailbox_messages mm "
+                "join part_numbers pn on (mm.message=pn.message) "
+                "join bodyparts bp on (pn.bodypart=bp.id) "
+                "where mm.mailbox=$1 and mm.uid=any($2) and pn.part=$3 "
+                "and bp.text is null and bp.data is not null "
+                "and bp.compression is null "
+                "and not exists (select 1 from part_numbers c "
+                "where c.message=pn.message and c.part=pn.part||'.1')" );
+            Query * q = 0;
+            if ( s->binary ) {
+                EString what = "bp.data";
+                if ( s->id == "size" )
+                    what = "octet_length(bp.data) as size";
+                else if ( s->partial )
+                    what = "substring(bp.data from $4 for $5) as data";
+                q = new Query( "select mm.uid, " + what + " " + from,
+                               this );
+            }
+            else {
+                // BODY[part]<offset.length> wants the encoded content.
+                // the top-level header stands in for that of part 1 in
+                // a single-part message, see Injector::insertMessages().
+                // quoted-printable parts are left to the fallback, and
+                // for base64 we select whole lines' worth of data, see
+                // pickup().
+                q = new Query(
+                    "select uid, cte, case "
+                    "when cte='quoted-printable' then null "
+                    "when cte='base64' then substring(data from $6 for $7) "
+                    "else substring(data from $4 for $5) end as data "
+                    "from (select mm.uid, bp.data, "
+                    "(select lower(hf.value) from header_fields hf "
+                    "where hf.message=pn.message "
+                    "and hf.field=" +
+                    fn( HeaderField::ContentTransferEncoding ) + " "
+                    "and (hf.part=pn.part or (hf.part='' and pn.part='1')) "
+                    "order by hf.part desc limit 1) as cte " +
+                    from + ") x",
+                    this );
+            }
+            q->bind( 1, session()->mailbox()->id() );
+            q->bind( 2, d->set );
+            q->bind( 3, s->part );
+            if ( s->id.isEmpty() && s->partial ) {
+                q->bind( 4, s->offset + 1 );
+                uint l = s->length;
+                if ( l > INT_MAX )
+                    l = INT_MAX;
+                q->bind( 5, l );
+                if ( !s->binary ) {
+                    uint first = s->offset / base64Line;
+                    uint last = first;
+                    if ( l )
+                        last = ( s->offset + l - 1 ) / base64Line;
+                    q->bind( 6, first * base64Bytes + 1 );
+                    q->bind( 7, ( last + 1 - first ) * base64Bytes );
+                }
+            }
+            enqueue( q );
+            d->partialFetches.append(
+                new FetchData::PartialFetch( s, n, q ) );
+        }
+        ++n;
+        ++s;
+    }
+}
+
+
+/*! Starts fetching whatever's needed for the sections which could not
+    be answered by sendPartialQueries(), for the messages in
+    d->fallback.
+*/
+
+void Fetch::sendFallbackQueries()
+{
+    List<Message> * l = new List<Message>;
+    IntegerSet r( d->fallback );
+    while ( !r.isEmpty() ) {
+        uint uid = r.smallest();
+        r.remove( uid );
+        Message * m = d->messages.find( uid );
+        if ( m )
+            l->append( m );
+    }
+
+    Fetcher * f = new Fetcher( l, this, imap() );
+    f->fetch( Fetcher::Addresses );
+    f->fetch( Fetcher::OtherHeader );
+    f->fetch( Fetcher::Body );
+    d->fetchers.append( f );
+    f->execute();
+}
+
+
+/*! Looks for messages whose header has been fetched, but doesn't
+    contain all of a BODY[]<offset.length> section, and starts fetching
+    their bodies so the sections can be answered from the entire
+    message.
+*/
+
+void Fetch::sendBodyQueries()
+{
+    bool unicode = imap()->clientSupports( IMAP::Unicode );
+    List<Message> * l = new List<Message>;
+    uint i = 1;
+    uint n = d->remaining.count();
+    while ( i <= n ) {
+        uint uid = d->remaining.value( i );
+        ++i;
+        Message * m = d->messages.find( uid );
+        if ( !m || !m->hasHeaders() || !m->hasAddresses() ||
+             m->hasBodies() || d->fallback.contains( uid ) )
+            continue;
+        uint h = m->header()->asText( !unicode ).length() + 2;
+        List<Section>::Iterator s( d->sections );
+        while ( s && ( !canUseHeader( s ) ||
+                       ( s->offset <= h && s->length <= h - s->offset ) ) )
+            ++s;
+        if ( s ) {
+            d->fallback.add( uid );
+            l->append( m );
+        }
+    }
+
+    if ( l->isEmpty() )
+        return;
+
+    log( "Fetching " + fn( l->count() ) +
+         " messages whose header is too short", Log::Debug );
+    Fetcher * f = new Fetcher( l, this, imap() );
+    f->fetch( Fetcher::Body );
+    d->fetchers.append( f );
     f->execute();
 }
 
@@ -914,7 +1333,30 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 {
     EString item, data;
 
-    if ( s->id == "rfc822" ) {
+    EString raw;
+    if ( canUseRawText( s ) )
+        raw = m->rawText();
+
+    if ( !raw.isEmpty() ) {
+        // the original is stored, and it's all ASCII where it matters
+        int e = raw.find( "\r\n\r\n" );
+        if ( e < 0 )
+            e = raw.length();
+        else
+            e += 4;
+        if ( s->id == "rfc822.header" || s->id == "header" )
+            data = raw.mid( 0, e );
+        else if ( s->id == "rfc822.text" || s->id == "text" )
+            data = raw.mid( e );
+        else
+            data = raw;
+        if ( s->id.startsWith( "rfc822" ) )
+            item = s->id.upper();
+        else
+            item = "BODY[" + s->id.upper() + "]";
+    }
+
+    else if ( s->id == "rfc822" ) {
         item = s->id.upper();
         data = m->rfc822( !unicodable );
     }
@@ -1000,6 +1442,12 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
             item = "BINARY.SIZE[]";
             data = fn( m->rfc822Size() );
         }
+        else if ( s->partial && !m->hasBodies() ) {
+            // sendBodyQueries() made sure the header suffices
+            item = "BODY[]";
+            data = m->header()->asText( !unicodable );
+            data.append( "\r\n" );
+        }
         else {
             item = "BODY[]";
             data = m->rfc822( !unicodable );
@@ -1076,22 +1524,83 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 }
 
 
+/* Appends \a data to \a r as an nstring. If \a literal is non-null
+   and \a data is large, this appends only the literal's length and
+   sets *\a literal to \a data, so the caller can send it separately
+   instead of copying it.
+*/
+
+static void appendNString( EString & r, const EString & data,
+                           EString * literal )
+{
+    if ( !literal || data.length() < largeLiteral ) {
+        r.append( Command::imapQuoted( data, Command::NString ) );
+        return;
+    }
+    // if there's a null byte, we need to send a literal8
+    if ( data.contains( 0 ) )
+        r.append( '~' );
+    r.append( '{' );
+    r.appendNumber( data.length() );
+    r.append( "}\r\n" );
+    *literal = data;
+}
+
+
 /* This function returns the response data for an element in
    d->sections, to be included in the FETCH response by
    fetchResponses() below. If \a unicode is false, the result will be
-   downgraded rather than contain unicode.
+   downgraded rather than contain unicode. \a literal is as for
+   appendNString().
 */
 
-static EString sectionResponse( Section * s, Message * m, bool unicode )
+static EString sectionResponse( Section * s, Message * m, bool unicode,
+                                EString * literal )
 {
     EString data( Fetch::sectionData( s, m, unicode ) );
-    if ( !s->item.startsWith( "BINARY.SIZE" ) )
-        data = Command::imapQuoted( data, Command::NString );
     EString r;
-    r.reserve( data.length() + s->item.length() + 1 );
+    if ( s->item.startsWith( "BINARY.SIZE" ) ) {
+        r.reserve( data.length() + s->item.length() + 1 );
+        r.append( s->item );
+        r.append( " " );
+        r.append( data );
+        return r;
+    }
+    r.reserve( data.length() + s->item.length() + 30 );
     r.append( s->item );
     r.append( " " );
-    r.append( data );
+    appendNString( r, data, literal );
+    return r;
+}
+
+
+/* This function returns the response data for the section \a s,
+   whose \a data was selected by Fetch::sendPartialQueries(). \a
+   literal is as for appendNString().
+*/
+
+static EString partialResponse( Section * s, const EString & data,
+                                EString * literal )
+{
+    EString r;
+    if ( s->id == "size" ) {
+        r = "BINARY.SIZE[" + s->part + "] " + data;
+        return r;
+    }
+    r.reserve( data.length() + s->part.length() + 30 );
+    if ( s->binary )
+        r.append( "BINARY[" );
+    else
+        r.append( "BODY[" );
+    r.append( s->part );
+    r.append( "]" );
+    if ( s->partial ) {
+        r.append( "<" );
+        r.appendNumber( s->offset );
+        r.append( ">" );
+    }
+    r.append( " " );
+    appendNString( r, data, literal );
     return r;
 }
 
@@ -1103,6 +1612,31 @@ static EString sectionResponse( Section * s, Message * m, bool unicode )
 */
 
 EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
+{
+    EString r;
+    r.appendNumber( msn );
+    r.append( " FETCH (" );
+    r.append( fetchItems( m, uid ) );
+    uint n = 0;
+    while ( n < d->sections.count() ) {
+        if ( !r.endsWith( "(" ) )
+            r.append( " " );
+        r.append( sectionItem( m, uid, n, 0 ) );
+        ++n;
+    }
+    r.append( ")" );
+    return r;
+}
+
+
+/*! Returns the FETCH response items for the message \a m, which is
+    trusted to have UID \a uid, except those for the sections
+    requested. The items are separated by spaces.
+
+    The message must have all necessary content.
+*/
+
+EString Fetch::fetchItems( Message * m, uint uid )
 {
     EStringList l;
     if ( d->uid )
@@ -1117,12 +1651,28 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
         l.append( "FLAGS (" + flagList( uid ) + ")" );
     if ( d->internaldate )
         l.append( "INTERNALDATE " + internalDate( m ) );
-    if ( d->envelope )
-        l.append( "ENVELOPE " + envelope( m ) );
-    if ( d->body )
-        l.append( "BODY " + bodyStructure( m, false ) );
-    if ( d->bodystructure )
-        l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
+    bool unicode = imap()->clientSupports( IMAP::Unicode );
+    bool stored = !unicode && !m->imapEnvelope().isEmpty();
+    if ( d->envelope ) {
+        if ( stored )
+            l.append( "ENVELOPE " + m->imapEnvelope() );
+        else
+            l.append( "ENVELOPE " + ImapStructure::envelope( m, unicode ) );
+    }
+    if ( d->body ) {
+        if ( stored )
+            l.append( "BODY " + m->imapBodyStructure( false ) );
+        else
+            l.append( "BODY " +
+                      ImapStructure::bodyStructure( m, false, unicode ) );
+    }
+    if ( d->bodystructure ) {
+        if ( stored )
+            l.append( "BODYSTRUCTURE " + m->imapBodyStructure( true ) );
+        else
+            l.append( "BODYSTRUCTURE " +
+                      ImapStructure::bodyStructure( m, true, unicode ) );
+    }
     if ( d->annotation )
         l.append( "ANNOTATION " + annotation( imap()->user(), uid,
                                               d->entries, d->attribs ) );
@@ -1131,22 +1681,48 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
         if ( dd && dd->modseq )
             l.append( "MODSEQ (" + fn( dd->modseq ) + ")" );
     }
+    return l.join( " " );
+}
 
-    List< Section >::Iterator it( d->sections );
-    bool unicode = imap()->clientSupports( IMAP::Unicode );
-    while ( it ) {
-        l.append( sectionResponse( it, m, unicode ) );
+
+/*! Returns the number of sections (BODY[...], BINARY[...] etc.)
+    requested.
+*/
+
+uint Fetch::sectionCount() const
+{
+    return d->sections.count();
+}
+
+
+/*! Returns the FETCH response item for the \a n'th section requested,
+    for the message \a m, which is trusted to have UID \a uid.
+
+    If \a literal is non-null and the section's data is large, the
+    item returned ends with the literal's length, and *\a literal is
+    set to the data, which the caller must send next.
+*/
+
+EString Fetch::sectionItem( Message * m, uint uid, uint n,
+                            EString * literal )
+{
+    List<Section>::Iterator it( d->sections );
+    uint i = 0;
+    while ( it && i < n ) {
+        ++i;
         ++it;
     }
+    if ( !it )
+        return "";
 
-    EString r;
-    EString payload = l.join( " " );
-    r.reserve( payload.length() + 30 );
-    r.appendNumber( msn );
-    r.append( " FETCH (" );
-    r.append( payload );
-    r.append( ")" );
-    return r;
+    FetchData::DynamicData * dd = d->dynamics.find( uid );
+    EString * data = 0;
+    if ( dd )
+        data = dd->sections.find( n );
+    if ( data )
+        return partialResponse( it, *data, literal );
+    return sectionResponse( it, m, imap()->clientSupports( IMAP::Unicode ),
+                            literal );
 }
 
 
@@ -1183,293 +1759,6 @@ EString Fetch::internalDate( Message * m )
 }
 
 
-static EString hf( Header * f, HeaderField::Type t, bool unicodable )
-{
-    List<Address> * a = f->addresses( t );
-    if ( !a || a->isEmpty() )
-        return "NIL ";
-    EString r;
-    r.reserve( 50 );
-    r.append( "(" );
-    List<Address>::Iterator it( a );
-    while ( it ) {
-        r.append( "(" );
-        if ( it->type() == Address::EmptyGroup ) {
-            r.append( "NIL NIL " );
-            r.append( Command::imapQuoted( it->name( !unicodable ),
-                                           Command::NString ) );
-            r.append( " NIL)(NIL NIL NIL NIL" );
-        } else if ( it->type() == Address::Local ||
-                    it->type() == Address::Normal ) {
-            UString u = it->uname();
-            EString eu;
-            if ( u.isAscii() || unicodable )
-                eu = u.simplified().utf8();
-            else
-                eu = HeaderField::encodePhrase( u );
-            r.append( Command::imapQuoted( eu, Command::NString ) );
-            r.append( " NIL " );
-            if ( unicodable ||
-                 ( it->localpart().isAscii() && it->domain().isAscii() ) ) {
-                r.append( Command::imapQuoted( it->localpart().utf8(),
-                                               Command::NString ) );
-                r.append( " " );
-                if ( it->domain().isEmpty() )
-                    r.append( "\" \"" ); // RFC 3501, page 77 near bottom
-                else
-                    r.append( Command::imapQuoted( it->domain().utf8(),
-                                                   Command::NString ) );
-            }
-            else {
-                r.append( "noreply unicode-needed.invalid" );
-            }
-        }
-        r.append( ")" );
-        ++it;
-    }
-    r.append( ") " );
-    return r;
-}
-
-
-/*! Returns the IMAP envelope for \a m. */
-
-EString Fetch::envelope( Message * m )
-{
-    Header * h = m->header();
-
-    // envelope = "(" env-date SP env-subject SP env-from SP
-    //                env-sender SP env-reply-to SP env-to SP env-cc SP
-    //                env-bcc SP env-in-reply-to SP env-message-id ")"
-
-    EString r;
-    r.reserve( 300 );
-    r.append( "(" );
-
-    Date * date = h->date();
-    if ( date )
-        r.append( imapQuoted( date->rfc822(), NString ) );
-    else
-        r.append( "NIL" );
-    r.append( " " );
-
-    r.append( imapQuoted( h->subject(), NString ) + " " );
-    bool unicode = imap()->clientSupports( IMAP::Unicode );
-    r.append( hf( h, HeaderField::From, unicode ) );
-    r.append( hf( h, HeaderField::Sender, unicode ) );
-    r.append( hf( h, HeaderField::ReplyTo, unicode ) );
-    r.append( hf( h, HeaderField::To, unicode ) );
-    r.append( hf( h, HeaderField::Cc, unicode ) );
-    r.append( hf( h, HeaderField::Bcc, unicode ) );
-    r.append( imapQuoted( h->inReplyTo(), NString ) + " " );
-    r.append( imapQuoted( h->messageId(), NString ) );
-
-    r.append( ")" );
-    return r;
-}
-
-
-static EString parameterEString( MimeField *mf )
-{
-    EStringList *p = 0;
-
-    if ( mf )
-        p = mf->parameters();
-    if ( !mf || !p || p->isEmpty() )
-        return "NIL";
-
-    EStringList l;
-    EStringList::Iterator it( p );
-    while ( it ) {
-        l.append( Command::imapQuoted( *it ) );
-        l.append( Command::imapQuoted( mf->parameter( *it ) ) );
-        ++it;
-    }
-
-    EString r = l.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
-}
-
-
-static EString dispositionEString( ContentDisposition *cd )
-{
-    if ( !cd )
-        return "NIL";
-
-    EString s;
-    switch ( cd->disposition() ) {
-    case ContentDisposition::Inline:
-        s = "inline";
-        break;
-    case ContentDisposition::Attachment:
-        s = "attachment";
-        break;
-    }
-
-    return "(\"" + s + "\" " + parameterEString( cd ) + ")";
-}
-
-
-static EString languageEString( ContentLanguage *cl )
-{
-    if ( !cl )
-        return "NIL";
-
-    EStringList m;
-    const EStringList *l = cl->languages();
-    EStringList::Iterator it( l );
-    while ( it ) {
-        m.append( Command::imapQuoted( *it ) );
-        ++it;
-    }
-
-    if ( l->count() == 1 )
-        return *m.first();
-    EString r = m.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
-}
-
-
-/*! Returns either the IMAP BODY or BODYSTRUCTURE production for \a
-    m. If \a extended is true, BODYSTRUCTURE is returned. If it's
-    false, BODY.
-*/
-
-EString Fetch::bodyStructure( Multipart * m, bool extended )
-{
-    EString r;
-
-    Header * hdr = m->header();
-    ContentType * ct = hdr->contentType();
-
-    if ( ct && ct->type() == "multipart" ) {
-        EStringList children;
-        List< Bodypart >::Iterator it( m->children() );
-        while ( it ) {
-            children.append( bodyStructure( it, extended ) );
-            ++it;
-        }
-
-        r = children.join( "" );
-        r.prepend( "(" );
-        r.append( " " );
-        r.append( imapQuoted( ct->subtype() ));
-
-        if ( extended ) {
-            r.append( " " );
-            r.append( parameterEString( ct ) );
-            r.append( " " );
-            r.append( dispositionEString( hdr->contentDisposition() ) );
-            r.append( " " );
-            r.append( languageEString( hdr->contentLanguage() ) );
-            r.append( " " );
-            r.append( imapQuoted( hdr->contentLocation(), NString ) );
-        }
-
-        r.append( ")" );
-    }
-    else {
-        r = singlePartStructure( (Bodypart*)m, extended );
-    }
-
-    return r;
-}
-
-
-/*! Returns the structure of the single-part bodypart \a mp.
-
-    If \a extended is true, extended BODYSTRUCTURE attributes are
-    included.
-*/
-
-EString Fetch::singlePartStructure( Multipart * mp, bool extended )
-{
-    EStringList l;
-
-    if ( !mp )
-        return "";
-
-    ContentType * ct = mp->header()->contentType();
-
-    if ( ct ) {
-        l.append( imapQuoted( ct->type() ) );
-        l.append( imapQuoted( ct->subtype() ) );
-    }
-    else {
-        // XXX: What happens to the default if this is a /digest?
-        l.append( "\"text\"" );
-        l.append( "\"plain\"" );
-    }
-
-    l.append( parameterEString( ct ) );
-    l.append( imapQuoted( mp->header()->messageId( HeaderField::ContentId ),
-                          NString ) );
-    l.append( imapQuoted( mp->header()->contentDescription(), NString ) );
-
-    if ( mp->header()->contentTransferEncoding() ) {
-        switch( mp->header()->contentTransferEncoding()->encoding() ) {
-        case EString::Binary:
-            l.append( "\"8BIT\"" ); // hm. is this entirely sound?
-            break;
-        case EString::Uuencode:
-            l.append( "\"x-uuencode\"" ); // should never happen
-            break;
-        case EString::Base64:
-            l.append( "\"BASE64\"" );
-            break;
-        case EString::QP:
-            l.append( "\"QUOTED-PRINTABLE\"" );
-            break;
-        }
-    }
-    else {
-        l.append( "\"7BIT\"" );
-    }
-
-    Bodypart * bp = 0;
-    if ( mp->isBodypart() )
-        bp = (Bodypart*)mp;
-    else if ( mp->isMessage() )
-        bp = ((Message*)mp)->children()->first();
-
-    if ( bp ) {
-        l.append( fn( bp->numEncodedBytes() ) );
-        if ( ct && ct->type() == "message" && ct->subtype() == "rfc822" ) {
-            // body-type-msg   = media-message SP body-fields SP envelope
-            //                   SP body SP body-fld-lines
-            l.append( envelope( bp->message() ) );
-            l.append( bodyStructure( bp->message(), extended ) );
-            l.append( fn ( bp->numEncodedLines() ) );
-        }
-        else if ( !ct || ct->type() == "text" ) {
-            // body-type-text  = media-text SP body-fields SP body-fld-lines
-            l.append( fn( bp->numEncodedLines() ) );
-        }
-    }
-
-    if ( extended ) {
-        EString md5;
-        HeaderField *f = mp->header()->field( HeaderField::ContentMd5 );
-        if ( f )
-            md5 = f->rfc822( false );
-
-        l.append( imapQuoted( md5, NString ) );
-        l.append( dispositionEString( mp->header()->contentDisposition() ) );
-        l.append( languageEString( mp->header()->contentLanguage() ) );
-        l.append( imapQuoted( mp->header()->contentLocation(), NString ) );
-    }
-
-    EString r = l.join( " " );
-    r.prepend( "(" );
-    r.append( ")" );
-    return r;
-}
-
-
 /*! Returns the IMAP ANNOTATION production for the message with \a
     uid, from the point of view of \a u (0 for no user, only public
     annotations). \a entrySpecs is a list of the entries to be
@@ -1680,6 +1969,63 @@ void Fetch::pickup()
         }
     }
 
+    List<FetchData::PartialFetch>::Iterator pf( d->partialFetches );
+    while ( pf ) {
+        bool size = pf->s->id == "size";
+        while ( pf->q->hasResults() ) {
+            Row * r = pf->q->nextRow();
+            uint uid = r->getInt( "uid" );
+            FetchData::DynamicData * dd = d->dynamics.find( uid );
+            if ( !dd ) {
+                dd = new FetchData::DynamicData;
+                d->dynamics.insert( uid, dd );
+            }
+            if ( size ) {
+                dd->sections.insert( pf->index,
+                                     new EString( fn( r->getInt( "size" ) ) ) );
+            }
+            else if ( r->isNull( "data" ) ) {
+                // quoted-printable, so the fallback does it
+            }
+            else if ( pf->s->binary || r->isNull( "cte" ) ||
+                      r->getEString( "cte" ) != "base64" ) {
+                dd->sections.insert( pf->index,
+                                     new EString( r->getEString( "data" ) ) );
+            }
+            else {
+                // we have whole lines, starting with the one containing
+                // the first byte wanted
+                uint skip = pf->s->offset % base64Line;
+                EString data( r->getEString( "data" ).e64( 70 ) );
+                data = data.mid( skip, pf->s->length );
+                dd->sections.insert( pf->index, new EString( data ) );
+            }
+        }
+        if ( !pf->q->done() )
+            return;
+        ++pf;
+    }
+
+    if ( d->pushedDown && !d->fallbackChecked ) {
+        d->fallbackChecked = true;
+        IntegerSet r( d->set );
+        while ( !r.isEmpty() ) {
+            uint uid = r.smallest();
+            r.remove( uid );
+            FetchData::DynamicData * dd = d->dynamics.find( uid );
+            pf = d->partialFetches.first();
+            while ( pf && dd && dd->sections.find( pf->index ) )
+                ++pf;
+            if ( pf )
+                d->fallback.add( uid );
+        }
+        if ( !d->fallback.isEmpty() ) {
+            log( "Fetching " + fn( d->fallback.count() ) +
+                 " messages in full: " + d->fallback.set(), Log::Debug );
+            sendFallbackQueries();
+        }
+    }
+
     if ( d->seenDeletedFetcher && !d->seenDeletedFetcher->done() )
         return;
 
@@ -1692,22 +2038,39 @@ void Fetch::pickup()
     if ( d->modseqFetcher && !d->modseqFetcher->done() )
         return;
 
+    if ( d->needsStructures )
+        sendStructureQueries();
+    if ( d->needsRawText )
+        sendRawTextQueries();
+    if ( d->headerPrefix )
+        sendBodyQueries();
+
     bool ok = true;
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
         uint uid = d->remaining.smallest();
         Message * m = d->messages.find( uid );
-        if ( d->needsAddresses && !m->hasAddresses() )
+        bool whole = d->fallback.contains( uid ) ||
+                     d->unraw.contains( uid );
+        if ( ( d->needsAddresses || whole ) && !m->hasAddresses() )
             ok = false;
-        if ( d->needsHeader && !m->hasHeaders() )
+        if ( ( d->needsHeader || whole ) && !m->hasHeaders() )
             ok = false;
         if ( d->needsPartNumbers && !m->hasBytesAndLines() )
             ok = false;
-        if ( d->needsBody && !m->hasBodies() )
+        if ( ( d->needsBody || whole ) && !m->hasBodies() )
             ok = false;
         if ( ( d->rfc822size || d->internaldate ||
                d->databaseId || d->threadId ) && !m->hasTrivia() )
             ok = false;
+        if ( d->needsRawText && !m->hasRawText() )
+            ok = false;
+        if ( d->needsStructures &&
+             ( !m->hasImapStructures() ||
+               ( m->imapEnvelope().isEmpty() &&
+                 ( !m->hasAddresses() || !m->hasHeaders() ||
+                   !m->hasBytesAndLines() ) ) ) )
+            ok = false;
         if ( ok ) {
             d->processed = uid;
             d->remaining.remove( uid );
@@ -1737,7 +2100,8 @@ void Fetch::pickup()
 
 ImapFetchResponse::ImapFetchResponse( ImapSession * s,
                                       Fetch * fetch, uint uid )
-    : ImapResponse( s ), f( fetch ), u( uid )
+    : ImapResponse( s ), f( fetch ), u( uid ),
+      next( 0 ), started( false ), finished( false ), separate( false )
 {
 }
 
@@ -1751,6 +2115,52 @@ EString ImapFetchResponse::text() const
 }
 
 
+/*! Returns the response in pieces, so that large sections need
+    neither be copied into the response nor be generated before the
+    client has read the preceding ones. Each large literal's data is
+    a piece of its own, and the text between two such literals
+    another.
+*/
+
+EString ImapFetchResponse::nextPiece()
+{
+    if ( !literal.isEmpty() ) {
+        EString r = literal;
+        literal = "";
+        return r;
+    }
+    if ( finished )
+        return "";
+
+    Message * m = f->message( u );
+    EString r;
+    if ( !started ) {
+        started = true;
+        uint msn = session()->msn( u );
+        if ( !u || !msn ) {
+            finished = true;
+            return "";
+        }
+        r.appendNumber( msn );
+        r.append( " FETCH (" );
+        r.append( f->fetchItems( m, u ) );
+        separate = !r.endsWith( "(" );
+    }
+    while ( next < f->sectionCount() ) {
+        if ( separate )
+            r.append( " " );
+        separate = true;
+        r.append( f->sectionItem( m, u, next, &literal ) );
+        ++next;
+        if ( !literal.isEmpty() )
+            return r;
+    }
+    r.append( ")" );
+    finished = true;
+    return r;
+}
+
+
 /*! This reimplementation of setSent() frees up memory... that
     shouldn't be necessary when using garbage collection, but in this
     case it's important to remove messages from the data structures
@@ -1811,6 +2221,62 @@ void Fetch::sendFlagQuery()
 }
 
 
+/*! Returns true if the flags and modseqs this Fetch needs can be
+    taken from the Session instead of the database. That's possible
+    when the Session is up to date, knows the flags and modseq of
+    every message, and this command doesn't need to lock anything.
+*/
+
+bool Fetch::sessionKnowsFlags()
+{
+    if ( !d->flags && !d->modseq )
+        return false;
+    if ( !d->peek || d->annotation )
+        return false;
+    ImapSession * s = session();
+    if ( !s || !s->initialised() || !s->knowsFlags() )
+        return false;
+    IntegerSet r( d->set.intersection( s->messages() ) );
+    while ( !r.isEmpty() ) {
+        uint uid = r.smallest();
+        r.remove( uid );
+        if ( !s->modSeq( uid ) )
+            return false;
+    }
+    return true;
+}
+
+
+/*! Copies the flags and modseq of each message from the Session,
+    where sendFlagQuery() and sendModSeqQuery() would ask the database.
+*/
+
+void Fetch::copySessionFlags()
+{
+    ImapSession * s = session();
+    IntegerSet r( d->set );
+    while ( !r.isEmpty() ) {
+        uint uid = r.smallest();
+        r.remove( uid );
+        FetchData::DynamicData * dd = d->dynamics.find( uid );
+        if ( !dd ) {
+            dd = new FetchData::DynamicData;
+            d->dynamics.insert( uid, dd );
+        }
+        if ( d->modseq )
+            dd->modseq = s->modSeq( uid );
+        if ( d->flags ) {
+            EStringList flags = s->flags( uid );
+            EStringList::Iterator f( flags );
+            while ( f ) {
+                dd->flags.insert( f->lower(), f );
+                ++f;
+            }
+        }
+    }
+}
+
+
 /*! Sends a query to retrieve all annotations. */
 
 void Fetch::sendAnnotationsQuery()
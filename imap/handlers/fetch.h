@@ -34,6 +34,9 @@ public:
                        const EStringList &, const EStringList & );
 
     EString makeFetchResponse( Message *, uint, uint );
+    EString fetchItems( Message *, uint );
+    uint sectionCount() const;
+    EString sectionItem( Message *, uint, uint, EString * );
 
     Message * message( uint ) const;
     void forget( uint );
@@ -41,16 +44,23 @@ public:
 private:
     void parseFetchModifier();
     void parseBody( bool );
+    static bool canPushDown( Section * );
+    static bool canUseHeader( Section * );
+    static bool canUseRawText( Section * );
     void parseAnnotation();
     void sendFetchQueries();
+    void sendPartialQueries();
+    void sendFallbackQueries();
+    void sendStructureQueries();
+    void sendRawTextQueries();
+    void sendBodyQueries();
+    bool sessionKnowsFlags();
+    void copySessionFlags();
     void sendFlagQuery();
     void sendAnnotationsQuery();
     void sendModSeqQuery();
     EString dotLetters( uint, uint );
     EString internalDate( Message * );
-    EString envelope( Message * );
-    EString bodyStructure( Multipart *, bool );
-    EString singlePartStructure( Multipart *, bool );
 
     void pickup();
 
@@ -67,11 +77,17 @@ class ImapFetchResponse
 public:
     ImapFetchResponse( ImapSession *, Fetch *, uint );
     EString text() const;
+    EString nextPiece();
     void setSent();
 
 private:
     Fetch * f;
     uint u;
+    uint next;
+    bool started;
+    bool finished;
+    bool separate;
+    EString literal;
 };
 
 
@@ -0,0 +1,247 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "multisearch.h"
+
+#include "parallelsearch.h"
+#include "permissions.h"
+#include "transaction.h"
+#include "imapsession.h"
+#include "imapparser.h"
+#include "eventmap.h"
+#include "mailbox.h"
+#include "user.h"
+
+
+class MultiSearchData
+    : public Garbage
+{
+public:
+    MultiSearchData()
+        : root( 0 ), selected( false ), events( new EventMap ),
+          mailboxes( 0 ), search( 0 )
+    {}
+
+    Selector * root;
+    bool selected;
+    EventMap * events;
+    List<Mailbox> subtreeOne;
+    List<Mailbox> * mailboxes;
+    List<Permissions> permissions;
+    ParallelSearch * search;
+};
+
+
+/*! \class MultiSearch multisearch.h
+
+    The MultiSearch class implements the ESEARCH command from RFC
+    7377, which searches several mailboxes at once.
+
+    The mailboxes are chosen using the filters from NOTIFY (RFC 5465)
+    and those the user may not read are silently skipped. The search
+    itself is run by a ParallelSearch, and each mailbox's ESEARCH
+    response is sent as soon as that mailbox and all preceding ones
+    are done.
+
+    The RETURN options MIN, MAX, COUNT and ALL are supported; PARTIAL
+    and UPDATE are not.
+*/
+
+
+/*! Constructs an empty ESEARCH command. */
+
+MultiSearch::MultiSearch()
+    : Search( true ), d( new MultiSearchData )
+{
+    setGroup( 0 );
+}
+
+
+void MultiSearch::parse()
+{
+    space();
+    if ( present( "in" ) ) {
+        space();
+        require( "(" );
+        parseSource();
+        while ( ok() && present( " " ) ) {
+            if ( nextChar() == '(' )
+                error( Bad, "No scope options are supported" );
+            parseSource();
+        }
+        require( ")" );
+        space();
+    }
+    else {
+        d->selected = true;
+    }
+
+    parseReturnOptions();
+    SearchReturn * r = returnOptions();
+    if ( r->partial || r->update )
+        error( Bad, "PARTIAL and UPDATE cannot be used with ESEARCH" );
+
+    if ( present ( "charset" ) ) {
+        space();
+        setCharset( astring() );
+        space();
+    }
+    d->root = new Selector;
+    d->root->add( parseKey() );
+    while ( ok() && !parser()->atEnd() ) {
+        space();
+        d->root->add( parseKey() );
+    }
+    end();
+
+    d->root->simplify();
+    log( "Search for " + d->root->debugString() );
+}
+
+
+/*! Parses a single filter-mailboxes item, and records it. */
+
+void MultiSearch::parseSource()
+{
+    EventFilterSpec * s = new EventFilterSpec;
+    if ( present( "selected" ) ) {
+        d->selected = true;
+        return;
+    }
+    else if ( present( "inboxes" ) ) {
+        s->setType( EventFilterSpec::Inboxes );
+    }
+    else if ( present( "personal" ) ) {
+        s->setType( EventFilterSpec::Personal );
+    }
+    else if ( present( "subscribed" ) ) {
+        s->setType( EventFilterSpec::Subscribed );
+    }
+    else if ( present( "subtree-one" ) ) {
+        space();
+        List<Mailbox>::Iterator i( parseMailboxes() );
+        while ( i ) {
+            d->subtreeOne.append( i );
+            List<Mailbox>::Iterator c( i->children() );
+            while ( c ) {
+                d->subtreeOne.append( c );
+                ++c;
+            }
+            ++i;
+        }
+        return;
+    }
+    else if ( present( "subtree" ) ) {
+        s->setType( EventFilterSpec::Subtree );
+        space();
+        s->setMailboxes( parseMailboxes() );
+    }
+    else if ( present( "mailboxes" ) ) {
+        s->setType( EventFilterSpec::Mailboxes );
+        space();
+        s->setMailboxes( parseMailboxes() );
+    }
+    else {
+        error( Bad, "Expected SELECTED, INBOXES, etc." );
+    }
+    d->events->add( s );
+}
+
+
+/*! Parses the one-or-more-mailbox item and returns a pointer to a
+    nonempty list of mailboxes.
+*/
+
+List<Mailbox> * MultiSearch::parseMailboxes()
+{
+    List<Mailbox> * l = new List<Mailbox>;
+    if ( present( "(" ) ) {
+        l->append( mailbox() );
+        while ( ok() && present( " " ) )
+            l->append( mailbox() );
+        require( ")" );
+    }
+    else {
+        l->append( mailbox() );
+    }
+    return l;
+}
+
+
+void MultiSearch::execute()
+{
+    if ( state() != Executing )
+        return;
+
+    if ( !d->mailboxes ) {
+        if ( !transaction() ) {
+            setTransaction( new Transaction( this ) );
+            d->events->refresh( transaction(), imap()->user() );
+            transaction()->commit();
+        }
+        if ( !transaction()->done() )
+            return;
+
+        List<Mailbox> * l = new List<Mailbox>;
+        if ( d->selected && imap()->session() )
+            l->append( imap()->session()->mailbox() );
+        l->append( d->events->mailboxes() );
+        l->append( d->subtreeOne );
+
+        IntegerSet seen;
+        d->mailboxes = new List<Mailbox>;
+        List<Mailbox>::Iterator i( l );
+        while ( i ) {
+            if ( i->id() && !i->deleted() && !seen.contains( i->id() ) ) {
+                seen.add( i->id() );
+                d->mailboxes->append( i );
+                d->permissions.append( new Permissions( i, imap()->user(),
+                                                        this ) );
+            }
+            ++i;
+        }
+    }
+
+    if ( !d->search ) {
+        List<Mailbox> * readable = new List<Mailbox>;
+        List<Mailbox>::Iterator m( d->mailboxes );
+        List<Permissions>::Iterator p( d->permissions );
+        while ( p ) {
+            if ( !p->ready() )
+                return;
+            if ( p->allowed( Permissions::Read ) )
+                readable->append( m );
+            ++p;
+            ++m;
+        }
+        d->search = new ParallelSearch( d->root, readable,
+                                        imap()->user(), this );
+        d->search->execute();
+    }
+
+    SearchReturn * r = returnOptions();
+    Mailbox * m;
+    while ( (m=d->search->nextMailbox()) != 0 ) {
+        IntegerSet s = d->search->matches( m );
+        if ( s.isEmpty() )
+            continue;
+        EString t = "ESEARCH (tag " + tag().quoted() +
+                    " mailbox " + imapQuoted( m ) +
+                    " uidvalidity " + fn( m->uidvalidity() ) + ") uid";
+        if ( r->count )
+            t.append( " count " + fn( s.count() ) );
+        if ( r->min )
+            t.append( " min " + fn( s.smallest() ) );
+        if ( r->max )
+            t.append( " max " + fn( s.largest() ) );
+        if ( r->all )
+            t.append( " all " + s.set() );
+        respond( t );
+    }
+    imap()->emitResponses();
+
+    if ( !d->search->done() )
+        return;
+    if ( d->search->failed() )
+        error( No, "Database error: " + d->search->error() );
+    finish();
+}
@@ -0,0 +1,27 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MULTISEARCH_H
+#define MULTISEARCH_H
+
+#include "search.h"
+#include "list.h"
+
+
+class MultiSearch
+    : public Search
+{
+public:
+    MultiSearch();
+
+    void parse();
+    void execute();
+
+private:
+    class MultiSearchData * d;
+
+    void parseSource();
+    List<Mailbox> * parseMailboxes();
+};
+
+
+#endif
@@ -32,11 +32,13 @@ void GetQuota::parse()
 void GetQuota::execute()
 {
     if ( !q ) {
-        q = new Query( "select count(rfc822size) as c, "
-                       "coalesce(sum(rfc822size::bigint),0)::bigint/1024 as s "
-                       "from messages m"
-                       " join mailbox_messages mm on (m.id=mm.message)"
-                       " join mailboxes mb on (mm.mailbox=mb.id)"
+        // mailbox_counters is maintained by a trigger whenever a
+        // message is injected, copied, moved or expunged, so this
+        // looks at one row per mailbox rather than one per message.
+        q = new Query( "select coalesce(sum(c.messages),0)::bigint as c, "
+                       "coalesce(sum(c.size),0)::bigint/1024 as s "
+                       "from mailbox_counters c"
+                       " join mailboxes mb on (c.mailbox=mb.id)"
                        " where mb.owner=$1", this );
         q->bind( 1, imap()->user()->id() );
         q->execute();
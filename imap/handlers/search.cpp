@@ -16,6 +16,7 @@
 #include "list.h"
 #include "log.h"
 #include "utf.h"
+#include "user.h"
 
 
 static const char * legalAnnotationAttributes[] = {
@@ -34,9 +35,9 @@ public:
         : uid( false ), done( false ), codec( 0 ), root( 0 ),
           query( 0 ), highestmodseq( 1 ),
           firstmodseq( 1 ), lastmodseq( 1 ),
-          returnModseq( false ),
-          returnAll( false ), returnCount( false ),
-          returnMax( false ), returnMin( false )
+          returnModseq( false ), ret( new SearchReturn ),
+          windowed( false ), ceiling( 0 ), extent( 0 ),
+          total( 0 ), lowest( 0 ), highest( 0 ), snapshot( 0 )
     {}
 
     bool uid;
@@ -54,10 +55,15 @@ public:
     int64 lastmodseq;
     bool returnModseq;
 
-    bool returnAll;
-    bool returnCount;
-    bool returnMax;
-    bool returnMin;
+    SearchReturn * ret;
+
+    bool windowed;
+    uint ceiling;
+    Query * extent;
+    uint total;
+    uint lowest;
+    uint highest;
+    int64 snapshot;
 };
 
 
@@ -66,15 +72,21 @@ public:
 
     The entirety of the basic syntax is handled, as well as ESEARCH
     (RFC 4731 and RFC 4466), of CONDSTORE (RFC 4551), ANNOTATE (RFC
-    5257) and WITHIN (RFC 5032).
+    5257), WITHIN (RFC 5032) and CONTEXT=SEARCH (RFC 5267, including
+    the negative PARTIAL ranges from RFC 9394).
 
     Searches are first run against the RAM cache, rudimentarily. If
     the comparison is difficult, expensive or unsuccessful, it gives
     up and uses the database.
 
-    If ESEARCH with only MIN, only MAX or only COUNT is used, we could
-    generate better SQL than we do. Let's do that optimisation when a
-    client benefits from it.
+    If ESEARCH is used with PARTIAL, MIN, MAX or COUNT but not ALL,
+    the database is asked for at most one page of UIDs and computes
+    the count and extremes itself; see setWindow().
+
+    RETURN (UPDATE) is supported for UID SEARCH without PARTIAL; a
+    SearchContext is then kept for the ImapSession and sends ADDTO
+    and REMOVETO updates until CANCELUPDATE. Other searches get a
+    NOUPDATE response.
 */
 
 
@@ -98,33 +110,7 @@ Search::Search( bool u )
 void Search::parse()
 {
     space();
-    if ( present( "return" ) ) {
-        // RFC 4731 and RFC 4466 define ESEARCH together.
-        space();
-        require( "(" );
-        bool any = false;
-        while ( ok() && nextChar() != ')' &&
-                nextChar() >= 'A' && nextChar() <= 'z' ) {
-            EString modifier = letters( 3, 5 ).lower();
-            any = true;
-            if ( modifier == "all" )
-                d->returnAll = true;
-            else if ( modifier == "min" )
-                d->returnMin = true;
-            else if ( modifier == "max" )
-                d->returnMax = true;
-            else if ( modifier == "count" )
-                d->returnCount = true;
-            else
-                error( Bad, "Unknown search modifier option: " + modifier );
-            if ( nextChar() != ')' )
-                space();
-        }
-        require( ")" );
-        if ( !any )
-            d->returnAll = true;
-        space();
-    }
+    parseReturnOptions();
     if ( present ( "charset" ) ) {
         space();
         setCharset( astring() );
@@ -144,6 +130,75 @@ void Search::parse()
 }
 
 
+/*! Parses the RETURN options, if present, and the following space.
+    Does nothing if the next word isn't "return".
+*/
+
+void Search::parseReturnOptions()
+{
+    if ( !present( "return" ) )
+        return;
+
+    // RFC 4731 and RFC 4466 define ESEARCH together, RFC 5267 adds
+    // PARTIAL, UPDATE and CONTEXT, and RFC 9394 negative ranges.
+    SearchReturn * r = d->ret;
+    space();
+    require( "(" );
+    while ( ok() && nextChar() != ')' &&
+            nextChar() >= 'A' && nextChar() <= 'z' ) {
+        EString modifier = letters( 3, 7 ).lower();
+        if ( modifier == "all" ) {
+            r->all = true;
+        }
+        else if ( modifier == "min" ) {
+            r->min = true;
+        }
+        else if ( modifier == "max" ) {
+            r->max = true;
+        }
+        else if ( modifier == "count" ) {
+            r->count = true;
+        }
+        else if ( modifier == "partial" ) {
+            space();
+            r->partial = true;
+            r->reverse = false;
+            if ( nextChar() == '-' ) {
+                step();
+                r->reverse = true;
+            }
+            r->first = nzNumber();
+            require( ":" );
+            if ( r->reverse )
+                require( "-" );
+            r->last = nzNumber();
+            if ( r->first > r->last ) {
+                uint x = r->first;
+                r->first = r->last;
+                r->last = x;
+            }
+        }
+        else if ( modifier == "update" ) {
+            r->update = true;
+        }
+        else if ( modifier == "context" ) {
+            // RFC 5267 says this is only a hint. We take no hints.
+        }
+        else {
+            error( Bad, "Unknown search modifier option: " + modifier );
+        }
+        if ( nextChar() != ')' )
+            space();
+    }
+    require( ")" );
+    if ( r->all && r->partial )
+        error( Bad, "PARTIAL and ALL are mutually exclusive" );
+    if ( !r->extended() )
+        r->all = true;
+    space();
+}
+
+
 /*! Parse one search key (IMAP search-key) and returns a pointer to
     the corresponding Selector. Leaves the cursor on the first
     character following the search-key.
@@ -440,13 +495,16 @@ void Search::execute()
     ImapSession * s = session();
 
     if ( !d->query ) {
+        d->snapshot = s->nextModSeq();
         considerCache();
         if ( d->done ) {
+            applyPartial();
             sendResponse();
             finish();
             return;
         }
 
+        d->windowed = setWindow();
         d->query = d->root->query( imap()->user(), s->mailbox(),
                                    s, this, false );
         d->query->execute();
@@ -464,6 +522,11 @@ void Search::execute()
     Row * r;
     while ( (r=d->query->nextRow()) != 0 ) {
         d->matches.add( r->getInt( "uid" ) );
+        if ( d->windowed ) {
+            d->total = r->getBigint( "total" );
+            d->lowest = r->getInt( "lowest" );
+            d->highest = r->getInt( "highest" );
+        }
         if ( d->returnModseq ) {
             int64 ms = r->getBigint( "modseq" );
             if ( firstRow )
@@ -475,11 +538,105 @@ void Search::execute()
         }
     }
 
+    if ( d->windowed && d->ret->partial && d->matches.isEmpty() &&
+         ( d->ret->count || d->ret->min || d->ret->max ) ) {
+        // the PARTIAL range lies past the last match, so no row
+        // carried the count and extremes. ask for them alone.
+        if ( !d->extent ) {
+            d->root->setWindow( 0, 1, false, d->ceiling );
+            d->extent = d->root->query( imap()->user(), s->mailbox(),
+                                        s, this, false );
+            d->extent->execute();
+        }
+        if ( !d->extent->done() )
+            return;
+        if ( d->extent->failed() ) {
+            error( No, "Database error: " + d->extent->error() );
+            return;
+        }
+        r = d->extent->nextRow();
+        if ( r ) {
+            d->total = r->getBigint( "total" );
+            d->lowest = r->getInt( "lowest" );
+            d->highest = r->getInt( "highest" );
+        }
+    }
+
+    if ( !d->windowed )
+        applyPartial();
     sendResponse();
     finish();
 }
 
 
+/*! Asks the Selector to return only the part of the result the
+    client asked for, if that part can be computed by the database
+    without changing the response. Returns true if the Selector will
+    return only a window, and false if it will return all matches.
+
+    The window is either the PARTIAL range or a single row, which
+    carries the count and the smallest and largest UIDs. If the
+    PARTIAL range is empty, execute() asks for that single row
+    separately.
+*/
+
+bool Search::setWindow()
+{
+    SearchReturn * r = d->ret;
+    if ( r->all || r->update || d->returnModseq )
+        return false;
+
+    ImapSession * s = session();
+    uint highest = 0;
+    if ( !d->uid ) {
+        // MSN positions are relative to the session, so the database
+        // has to see exactly the messages the session sees.
+        if ( !s->expunged().isEmpty() || s->messages().isEmpty() )
+            return false;
+        highest = s->messages().largest();
+    }
+    d->ceiling = highest;
+
+    if ( r->partial )
+        d->root->setWindow( r->first - 1, r->last + 1 - r->first,
+                            r->reverse, highest );
+    else
+        d->root->setWindow( 0, 1, false, highest );
+    return true;
+}
+
+
+/*! Records the count and extremes of the matches, and if PARTIAL was
+    used, reduces the matches to the requested range.
+*/
+
+void Search::applyPartial()
+{
+    SearchReturn * r = d->ret;
+    if ( r->partial && !d->uid )
+        d->matches = d->matches.intersection( session()->messages() );
+
+    d->total = d->matches.count();
+    d->lowest = d->matches.smallest();
+    d->highest = d->matches.largest();
+
+    if ( !r->partial )
+        return;
+
+    IntegerSet w;
+    uint n = d->matches.count();
+    uint i = r->first;
+    while ( i <= r->last && i <= n ) {
+        if ( r->reverse )
+            w.add( d->matches.value( n + 1 - i ) );
+        else
+            w.add( d->matches.value( i ) );
+        i++;
+    }
+    d->matches = w;
+}
+
+
 /*! Considers whether this search can and should be solved using this
     cache, and if so, finds all the matches.
 */
@@ -657,6 +814,17 @@ Selector * Search::selector() const
 }
 
 
+/*! Returns the RETURN options parsed by parseReturnOptions(). The
+    object is never null; if no options were given, extended()
+    returns false.
+*/
+
+SearchReturn * Search::returnOptions() const
+{
+    return d->ret;
+}
+
+
 /*! This reimplementation of Command::set() simplifies the set by
     including messages that don't exist. \a parseMsns is as for
     Command::set().
@@ -683,23 +851,36 @@ static uint max( uint a, uint b )
 
 void Search::sendResponse()
 {
+    SearchReturn * r = d->ret;
     int64 ms = d->highestmodseq;
     if ( !d->returnModseq )
         ms = 0; // means to send none
-    else if ( d->returnAll || d->returnCount )
+    else if ( r->all || r->count || r->partial )
         ms = d->highestmodseq;
-    else if ( d->returnMin && d->returnMax )
+    else if ( r->min && r->max )
         ms = max( d->firstmodseq, d->lastmodseq );
-    else if ( d->returnMin )
+    else if ( r->min )
         ms = d->firstmodseq;
-    else if ( d->returnMax )
+    else if ( r->max )
         ms = d->lastmodseq;
-    waitFor( new ImapSearchResponse( session(), d->matches, ms, tag(),
-                                     d->uid,
-                                     d->returnMin,
-                                     d->returnMax,
-                                     d->returnCount,
-                                     d->returnAll ) );
+    ImapSearchResponse * response
+        = new ImapSearchResponse( session(), d->matches, ms, tag(),
+                                  d->uid, r );
+    response->setExtent( d->total, d->lowest, d->highest );
+    waitFor( response );
+
+    if ( !r->update )
+        return;
+
+    ImapSession * s = session();
+    if ( d->uid && !r->partial &&
+         s->addSearchContext( new SearchContext( s, tag(), d->root,
+                                                 d->matches, d->snapshot,
+                                                 r ) ) )
+        return;
+
+    (void)new ImapResponse( s, "NO [NOUPDATE " + tag().quoted() + "] "
+                            "Updates not supported for this search" );
 }
 
 
@@ -719,19 +900,36 @@ void Search::sendResponse()
     needs to be sent, \a modseq will be. If the response is ESEARCH,
     then \a tag will be included as command tag.
 
-    The \a rmin, \a rmax, \a rcount and \a rall response modifiers
-    correspond to the four result options in RFC 4731.
+    \a options contains the result options from RFC 4731 and RFC
+    5267. If it asks for PARTIAL, \a set must contain only the
+    requested range, and setExtent() should be called.
 */
 
 ImapSearchResponse::ImapSearchResponse( ImapSession * session,
                                         const IntegerSet & set, int64 modseq,
                                         const EString & tag,
                                         bool u,
-                                        bool rmin, bool rmax,
-                                        bool rcount, bool rall )
+                                        SearchReturn * options )
     : ImapResponse( session ), r( set ), ms( modseq ), t( tag ),
-      uid( u ), min( rmin ), max( rmax ), count( rcount ), all( rall )
+      uid( u ), o( options ),
+      total( set.count() ), lowest( set.smallest() ),
+      highest( set.largest() )
+{
+}
+
+
+/*! Records that the entire result contains \a count messages, the
+    lowest UID being \a smallest and the highest \a largest. This is
+    necessary when the response's set contains only a part of the
+    result.
+*/
+
+void ImapSearchResponse::setExtent( uint count, uint smallest,
+                                    uint largest )
 {
+    total = count;
+    lowest = smallest;
+    highest = largest;
 }
 
 
@@ -755,28 +953,52 @@ EString ImapSearchResponse::text() const
     Session * s = session();
     EString result;
     result.reserve( r.count() * 10 );
-    if ( all || max || min || count ) {
+    if ( o->extended() ) {
         result.append( "ESEARCH (tag " );
         result.append( t.quoted() );
         result.append( ")" );
         if ( uid )
             result.append( " uid" );
-        if ( count ) {
+        if ( o->count ) {
             result.append( " count " );
-            result.appendNumber( r.count() );
+            result.appendNumber( total );
+        }
+        if ( o->partial ) {
+            result.append( " partial (" );
+            result.append( o->partialRange() );
+            result.append( " " );
+            IntegerSet p;
+            if ( uid ) {
+                p = r;
+            }
+            else {
+                uint i = 1;
+                uint max = r.count();
+                while ( i <= max ) {
+                    uint m = s->msn( r.value( i ) );
+                    if ( m )
+                        p.add( m );
+                    i++;
+                }
+            }
+            if ( p.isEmpty() )
+                result.append( "nil" );
+            else
+                result.append( p.set() );
+            result.append( ")" );
         }
-        if ( r.isEmpty() )
+        if ( !total )
             return result;
 
-        if ( min ) {
+        if ( o->min ) {
             result.append( " min " );
-            appendUid( result, s, uid, r.smallest() );
+            appendUid( result, s, uid, lowest );
         }
-        if ( max ) {
+        if ( o->max ) {
             result.append( " max " );
-            appendUid( result, s, uid, r.largest() );
+            appendUid( result, s, uid, highest );
         }
-        if ( all ) {
+        if ( o->all ) {
             result.append( " all " );
             if ( uid ) {
                 result.append( r.set() );
@@ -817,3 +1039,223 @@ EString ImapSearchResponse::text() const
     }
     return result;
 }
+
+
+/*! \class SearchReturn search.h
+
+    The SearchReturn class holds the RETURN options of an ESEARCH
+    (RFC 4731) or ESORT (RFC 5267) command. It's shared by the Search
+    and Sort commands and their responses.
+
+    If partial is true, first and last are the one-based positions of
+    the requested range, first <= last, and reverse is true if the
+    positions count from the end of the result (RFC 9394).
+*/
+
+
+/*! Constructs a SearchReturn without any options. */
+
+SearchReturn::SearchReturn()
+    : min( false ), max( false ), count( false ), all( false ),
+      partial( false ), update( false ),
+      first( 0 ), last( 0 ), reverse( false )
+{
+}
+
+
+/*! Returns true if the response should be an ESEARCH response, and
+    false if an old-style SEARCH or SORT response is wanted.
+*/
+
+bool SearchReturn::extended() const
+{
+    return min || max || count || all || partial;
+}
+
+
+/*! Returns the PARTIAL range in IMAP syntax, e.g. "1:50" or
+    "-1:-50".
+*/
+
+EString SearchReturn::partialRange() const
+{
+    EString r;
+    if ( reverse )
+        r.append( "-" );
+    r.appendNumber( first );
+    r.append( ":" );
+    if ( reverse )
+        r.append( "-" );
+    r.appendNumber( last );
+    return r;
+}
+
+
+class SearchContextData
+    : public Garbage
+{
+public:
+    SearchContextData()
+        : session( 0 ), root( 0 ), ret( 0 ), modseq( 0 ),
+          found( 0 ), changed( 0 )
+    {}
+
+    ImapSession * session;
+    EString tag;
+    Selector * root;
+    SearchReturn * ret;
+    IntegerSet matches;
+    int64 modseq;
+    Query * found;
+    Query * changed;
+};
+
+
+/*! \class SearchContext search.h
+
+    The SearchContext class keeps the result of a UID SEARCH RETURN
+    (UPDATE) up to date, as described in RFC 5267 section 4.3.
+
+    Whenever the ImapSession learns about changes, it calls update(),
+    which reports expunged matches at once and reruns the search for
+    the messages whose modseq has changed since the last time. The
+    differences are sent as ESEARCH ADDTO and REMOVETO responses.
+
+    The context lives until CANCELUPDATE or until the session ends.
+*/
+
+
+/*! Constructs a context for the search tagged \a tag in \a session.
+    \a root is the search condition, \a matches the result sent to
+    the client, \a modseq the session's nextModSeq() when the search
+    started and \a options the RETURN options.
+*/
+
+SearchContext::SearchContext( ImapSession * session, const EString & tag,
+                              Selector * root, const IntegerSet & matches,
+                              int64 modseq, SearchReturn * options )
+    : EventHandler(), d( new SearchContextData )
+{
+    d->session = session;
+    d->tag = tag;
+    d->root = root;
+    d->matches = matches;
+    d->modseq = modseq;
+    d->ret = options;
+    setLog( new Log );
+}
+
+
+/*! Returns the tag of the SEARCH command which created this
+    context.
+*/
+
+EString SearchContext::tag() const
+{
+    return d->tag;
+}
+
+
+/*! Notes that the messages in \a expunged have been expunged, and
+    starts looking for other changes if the mailbox has changed since
+    the last look.
+*/
+
+void SearchContext::update( const IntegerSet & expunged )
+{
+    IntegerSet gone = d->matches.intersection( expunged );
+    if ( !gone.isEmpty() ) {
+        d->matches.remove( gone );
+        report( IntegerSet(), gone );
+    }
+    if ( !d->found )
+        execute();
+}
+
+
+void SearchContext::execute()
+{
+    if ( d->session->imap()->session() != d->session )
+        return;
+
+    if ( !d->found ) {
+        if ( d->session->nextModSeq() <= d->modseq )
+            return;
+
+        Selector * s = new Selector( Selector::And );
+        s->add( new Selector( Selector::Modseq, Selector::Larger,
+                              d->modseq ) );
+        s->add( d->root );
+        d->found = s->query( d->session->imap()->user(),
+                             d->session->mailbox(), d->session,
+                             this, false );
+        d->changed = new Query( "select uid from mailbox_messages "
+                                "where mailbox=$1 and modseq>=$2", this );
+        d->changed->bind( 1, d->session->mailbox()->id() );
+        d->changed->bind( 2, d->modseq );
+        d->modseq = d->session->nextModSeq();
+        d->found->execute();
+        d->changed->execute();
+    }
+
+    if ( !d->found->done() || !d->changed->done() )
+        return;
+
+    IntegerSet now;
+    Row * r;
+    while ( (r=d->found->nextRow()) != 0 )
+        now.add( r->getInt( "uid" ) );
+    IntegerSet touched;
+    while ( (r=d->changed->nextRow()) != 0 )
+        touched.add( r->getInt( "uid" ) );
+
+    bool failed = d->found->failed() || d->changed->failed();
+    d->found = 0;
+    d->changed = 0;
+    if ( failed )
+        return;
+
+    IntegerSet added( now );
+    added.remove( d->matches );
+    IntegerSet removed( touched.intersection( d->matches ) );
+    removed.remove( now );
+    d->matches.add( added );
+    d->matches.remove( removed );
+    report( added, removed );
+
+    execute();
+}
+
+
+/*! Sends an ESEARCH response about \a added and \a removed, if
+    either is nonempty.
+*/
+
+void SearchContext::report( const IntegerSet & added,
+                            const IntegerSet & removed )
+{
+    if ( added.isEmpty() && removed.isEmpty() )
+        return;
+
+    EString r = "ESEARCH (tag " + d->tag.quoted() + ") uid";
+    if ( d->ret->all ) {
+        if ( !added.isEmpty() )
+            r.append( " addto (0 " + added.set() + ")" );
+        if ( !removed.isEmpty() )
+            r.append( " removeto (0 " + removed.set() + ")" );
+    }
+    if ( d->ret->count ) {
+        r.append( " count " );
+        r.appendNumber( d->matches.count() );
+    }
+    if ( d->ret->min && !d->matches.isEmpty() ) {
+        r.append( " min " );
+        r.appendNumber( d->matches.smallest() );
+    }
+    if ( d->ret->max && !d->matches.isEmpty() ) {
+        r.append( " max " );
+        r.appendNumber( d->matches.largest() );
+    }
+    (void)new ImapResponse( d->session, r );
+    d->session->imap()->emitResponses();
+}
@@ -7,11 +7,33 @@
 #include "integerset.h"
 #include "selector.h"
 #include "ustring.h"
+#include "event.h"
 
 
 class Message;
 
 
+class SearchReturn
+    : public Garbage
+{
+public:
+    SearchReturn();
+
+    bool extended() const;
+    EString partialRange() const;
+
+    bool min;
+    bool max;
+    bool count;
+    bool all;
+    bool partial;
+    bool update;
+    uint first;
+    uint last;
+    bool reverse;
+};
+
+
 class Search
     : public Command
 {
@@ -24,8 +46,10 @@ public:
 protected:
     void setCharset( const EString & );
     Selector * parseKey();
+    void parseReturnOptions();
 
     Selector * selector() const;
+    SearchReturn * returnOptions() const;
 
     void sendResponse();
 
@@ -33,6 +57,8 @@ private:
     EString date();
 
     void considerCache();
+    bool setWindow();
+    void applyPartial();
 
     UString ustring( Command::QuoteMode stringType );
 
@@ -50,15 +76,37 @@ class ImapSearchResponse
 public:
     ImapSearchResponse( ImapSession *, const IntegerSet &,
                         int64, const EString & tag,
-                        bool,
-                        bool, bool, bool, bool );
+                        bool, SearchReturn * );
     EString text() const;
 
+    void setExtent( uint, uint, uint );
+
 private:
     IntegerSet r;
     int64 ms;
     EString t;
-    bool uid, min, max, count, all;
+    bool uid;
+    SearchReturn * o;
+    uint total, lowest, highest;
+};
+
+
+class SearchContext
+    : public EventHandler
+{
+public:
+    SearchContext( ImapSession *, const EString &, Selector *,
+                   const IntegerSet &, int64, SearchReturn * );
+
+    EString tag() const;
+
+    virtual void update( const IntegerSet & );
+    void execute();
+
+private:
+    class SearchContextData * d;
+
+    void report( const IntegerSet &, const IntegerSet & );
 };
 
 
@@ -13,7 +13,11 @@ class SortData
     : public Garbage
 {
 public:
-    SortData(): Garbage(), s( 0 ), q( 0 ), u( false ) {}
+    SortData()
+        : Garbage(), s( 0 ), q( 0 ), extent( 0 ), result( 0 ),
+          u( false ), windowed( false ), ceiling( 0 ), total( 0 ),
+          snapshot( 0 )
+    {}
 
     enum SortCriterionType {
         Arrival,
@@ -48,10 +52,18 @@ public:
 
     Selector * s;
     Query * q;
+    Query * extent;
+    List<uint> * result;
     bool u;
+    bool windowed;
+    uint ceiling;
+    uint total;
+    int64 snapshot;
 
     bool usingCriterionType( SortCriterionType );
 
+    Query * query( User *, ImapSession *, EventHandler * );
+
     void addCondition( EString &, class SortCriterion * );
     void addJoin( EString &, const EString &, const EString &, bool );
 };
@@ -60,7 +72,9 @@ public:
 /*! \class Sort sort.h
 
     The Sort class implements the IMAP SORT extension, which is
-    defined in RFC 5256.
+    defined in RFC 5256, and ESORT and CONTEXT=SORT from RFC 5267.
+    RETURN (UPDATE) is supported for UID SORT without PARTIAL, using
+    a SortContext; other sorts get a NOUPDATE response.
 
     This class subclasses Search in order to take advantage of its
     parser, and operates quite nastily on the Query generated by
@@ -82,8 +96,10 @@ Sort::Sort( bool u )
 
 void Sort::parse()
 {
-    // sort-criteria
     space();
+    parseReturnOptions();
+
+    // sort-criteria
     require( "(" );
     bool x = true;
     while ( x ) {
@@ -169,43 +185,108 @@ void Sort::execute()
     if ( state() != Executing )
         return;
 
+    SearchReturn * o = returnOptions();
+
     if ( !d->q ) {
         d->s->simplify();
-        d->q = d->s->query( imap()->user(), session()->mailbox(),
-                            session(), this, true );
-        EString t = d->q->string();
-        List<SortData::SortCriterion>::Iterator c( d->c );
-        while ( c ) {
-            if ( c->t == SortData::Annotation ) {
-                c->b1 = d->s->placeHolder();
-                d->q->bind( c->b1, c->annotationEntry );
-                if ( c->priv ) {
-                    c->b2 = d->s->placeHolder();
-                    d->q->bind( c->b2, imap()->user()->id() );
-                }
-            }
-            d->addCondition( t, c );
-            ++c;
+        // a forward PARTIAL can be cut out of the sorted rows by the
+        // database. the MSN case needs the same view as the session.
+        if ( o->partial && !o->reverse && !o->min && !o->max &&
+             !o->update &&
+             ( d->u || ( session()->expunged().isEmpty() &&
+                         !session()->messages().isEmpty() ) ) ) {
+            d->windowed = true;
+            if ( !d->u )
+                d->ceiling = session()->messages().largest();
+            d->s->setWindow( o->first - 1, o->last + 1 - o->first, false,
+                             d->ceiling );
         }
-        d->q->setString( t );
+        d->snapshot = session()->nextModSeq();
+        d->q = d->query( imap()->user(), session(), this );
         d->q->execute();
     }
 
     if ( !d->q->done() )
         return;
 
-    List<uint> * result = new List<uint>;
-    Row * r;
-    while ( (r=d->q->nextRow()) != 0 ) {
-        uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
-        *tmp = r->getInt( "uid" );
-        result->append( tmp );
+    if ( !d->result ) {
+        d->result = new List<uint>;
+        Row * r;
+        while ( (r=d->q->nextRow()) != 0 ) {
+            uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
+            *tmp = r->getInt( "uid" );
+            d->result->append( tmp );
+            if ( d->windowed )
+                d->total = r->getBigint( "total" );
+        }
+        if ( !d->windowed )
+            d->total = d->result->count();
     }
-    waitFor( new ImapSortResponse( session(), result, d->u ) );
+
+    if ( d->windowed && o->count && d->result->isEmpty() ) {
+        // the PARTIAL range lies past the last match, so no row
+        // carried the count. ask for it alone.
+        if ( !d->extent ) {
+            d->s->setWindow( 0, 1, false, d->ceiling );
+            d->extent = d->s->query( imap()->user(), session()->mailbox(),
+                                     session(), this, false );
+            d->extent->execute();
+        }
+        if ( !d->extent->done() )
+            return;
+        if ( d->extent->failed() ) {
+            error( No, "Database error: " + d->extent->error() );
+            return;
+        }
+        Row * r = d->extent->nextRow();
+        if ( r )
+            d->total = r->getBigint( "total" );
+    }
+
+    ImapSortResponse * response
+        = new ImapSortResponse( session(), d->result, d->u );
+    if ( o->extended() )
+        response->setReturnOptions( tag(), o, d->total, d->windowed );
+    waitFor( response );
+    if ( o->update &&
+         ( !d->u || o->partial ||
+           !session()->addSearchContext(
+               new SortContext( session(), tag(), d, d->result,
+                                d->snapshot, o ) ) ) )
+        (void)new ImapResponse( session(),
+                                "NO [NOUPDATE " + tag().quoted() + "] "
+                                "Updates not supported for this sort" );
     finish();
 }
 
 
+/*! Returns a query to find the matching messages in the order
+    requested, using \a user and \a session and notifying \a owner.
+*/
+
+Query * SortData::query( User * user, ImapSession * session,
+                         EventHandler * owner )
+{
+    Query * q = s->query( user, session->mailbox(), session, owner, true );
+    EString t = q->string();
+    List<SortCriterion>::Iterator i( c );
+    while ( i ) {
+        if ( i->t == Annotation ) {
+            i->b1 = s->placeHolder();
+            q->bind( i->b1, i->annotationEntry );
+            if ( i->priv ) {
+                i->b2 = s->placeHolder();
+                q->bind( i->b2, user->id() );
+            }
+        }
+        addCondition( t, i );
+        ++i;
+    }
+    q->setString( t );
+    return q;
+}
+
+
 void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
 {
     switch ( c->t ) {
@@ -374,14 +455,64 @@ bool SortData::usingCriterionType( SortCriterionType t )
 
 ImapSortResponse::ImapSortResponse( ImapSession * session,
                                     List<uint> * result, bool uid )
-    : ImapResponse( session ),r( result ), u( uid )
+    : ImapResponse( session ),r( result ), u( uid ),
+      o( 0 ), total( 0 ), windowed( false )
 {
 }
 
 
+/*! Instructs this response to be an ESEARCH response as described
+    in RFC 5267, tagged with \a tag and containing the data requested
+    by \a options. The entire result contains \a count messages. If
+    \a window is true, the result list contains just the PARTIAL
+    range, if false, it contains all messages.
+*/
+
+void ImapSortResponse::setReturnOptions( const EString & tag,
+                                         SearchReturn * options,
+                                         uint count, bool window )
+{
+    t = tag;
+    o = options;
+    total = count;
+    windowed = window;
+}
+
+
+/*! Appends \a l to \a result as an RFC 5267 sequence, in order, so
+    that runs of consecutive numbers are compressed.
+*/
+
+static void appendSequence( EString & result, const List<uint> & l )
+{
+    List<uint>::Iterator i( l );
+    bool first = true;
+    while ( i ) {
+        uint b = *i;
+        uint e = b;
+        ++i;
+        while ( i && *i == e + 1 ) {
+            e = *i;
+            ++i;
+        }
+        if ( !first )
+            result.append( "," );
+        first = false;
+        result.appendNumber( b );
+        if ( e > b ) {
+            result.append( ":" );
+            result.appendNumber( e );
+        }
+    }
+}
+
+
 EString ImapSortResponse::text() const
 {
     Session * s = session();
+    if ( o )
+        return esearch();
+
     EString result;
     result.reserve( r->count() * 10 );
     result.append( "SORT" );
@@ -398,3 +529,287 @@ EString ImapSortResponse::text() const
     }
     return result;
 }
+
+
+/*! Returns the ESEARCH form of the response; see
+    setReturnOptions().
+*/
+
+EString ImapSortResponse::esearch() const
+{
+    Session * s = session();
+    List<uint> sorted;
+    List<uint>::Iterator i( r );
+    while ( i ) {
+        uint * x = (uint *)Allocator::alloc( sizeof(uint), 0 );
+        *x = *i;
+        if ( !u )
+            *x = s->msn( *x );
+        if ( *x )
+            sorted.append( x );
+        ++i;
+    }
+
+    EString result;
+    result.reserve( sorted.count() * 6 );
+    result.append( "ESEARCH (tag " );
+    result.append( t.quoted() );
+    result.append( ")" );
+    if ( u )
+        result.append( " uid" );
+    if ( o->count ) {
+        result.append( " count " );
+        result.appendNumber( total );
+    }
+    if ( o->partial ) {
+        List<uint> p;
+        uint n = sorted.count();
+        uint first = o->first;
+        uint last = o->last;
+        if ( windowed ) {
+            first = 1;
+            last = n;
+        }
+        else if ( o->reverse ) {
+            first = n + 1 > o->last ? n + 1 - o->last : 1;
+            last = n + 1 > o->first ? n + 1 - o->first : 0;
+        }
+        uint c = 1;
+        List<uint>::Iterator x( sorted );
+        while ( x && c <= last ) {
+            if ( c >= first )
+                p.append( x );
+            ++x;
+            c++;
+        }
+        result.append( " partial (" );
+        result.append( o->partialRange() );
+        result.append( " " );
+        if ( p.isEmpty() )
+            result.append( "nil" );
+        else
+            appendSequence( result, p );
+        result.append( ")" );
+    }
+    if ( sorted.isEmpty() )
+        return result;
+    if ( o->min ) {
+        result.append( " min " );
+        result.appendNumber( *sorted.first() );
+    }
+    if ( o->max ) {
+        result.append( " max " );
+        result.appendNumber( *sorted.last() );
+    }
+    if ( o->all ) {
+        result.append( " all " );
+        appendSequence( result, sorted );
+    }
+    return result;
+}
+
+
+class SortContextData
+    : public Garbage
+{
+public:
+    SortContextData()
+        : session( 0 ), sort( 0 ), ret( 0 ), result( 0 ), modseq( 0 ),
+          q( 0 ), stale( false )
+    {}
+
+    ImapSession * session;
+    EString tag;
+    SortData * sort;
+    SearchReturn * ret;
+    List<uint> * result;
+    int64 modseq;
+    Query * q;
+    bool stale;
+};
+
+
+/*! \class SortContext sort.h
+
+    The SortContext class keeps the result of a UID SORT RETURN
+    (UPDATE) up to date, as described in RFC 5267 section 4.4.
+
+    Unlike SearchContext, it cannot look only at the changed
+    messages, since a change may move a message within the sort
+    order. So it reruns the entire sort whenever the mailbox has
+    changed, and compares the new order to the old. Messages which
+    have left the result or moved are reported with REMOVETO, and
+    those which have joined it or moved are reported with ADDTO and
+    their new positions.
+*/
+
+
+/*! Constructs a context for the sort tagged \a tag in \a session.
+    \a sort describes the sort, \a result is the sorted list sent to
+    the client, \a modseq the session's nextModSeq() when the sort
+    started and \a options the RETURN options.
+*/
+
+SortContext::SortContext( ImapSession * session, const EString & tag,
+                          SortData * sort, List<uint> * result,
+                          int64 modseq, SearchReturn * options )
+    : SearchContext( session, tag, sort->s, IntegerSet(), modseq,
+                     options ),
+      d( new SortContextData )
+{
+    d->session = session;
+    d->tag = tag;
+    d->sort = sort;
+    d->result = result;
+    d->modseq = modseq;
+    d->ret = options;
+}
+
+
+/*! Notes that the messages in \a expunged have been expunged, and
+    reruns the sort if that or anything else has changed the
+    result.
+*/
+
+void SortContext::update( const IntegerSet & expunged )
+{
+    List<uint>::Iterator i( d->result );
+    while ( i && !expunged.contains( *i ) )
+        ++i;
+    if ( i )
+        d->stale = true;
+    if ( !d->q )
+        execute();
+}
+
+
+void SortContext::execute()
+{
+    if ( d->session->imap()->session() != d->session )
+        return;
+
+    if ( !d->q ) {
+        if ( !d->stale && d->session->nextModSeq() <= d->modseq )
+            return;
+
+        d->stale = false;
+        d->modseq = d->session->nextModSeq();
+        d->q = d->sort->query( d->session->imap()->user(), d->session,
+                               this );
+        d->q->execute();
+    }
+
+    if ( !d->q->done() )
+        return;
+
+    List<uint> * now = new List<uint>;
+    Row * r;
+    while ( (r=d->q->nextRow()) != 0 ) {
+        uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
+        *tmp = r->getInt( "uid" );
+        now->append( tmp );
+    }
+
+    bool failed = d->q->failed();
+    d->q = 0;
+    if ( failed )
+        return;
+
+    report( now );
+    d->result = now;
+
+    execute();
+}
+
+
+/*! Sends an ESEARCH response describing how the sort result changed
+    from the one last sent to \a now, if it changed.
+*/
+
+void SortContext::report( List<uint> * now )
+{
+    IntegerSet before;
+    List<uint>::Iterator i( d->result );
+    while ( i ) {
+        before.add( *i );
+        ++i;
+    }
+    IntegerSet after;
+    i = now->first();
+    while ( i ) {
+        after.add( *i );
+        ++i;
+    }
+
+    // the messages in both lists have moved if they aren't in the
+    // same place relative to the others.
+    IntegerSet moved;
+    List<uint>::Iterator o( d->result );
+    List<uint>::Iterator n( now );
+    while ( o && n ) {
+        if ( !after.contains( *o ) ) {
+            ++o;
+        }
+        else if ( !before.contains( *n ) ) {
+            ++n;
+        }
+        else {
+            if ( *o != *n ) {
+                moved.add( *o );
+                moved.add( *n );
+            }
+            ++o;
+            ++n;
+        }
+    }
+
+    IntegerSet removed( before );
+    removed.remove( after );
+    removed.add( moved );
+    IntegerSet added( after );
+    added.remove( before );
+    added.add( moved );
+    if ( added.isEmpty() && removed.isEmpty() )
+        return;
+
+    EString r = "ESEARCH (tag " + d->tag.quoted() + ") uid";
+    if ( d->ret->all ) {
+        if ( !removed.isEmpty() )
+            r.append( " removeto (0 " + removed.set() + ")" );
+        if ( !added.isEmpty() ) {
+            // the client applies REMOVETO first, so inserting the
+            // others in ascending order of position is correct.
+            r.append( " addto (" );
+            uint position = 1;
+            bool first = true;
+            i = now->first();
+            while ( i ) {
+                if ( added.contains( *i ) ) {
+                    if ( !first )
+                        r.append( " " );
+                    first = false;
+                    r.appendNumber( position );
+                    r.append( " " );
+                    r.appendNumber( *i );
+                }
+                ++i;
+                position++;
+            }
+            r.append( ")" );
+        }
+    }
+    if ( d->ret->count ) {
+        r.append( " count " );
+        r.appendNumber( now->count() );
+    }
+    if ( d->ret->min && !now->isEmpty() ) {
+        r.append( " min " );
+        r.appendNumber( *now->first() );
+    }
+    if ( d->ret->max && !now->isEmpty() ) {
+        r.append( " max " );
+        r.appendNumber( *now->last() );
+    }
+    (void)new ImapResponse( d->session, r );
+    d->session->imap()->emitResponses();
+}
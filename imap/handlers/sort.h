@@ -20,6 +20,23 @@ private:
 };
 
 
+class SortContext
+    : public SearchContext
+{
+public:
+    SortContext( ImapSession *, const EString &, class SortData *,
+                 List<uint> *, int64, SearchReturn * );
+
+    void update( const IntegerSet & );
+    void execute();
+
+private:
+    class SortContextData * d;
+
+    void report( List<uint> * );
+};
+
+
 class ImapSortResponse
     : public ImapResponse
 {
@@ -27,9 +44,17 @@ public:
     ImapSortResponse( ImapSession *, List<uint> *, bool );
     EString text() const;
 
+    void setReturnOptions( const EString &, SearchReturn *, uint, bool );
+
 private:
     List<uint> * r;
     bool u;
+    EString t;
+    SearchReturn * o;
+    uint total;
+    bool windowed;
+
+    EString esearch() const;
 };
 
 
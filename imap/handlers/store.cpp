@@ -14,13 +14,13 @@
 #include "message.h"
 #include "fetcher.h"
 #include "estring.h"
+#include "allocator.h"
 #include "query.h"
 #include "scope.h"
 #include "flag.h"
 #include "list.h"
 #include "imap.h"
 #include "user.h"
-#include "map.h"
 
 
 class StoreData
@@ -34,13 +34,10 @@ public:
           unchangedSince( 0 ), seenUnchangedSince( false ),
           sentWorkQueries( false ),
           modseq( 0 ),
-          modSeqQuery( 0 ), obtainModSeq( 0 ), findSet( 0 ),
-          presentFlags( 0 ), present( 0 ),
+          obtainModSeq( 0 ), findSet( 0 ),
           flagCreator( 0 ),
           annotationNameCreator( 0 ), session( 0 ),
-          changeSeen( false ), changeDeleted( false ),
-          newSeen( false ), newDeleted( false ),
-          sentNextModSeq( false ), modseqUpdate( 0 )
+          sentNextModSeq( false ), work( 0 )
     {}
     IntegerSet specified;
     IntegerSet s;
@@ -60,25 +57,18 @@ public:
     bool seenUnchangedSince;
     bool sentWorkQueries;
     int64 modseq;
-    Query * modSeqQuery;
     Query * obtainModSeq;
     Query * findSet;
-    Query * presentFlags;
-    Map<IntegerSet> * present;
     FlagCreator * flagCreator;
     AnnotationNameCreator * annotationNameCreator;
 
     ImapSession * session;
 
     List<Annotation> annotations;
-    bool changeSeen;
-    bool changeDeleted;
-    bool newSeen;
-    bool newDeleted;
     IntegerSet changedUids;
 
     bool sentNextModSeq;
-    Query * modseqUpdate;
+    Query * work;
 };
 
 
@@ -97,6 +87,11 @@ public:
     order, and the x flag on message 1 may have any value afterwards.
     Generally, the second command's finished last, because of how the
     database does locking.
+
+    All the changes to flags, mailbox_messages.seen/deleted and the
+    modseqs are made by a single prepared statement (see
+    sendWorkQuery()), which also finds out which messages actually
+    changed, so that only those get a new modseq.
 */
 
 /*! Constructs a Store handler. If \a u is set, the first argument is
@@ -395,52 +390,12 @@ void Store::execute()
         d->findSet->setString( s );
         transaction()->enqueue( d->findSet );
 
-        if  (d->op == StoreData::AddFlags ||
-             d->op == StoreData::RemoveFlags ||
-             d->op == StoreData::ReplaceFlags ) {
-            d->present = new Map<IntegerSet>;
-            EStringList::Iterator i( d->flagNames );
-            IntegerSet s;
-            while ( i ) {
-                uint id = Flag::id( *i );
-                ++i;
-                if ( id && !Flag::isSeen( id ) && !Flag::isDeleted( id ) ) {
-                    s.add( id );
-                    d->present->insert( id, new IntegerSet );
-                }
-            }
-            if ( !s.isEmpty() ) {
-                d->presentFlags =
-                    new Query(
-                        "select mailbox, uid, flag from flags "
-                        "where mailbox=$1 and uid=any($2) and flag=any($3)",
-                        this );
-                d->presentFlags->bind( 1, m->id() );
-                d->presentFlags->bind( 2, d->specified );
-                d->presentFlags->bind( 3, s );
-                transaction()->enqueue( d->presentFlags );
-            }
-        }
-
         transaction()->execute();
     }
 
     while ( d->findSet->hasResults() )
         d->s.add( d->findSet->nextRow()->getInt( "uid" ) );
 
-    if ( d->presentFlags && d->presentFlags->hasResults() ) {
-        Row * r;
-        IntegerSet * s = 0;
-        uint oldFlag = 0;
-        while ( (r=d->presentFlags->nextRow()) ) {
-            uint f = r->getInt( "flag" );
-            if ( !s || f != oldFlag )
-                s = d->present->find( f );
-            oldFlag = f;
-            s->add( r->getInt( "uid" ) );
-        }
-    }
-
     if ( d->op == StoreData::ReplaceAnnotations ) {
         if ( !processAnnotationNames() )
             return;
@@ -453,7 +408,7 @@ void Store::execute()
     if ( !d->findSet->done() )
         return;
 
-    if ( d->presentFlags && !d->presentFlags->done() )
+    if ( !d->obtainModSeq->done() )
         return;
 
     if ( !d->sentWorkQueries ) {
@@ -474,27 +429,22 @@ void Store::execute()
             return;
         }
 
-        bool work = false;
-        switch( d->op ) {
-        case StoreData::ReplaceFlags:
-            work = replaceFlags();
-            break;
-        case StoreData::AddFlags:
-            work = addFlags();
-            break;
-        case StoreData::RemoveFlags:
-            work = removeFlags();
-            break;
-        case StoreData::ReplaceAnnotations:
-            work = true;
-            replaceAnnotations();
-            break;
+        Row * r = d->obtainModSeq->nextRow();
+        if ( !r ) {
+            error( No, "Could not obtain modseq" );
+            return;
         }
+        d->modseq = r->getBigint( "nextmodseq" );
+
+        if ( d->op == StoreData::ReplaceAnnotations )
+            replaceAnnotations();
+
+        bool work = sendWorkQuery();
 
         if ( d->flagCreator )
             session()->sendFlagUpdate( d->flagCreator );
 
-        if ( !work && !d->changeSeen && !d->changeDeleted ) {
+        if ( !work ) {
             // there's no actual work to be done.
             transaction()->commit();
             finish();
@@ -504,103 +454,21 @@ void Store::execute()
         transaction()->execute();
     }
 
-    if ( !d->obtainModSeq->done() )
-        return;
-
-    if ( !d->modseq ) {
-        Row * r = d->obtainModSeq->nextRow();
-        if ( !r ) {
-            error( No, "Could not obtain modseq" );
-            return;
-        }
-        d->modseq = r->getBigint( "nextmodseq" );
-
-        d->modseqUpdate = new Query( "", this );
-        d->modseqUpdate->bind( 1, d->modseq );
-        d->modseqUpdate->bind( 2, m->id() );
-        d->modseqUpdate->bind( 3, d->s );
-        EString uq(  "update mailbox_messages set modseq=$1" );
-        if ( d->changeSeen ) {
-            uq.append( ",seen=" );
-            if ( d->newSeen )
-                uq.append( "true" );
-            else
-                uq.append( "false" );
-        }
-        if ( d->changeDeleted ) {
-            uq.append( ",deleted=" );
-            if ( d->newDeleted )
-                uq.append( "true" );
-            else
-                uq.append( "false" );
-        }
-        uq.append( " where mailbox=$2 and uid=any($3)" );
-        EStringList extraConditions;
-        bool checkSeenDeleted = true;
-        if ( d->changedUids.isEmpty() ) {
-            // in this case we're only changing seen/deleted
-        }
-        else if ( d->changedUids.contains( d->s ) ) {
-            // we change another flag on every message we touch, so
-            // there's nothing more we need
-            checkSeenDeleted = false;
-        }
-        else {
-            // we change flags on some messages, but maybe
-            // seen/deleted on more?
-            extraConditions.append( "uid=any($4)" );
-            d->modseqUpdate->bind( 4, d->changedUids );
-        }
-        if ( checkSeenDeleted ) {
-            if ( d->changeSeen ) {
-                if ( d->newSeen )
-                    extraConditions.append( "not seen" );
-                else
-                    extraConditions.append( "seen" );
-            }
-            if ( d->changeDeleted ) {
-                if ( d->newDeleted )
-                    extraConditions.append( "not deleted" );
-                else
-                    extraConditions.append( "deleted" );
-            }
-        }
-        if ( extraConditions.isEmpty() ) {
-            // nothing needed
-        }
-        else if ( extraConditions.count() == 1 ) {
-            uq.append( " and " );
-            uq.append( extraConditions.join( "" ) );
-        }
-        else {
-            uq.append( " and (" );
-            uq.append( extraConditions.join( " or " ) );
-            uq.append( ")" );
-        }
-        d->modseqUpdate->setString( uq );
-        transaction()->enqueue( d->modseqUpdate );
-        transaction()->execute();
-    }
-
-    if ( !d->modseqUpdate->done() )
+    if ( !d->work->done() )
         return;
 
     if ( !d->sentNextModSeq ) {
-        if ( !d->modseqUpdate->rows() ) {
-            // we updated zero mailbox_messages rows, so we also
-            // should not consume a modseq.
+        while ( d->work->hasResults() )
+            d->changedUids.add( d->work->nextRow()->getInt( "uid" ) );
+        if ( d->changedUids.isEmpty() ) {
+            // we updated zero mailbox_messages rows, so the work
+            // query did not consume a modseq either.
             transaction()->commit();
             finish();
             return;
         }
         d->sentNextModSeq = true;
 
-        Query * q = new Query( "update mailboxes set nextmodseq=$1 "
-                               "where id=$2", 0 );
-        q->bind( 1, d->modseq + 1 );
-        q->bind( 2, m->id() );
-        transaction()->enqueue( q );
-
         Mailbox::refreshMailboxes( transaction() );
         transaction()->commit();
 
@@ -618,9 +486,9 @@ void Store::execute()
 
     if ( d->silent && d->seenUnchangedSince ) {
         uint n = 0;
-        while ( n < d->s.count() ) {
+        while ( n < d->changedUids.count() ) {
             n++;
-            uint uid = d->s.value( n );
+            uint uid = d->changedUids.value( n );
             uint msn = d->session->msn( uid );
             respond( fn( msn ) + " FETCH (UID " + fn( uid ) +
                      " MODSEQ (" + fn( d->modseq ) + "))" );
@@ -676,138 +544,120 @@ bool Store::processAnnotationNames()
 }
 
 
-/*! Removes the specified flags from the relevant messages in the
-    database. If \a opposite, removes all other flags, but leaves the
-    specified flags.
-
-    Returns true if it enqueues a query and false if it does not.
-
-    This is a not ideal for the case where a single flag is removed
-    from a single messages or from a simple range of messages. In that
-    case, we could use a PreparedStatement. Later.
-*/
-
-bool Store::removeFlags( bool opposite )
-{
-    IntegerSet flags;
-
-    IntegerSet unchanged;
-    unchanged.add( d->specified );
-    EStringList::Iterator i( d->flagNames );
-    while ( i ) {
-        uint id = 0;
-        if ( d->flagCreator )
-            id = d->flagCreator->id( *i );
-        if ( !id )
-            id = Flag::id( *i );
-        ++i;
-        if ( id ) {
-            IntegerSet * present = d->present->find( id );
-            if ( present && !present->isEmpty() ) {
-                flags.add( id );
-                unchanged = unchanged.intersection( *present );
-            }
-        }
-    }
-    IntegerSet changed;
-    changed.add( d->specified );
-    changed.remove( unchanged );
-    d->changedUids.add( changed );
-
-    if ( ( d->seen && !opposite ) ||
-         ( opposite && !d->seen ) ) {
-        d->changeSeen = true;
-        d->newSeen = false;
-    }
-    if ( ( d->deleted && !opposite ) ||
-         ( opposite && !d->deleted ) ) {
-        d->changeDeleted = true;
-        d->newDeleted = false;
-    }
-
-    if ( flags.isEmpty() && !opposite )
-        return false;
-
-    EString s = "delete from flags where mailbox=$1 and uid=any($2) and ";
-    if ( opposite )
-        s.append( "not " );
-    s.append( "flag=any($3)" );
+static PreparedStatement * storeFlags;
 
-    Query * q = new Query( s, 0 );
-    q->bind( 1, d->session->mailbox()->id() );
-    q->bind( 2, d->s );
-    q->bind( 3, flags );
-    transaction()->enqueue( q );
-    return true;
-}
 
+/*! Enqueues the query that makes the changes for this command, unless
+    there is nothing to change. Returns true if it enqueues the query,
+    and false if not.
 
-/*! Adds all the necessary flags to the database. Returns true if it
-    sends any queries.
+    The query is the same prepared statement for all STOREs, with the
+    operation expressed in its arguments: the flags to add, the flags
+    to remove, whether to remove all flags but those added, the new
+    values of mailbox_messages.seen and deleted (null to leave
+    them), and whether to give each message a new modseq regardless,
+    as replaceAnnotations() needs. The database works out which
+    messages actually change, gives only those the new modseq and
+    consumes it, and returns their UIDs.
 */
 
-bool Store::addFlags()
+bool Store::sendWorkQuery()
 {
-    uint mailbox = d->session->mailbox()->id();
+    IntegerSet add;
+    IntegerSet remove;
+    bool removeOthers = false;
+    bool changeSeen = false;
+    bool changeDeleted = false;
+    bool touchAll = false;
 
-    bool work = false;
-    Query * q = new Query( "copy flags (mailbox, uid, flag) "
-                           "from stdin with binary", this );
+    switch( d->op ) {
+    case StoreData::ReplaceFlags:
+        removeOthers = true;
+        changeSeen = true;
+        changeDeleted = true;
+        break;
+    case StoreData::AddFlags:
+    case StoreData::RemoveFlags:
+        changeSeen = d->seen;
+        changeDeleted = d->deleted;
+        break;
+    case StoreData::ReplaceAnnotations:
+        touchAll = true;
+        break;
+    }
 
-    EStringList::Iterator it( d->flagNames );
-    while ( it ) {
-        IntegerSet s( d->s );
-        uint flag = 0;
-        if ( d->flagCreator )
-            flag = d->flagCreator->id( *it );
-        if ( !flag )
-            flag = Flag::id( *it );
-        ++it;
-        if ( Flag::isSeen( flag ) ) {
-            d->changeSeen = true;
-            d->newSeen = true;
-        }
-        else if ( Flag::isDeleted( flag ) ) {
-            d->changeDeleted = true;
-            d->newDeleted = true;
-        }
-        else if ( flag ) {
-            IntegerSet * p = d->present->find( flag );
-            if ( p )
-                s.remove( *p );
-            if ( !s.isEmpty() ) {
-                work = true;
-                int c = s.count();
-                while ( c ) {
-                    uint uid = s.value( c );
-                    c--;
-                    q->bind( 1, mailbox );
-                    q->bind( 2, uid );
-                    q->bind( 3, flag );
-                    q->submitLine();
-                }
-            }
+    if ( d->op != StoreData::ReplaceAnnotations ) {
+        EStringList::Iterator it( d->flagNames );
+        while ( it ) {
+            uint flag = 0;
+            if ( d->flagCreator )
+                flag = d->flagCreator->id( *it );
+            if ( !flag )
+                flag = Flag::id( *it );
+            ++it;
+            if ( !flag || Flag::isSeen( flag ) || Flag::isDeleted( flag ) )
+                continue;
+            if ( d->op == StoreData::RemoveFlags )
+                remove.add( flag );
+            else
+                add.add( flag );
         }
     }
-    if ( work )
-        transaction()->enqueue( q );
-
-    return work;
-}
 
+    if ( add.isEmpty() && remove.isEmpty() && !removeOthers &&
+         !changeSeen && !changeDeleted && !touchAll )
+        return false;
 
-/*! Ensures that the specified flags, and no others, are set for all
-    the specified messages.
-*/
+    if ( !storeFlags ) {
+        storeFlags = new PreparedStatement(
+            "with ins as ("
+            "insert into flags (mailbox, uid, flag) "
+            "select $1, mm.uid, f.flag "
+            "from mailbox_messages mm "
+            "cross join unnest($3::integer[]) f(flag) "
+            "where mm.mailbox=$1 and mm.uid=any($2) "
+            "and not exists (select 1 from flags x where "
+            "x.mailbox=$1 and x.uid=mm.uid and x.flag=f.flag) "
+            "returning uid), "
+            "del as ("
+            "delete from flags where mailbox=$1 and uid=any($2) "
+            "and (flag=any($4) or ($5 and not flag=any($3))) "
+            "returning uid), "
+            "upd as ("
+            "update mailbox_messages set modseq=$8, "
+            "seen=coalesce($6,seen), deleted=coalesce($7,deleted) "
+            "where mailbox=$1 and uid=any($2) "
+            "and ($9 or seen!=coalesce($6,seen) "
+            "or deleted!=coalesce($7,deleted) "
+            "or uid in (select uid from ins) "
+            "or uid in (select uid from del)) "
+            "returning uid), "
+            "mb as ("
+            "update mailboxes set nextmodseq=$8+1 "
+            "where id=$1 and exists (select 1 from upd)) "
+            "select uid from upd"
+        );
+        Allocator::addEternal( storeFlags, "STORE statement" );
+    }
 
-bool Store::replaceFlags()
-{
-    bool work = false;
-    if ( removeFlags( true ) )
-        work = true;
-    if ( addFlags() )
-        work = true;
-    return work;
+    d->work = new Query( *storeFlags, this );
+    d->work->bind( 1, d->session->mailbox()->id() );
+    d->work->bind( 2, d->s );
+    d->work->bind( 3, add );
+    d->work->bind( 4, remove );
+    d->work->bind( 5, removeOthers );
+    if ( changeSeen )
+        d->work->bind( 6, d->seen && d->op != StoreData::RemoveFlags );
+    else
+        d->work->bindNull( 6 );
+    if ( changeDeleted )
+        d->work->bind( 7, d->deleted && d->op != StoreData::RemoveFlags );
+    else
+        d->work->bindNull( 7 );
+    d->work->bind( 8, d->modseq );
+    d->work->bind( 9, touchAll );
+    transaction()->enqueue( d->work );
+    return true;
 }
 
 
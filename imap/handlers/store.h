@@ -26,9 +26,7 @@ private:
 private:
     bool processFlagNames();
     bool processAnnotationNames();
-    bool removeFlags( bool opposite = false );
-    bool addFlags();
-    bool replaceFlags();
+    bool sendWorkQuery();
     void replaceAnnotations();
     void parseAnnotationEntry();
     EString entryName();
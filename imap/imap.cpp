@@ -22,8 +22,10 @@
 #include "eventmap.h"
 #include "command.h"
 #include "cache.h"
+#include "graph.h"
 #include "date.h"
 #include "user.h"
+#include "allocator.h"
 
 #include "time.h"
 
@@ -31,6 +33,15 @@
 static bool endsWithLiteral( const EString *, uint *, bool * );
 
 
+// response pieces longer than this are streamed to the client a
+// chunk at a time, and the write buffer is topped up whenever it
+// drops below one chunk.
+static const uint streamingChunk = 65536;
+
+// connections that have been idle for this many seconds hibernate.
+static const uint hibernationDelay = 300;
+
+
 class IMAPData
     : public Garbage
 {
@@ -44,7 +55,9 @@ public:
           bytesArrived( 0 ),
           eventMap( new EventMap ),
           lastBadTime( 0 ),
-          nextOkTime( 0 )
+          streaming( 0 ), streamed( 0 ),
+          nextOkTime( 0 ),
+          lastActivity( time( 0 ) ), hibernating( false )
     {
         uint i = 0;
         while ( i < IMAP::NumClientCapabilities )
@@ -87,6 +100,11 @@ public:
 
     uint lastBadTime;
 
+    ImapResponse * streaming;
+    EString streamText;
+    uint streamed;
+    EString held;
+
     class BadBouncer
         : public EventHandler
     {
@@ -110,9 +128,71 @@ public:
     };
 
     uint nextOkTime;
+
+    uint lastActivity;
+    bool hibernating;
+};
+
+
+class Hibernator
+    : public EventHandler
+{
+public:
+    Hibernator();
+
+    void execute();
+
+    GraphableNumber * hibernating;
+    GraphableNumber * idleMemory;
 };
 
 
+/*! Constructs the object that looks for IMAP connections to
+    hibernate once a minute, and records statistics about them.
+*/
+
+Hibernator::Hibernator()
+    : EventHandler(),
+      hibernating( new GraphableNumber( "imap-hibernating-connections" ) ),
+      idleMemory( new GraphableNumber( "imap-idle-connection-memory" ) )
+{
+    Timer * t = new Timer( this, 60 );
+    t->setRepeating( true );
+}
+
+
+void Hibernator::execute()
+{
+    uint now = time( 0 );
+    uint idle = 0;
+    uint asleep = 0;
+    uint bytes = 0;
+    List<Connection>::Iterator i( EventLoop::global()->connections() );
+    while ( i ) {
+        Connection * c = i;
+        ++i;
+        if ( c->type() != Connection::ImapServer ||
+             c->state() != Connection::Connected )
+            continue;
+        IMAP * imap = (IMAP*)c;
+        if ( !imap->idle() )
+            continue;
+        if ( imap->lastActivity() + hibernationDelay <= now )
+            imap->hibernate();
+        idle++;
+        if ( imap->hibernating() )
+            asleep++;
+        bytes += imap->readBuffer()->memoryUsed() +
+                 imap->writeBuffer()->memoryUsed();
+    }
+    hibernating->setValue( asleep );
+    idleMemory->setValue( idle ? bytes / idle : 0 );
+}
+
+
+static Hibernator * hibernator;
+
+
 /*! \class IMAP imap.h
     This class implements the IMAP server as seen by clients.
 
@@ -140,6 +220,10 @@ public:
 
 void IMAP::setup()
 {
+    if ( ::hibernator )
+        return;
+    ::hibernator = new Hibernator;
+    Allocator::addEternal( ::hibernator, "IMAP hibernator" );
 }
 
 
@@ -170,6 +254,11 @@ IMAP::IMAP( int s )
 
 void IMAP::react( Event e )
 {
+    if ( e == Read ) {
+        d->lastActivity = time( 0 );
+        if ( d->hibernating )
+            wake();
+    }
     d->bytesArrived += readBuffer()->size();
     switch ( e ) {
     case Read:
@@ -875,19 +964,25 @@ void IMAP::emitResponses()
     Buffer * w = writeBuffer();
     List<ImapResponse>::Iterator r( d->responses );
     uint n = 0;
-    while ( r ) {
+    while ( r && !d->streaming ) {
         if ( !r->meaningful() ) {
             r->setSent();
         }
         else if ( !r->sent() && ( can || !r->changesMsn() ) ) {
-            EString t = r->text();
+            EString t = r->nextPiece();
             if ( !t.isEmpty() ) {
+                // stream() copies small responses into the write
+                // buffer at once. large ones it does bit by bit, and
+                // everything else waits until it's done.
                 w->append( "* ", 2 );
-                w->append( t );
-                w->append( "\r\n", 2 );
+                d->streaming = r;
+                d->streamText = t;
+                d->streamed = 0;
+                stream();
                 n++;
             }
-            r->setSent();
+            if ( d->streaming != r )
+                r->setSent();
             any = true;
         }
         if ( r->sent() )
@@ -907,6 +1002,120 @@ void IMAP::emitResponses()
 }
 
 
+/*! Appends \a s to the writeBuffer(), unless a large response is
+    being streamed to the client, in which case \a s is held back
+    until the streamed response has been sent in its entirety.
+*/
+
+void IMAP::enqueue( const EString & s )
+{
+    if ( d->streaming )
+        d->held.append( s );
+    else
+        Connection::enqueue( s );
+}
+
+
+/*! This private helper moves the response being streamed into the
+    writeBuffer(), one ImapResponse::nextPiece() at a time. Small
+    pieces are copied at once, large ones only as fast as the client
+    can be expected to read them. Returns true if the response has
+    been sent in its entirety, and false if there is more to do.
+*/
+
+bool IMAP::stream()
+{
+    Buffer * w = writeBuffer();
+    while ( !d->streamText.isEmpty() ) {
+        uint l = d->streamText.length();
+        bool small = d->streamed == 0 && l <= streamingChunk;
+        while ( d->streamed < l &&
+                ( small || w->size() < streamingChunk ) ) {
+            uint n = l - d->streamed;
+            if ( n > streamingChunk )
+                n = streamingChunk;
+            w->append( d->streamText.data() + d->streamed, n );
+            d->streamed += n;
+        }
+        if ( d->streamed < l )
+            return false;
+        d->streamText = d->streaming->nextPiece();
+        d->streamed = 0;
+    }
+
+    w->append( "\r\n", 2 );
+    d->streaming = 0;
+    return true;
+}
+
+
+/*! Writes as much as possible to the client, and streams more of a
+    large response if the client has read the previous part. When the
+    response has been sent completely, this releases any output which
+    was held back meanwhile and lets the commands proceed.
+*/
+
+void IMAP::write()
+{
+    Connection::write();
+    if ( !d->streaming )
+        return;
+    if ( Connection::state() != Connected ) {
+        // nobody's listening, so don't bother
+        d->streaming->setSent();
+        d->streaming = 0;
+        d->streamText.truncate();
+        d->held.truncate();
+        return;
+    }
+    if ( writeBuffer()->size() >= streamingChunk )
+        return;
+    ImapResponse * r = d->streaming;
+    if ( !stream() ) {
+        Connection::write();
+        return;
+    }
+
+    r->setSent();
+    if ( !d->held.isEmpty() ) {
+        Connection::enqueue( d->held );
+        d->held.truncate();
+    }
+    Connection::write();
+
+    List<Command>::Iterator c( commands() );
+    while ( c ) {
+        c->checkUntaggedResponses();
+        ++c;
+    }
+    emitResponses();
+    unblockCommands();
+}
+
+
+/*! Returns true if there is anything to send to the client, including
+    the unsent part of a streamed response.
+*/
+
+bool IMAP::canWrite()
+{
+    return d->streaming || Connection::canWrite();
+}
+
+
+/*! Returns the number of bytes queued for the client, including those
+    which are held back while a large response is being streamed.
+*/
+
+uint IMAP::writeBacklog() const
+{
+    uint n = Connection::writeBacklog() + d->held.length();
+    if ( d->streaming )
+        n += d->streamText.length() - d->streamed;
+    return n;
+}
+
+
 /*! Records that \a m is a (possibly) active mailbox group. */
 
 void IMAP::addMailboxGroup( MailboxGroup * m )
@@ -1035,3 +1244,55 @@ void IMAP::defeatNat()
     x.setUnixTime( now );
     enqueue( "* OK (NAT keepalive: " + x.isoTime() + ")\r\n" );
 }
+
+
+/*! Returns the time when the client last sent anything. */
+
+uint IMAP::lastActivity() const
+{
+    return d->lastActivity;
+}
+
+
+/*! Returns true if this connection is hibernating, ie. has released
+    the memory it keeps for reuse because the client hasn't sent
+    anything for a while, and false otherwise.
+*/
+
+bool IMAP::hibernating() const
+{
+    return d->hibernating;
+}
+
+
+/*! Releases the memory this connection keeps for reuse, provided it's
+    idle(): the spare buffer vectors, the output compressor's state
+    and the mailbox groups used to guess at the client's intentions.
+
+    The session is kept, so that mailbox changes are still sent at
+    once. Everything else that's released is recreated on demand, so
+    the connection wakes (see wake()) when the client next sends
+    something. Calling this while hibernating releases whatever may
+    have been allocated meanwhile, e.g. to send updates.
+*/
+
+void IMAP::hibernate()
+{
+    if ( !idle() || d->readingLiteral || d->streaming || !d->str.isEmpty() )
+        return;
+    if ( !d->hibernating )
+        log( "Hibernating", Log::Debug );
+    d->hibernating = true;
+    d->possibleGroups.clear();
+    readBuffer()->shrink();
+    writeBuffer()->shrink();
+}
+
+
+/*! Records that the connection is no longer hibernating. */
+
+void IMAP::wake()
+{
+    d->hibernating = false;
+    log( "Waking up", Log::Debug );
+}
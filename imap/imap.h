@@ -38,6 +38,11 @@ public:
 
     bool idle() const;
 
+    uint lastActivity() const;
+    bool hibernating() const;
+    void hibernate();
+    void wake();
+
     void setSession( class Session * );
 
     static void setup();
@@ -54,6 +59,11 @@ public:
     void respond( class ImapResponse * );
     void emitResponses();
 
+    void enqueue( const EString & );
+    void write();
+    bool canWrite();
+    uint writeBacklog() const;
+
     void addMailboxGroup( MailboxGroup * );
     void removeMailboxGroup( MailboxGroup * );
     MailboxGroup * mostLikelyGroup( Mailbox *, uint );
@@ -72,6 +82,7 @@ private:
     void addCommand();
     void runCommands();
     void run( Command * );
+    bool stream();
 };
 
 
@@ -13,7 +13,7 @@ class ImapResponseData
 public:
     ImapResponseData()
         : session( 0 ), imap( 0 ),
-          sent( false ), cmsn( false )
+          sent( false ), cmsn( false ), pieced( false )
         {}
 
     Session * session;
@@ -21,6 +21,7 @@ public:
     EString text;
     bool sent;
     bool cmsn;
+    bool pieced;
 };
 
 
@@ -145,6 +146,25 @@ EString ImapResponse::text() const
 }
 
 
+/*! Returns the next part of the text of the response, or an empty
+    string once all of it has been returned. IMAP sends the pieces one
+    after another, and only asks for the next one when the client has
+    read most of the previous one.
+
+    The default implementation returns text() in one piece. Subclasses
+    which may produce very large responses reimplement this so that
+    the response need never be held in memory in its entirety.
+*/
+
+EString ImapResponse::nextPiece()
+{
+    if ( d->pieced )
+        return "";
+    d->pieced = true;
+    return text();
+}
+
+
 /*! Returns true if this response has meaning, and false if it may be
     discarded.
 
@@ -20,6 +20,7 @@ public:
     virtual void setSent();
 
     virtual EString text() const;
+    virtual EString nextPiece();
 
     virtual bool meaningful() const;
     bool changesMsn() const;
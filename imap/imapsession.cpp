@@ -4,6 +4,7 @@
 
 #include "helperrowcreator.h"
 #include "handlers/fetch.h"
+#include "handlers/search.h"
 #include "command.h"
 #include "fetcher.h"
 #include "mailbox.h"
@@ -37,6 +38,7 @@ public:
     int64 cms;
     EStringList flags;
     List<int64> ignorable;
+    List<SearchContext> searchContexts;
     bool emitting;
     bool unicode;
 
@@ -242,6 +244,7 @@ void ImapSession::emitUpdates( Transaction * t )
     IntegerSet e;
     e.add( expunged() );
     e.remove( d->expungesReported );
+    IntegerSet gone( e );
     if ( !e.isEmpty() ) {
         d->expungesReported.add( e );
         if ( imap()->clientSupports( IMAP::QResync ) ) {
@@ -259,6 +262,12 @@ void ImapSession::emitUpdates( Transaction * t )
 
     emitFlagUpdates( t );
 
+    List<SearchContext>::Iterator sc( d->searchContexts );
+    while ( sc ) {
+        sc->update( gone );
+        ++sc;
+    }
+
     if ( d->uidnext < uidnext() ) {
         if ( !d->existsResponse ) {
             d->existsResponse =
@@ -296,6 +305,37 @@ void ImapSession::emitUpdates( Transaction * t )
 }
 
 
+/*! Records that \a c should be kept up to date as the mailbox
+    changes, until removeSearchContext() is called or this session
+    ends. Returns true if all is well, and false if this session
+    already has so many contexts that \a c is refused.
+*/
+
+bool ImapSession::addSearchContext( SearchContext * c )
+{
+    if ( d->searchContexts.count() >= 16 )
+        return false;
+    d->searchContexts.append( c );
+    return true;
+}
+
+
+/*! Forgets the search context created by the command tagged \a
+    tag. Returns true if there was such a context, false if not.
+*/
+
+bool ImapSession::removeSearchContext( const EString & tag )
+{
+    List<SearchContext>::Iterator sc( d->searchContexts );
+    while ( sc && sc->tag() != tag )
+        ++sc;
+    if ( !sc )
+        return false;
+    d->searchContexts.take( sc );
+    return true;
+}
+
+
 /*! This private helper starts/sends whatever flag updates are needed,
     using \a t for the database work.
 */
@@ -36,6 +36,9 @@ public:
 
     bool unicode() const;
 
+    bool addSearchContext( class SearchContext * );
+    bool removeSearchContext( const EString & );
+
 private:
     class ImapSessionData * d;
 
@@ -0,0 +1,240 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "blobstore.h"
+
+#include "configuration.h"
+#include "estringlist.h"
+#include "file.h"
+#include "log.h"
+
+// open, O_WRONLY etc.
+#include <fcntl.h>
+// write, unlink, getpid
+#include <unistd.h>
+// utime
+#include <utime.h>
+// rename
+#include <stdio.h>
+// mkdir, stat
+#include <sys/stat.h>
+// opendir, readdir
+#include <dirent.h>
+// time
+#include <time.h>
+// errno
+#include <errno.h>
+
+
+/*! \class BlobStore blobstore.h
+    Stores large bodyparts as files in the blob-directory.
+
+    Each file is named by the bodyparts.hash of its contents, so a
+    bodypart that occurs in many messages is stored once, and the
+    bodyparts row needs only its "external" flag to find it. The files
+    are spread over 256 subdirectories according to the first two
+    characters of the hash.
+
+    The Injector calls store() before it inserts the bodyparts row.
+    Since store() writes a temporary file and renames it into place,
+    the file is complete whenever a committed row refers to it. If the
+    transaction fails, the file remains until "aox vacuum" calls
+    removeUnused().
+
+    store() does not fsync() the file, since that would stall the
+    event loop for every large bodypart. It relies on the filesystem
+    to write data blocks before the rename, as ext4, XFS and most
+    other journalling filesystems do.
+*/
+
+
+/*! Returns true if the blob-directory is set, and false if all
+    bodyparts are stored in the database.
+*/
+
+bool BlobStore::enabled()
+{
+    return !Configuration::text( Configuration::BlobDirectory ).isEmpty();
+}
+
+
+/*! Returns true if \a data should be stored in the blob-directory
+    rather than the database, that is, if enabled() and \a data is at
+    least blob-minimum-size kilobytes long. A blob-minimum-size of 0
+    means that nothing new is stored there.
+*/
+
+bool BlobStore::wants( const EString & data )
+{
+    uint min = Configuration::scalar( Configuration::BlobMinimumSize );
+    if ( !enabled() || !min )
+        return false;
+    return data.length() >= 1024 * min;
+}
+
+
+/*! Returns the name of the file storing the bodypart with \a hash, or
+    an empty string if \a hash isn't a plausible MD5 hash.
+*/
+
+EString BlobStore::fileName( const EString & hash )
+{
+    if ( hash.length() != 32 || !hash.boring() )
+        return "";
+    EString n = Configuration::text( Configuration::BlobDirectory );
+    n.append( "/" );
+    n.append( hash.mid( 0, 2 ) );
+    n.append( "/" );
+    n.append( hash );
+    return n;
+}
+
+
+/*! Stores \a data as the blob identified by \a hash, and returns true
+    if that worked, or if an identical blob is already stored. Returns
+    false (and logs the reason) if the caller has to store \a data in
+    the database instead.
+
+    If a different blob with the same \a hash is already stored,
+    store() returns false rather than overwrite it. If an identical
+    one is, store() updates its modification time, so removeUnused()
+    won't delete it while the new reference is being committed.
+*/
+
+bool BlobStore::store( const EString & hash, const EString & data )
+{
+    EString name = fileName( hash );
+    if ( name.isEmpty() )
+        return false;
+
+    bool ok = false;
+    EString existing = fetch( hash, &ok );
+    if ( ok ) {
+        if ( existing != data )
+            return false;
+        if ( ::utime( File::chrooted( name ).cstr(), 0 ) < 0 ) {
+            log( "Cannot update modification time of " + name,
+                 Log::Error );
+            return false;
+        }
+        return true;
+    }
+
+    EString dir = File::chrooted( name.mid( 0, name.length() - 33 ) );
+    if ( ::mkdir( dir.cstr(), 0700 ) < 0 && errno != EEXIST ) {
+        log( "Cannot create directory " + dir, Log::Error );
+        return false;
+    }
+
+    EString tmp = File::chrooted( name + "." + fn( getpid() ) + ".tmp" );
+    int fd = ::open( tmp.cstr(), O_WRONLY|O_CREAT|O_TRUNC, 0600 );
+    if ( fd < 0 ) {
+        log( "Cannot create " + tmp, Log::Error );
+        return false;
+    }
+
+    uint done = 0;
+    while ( done < data.length() ) {
+        int n = ::write( fd, data.data() + done, data.length() - done );
+        if ( n <= 0 )
+            break;
+        done += n;
+    }
+    if ( done < data.length() ) {
+        ::close( fd );
+        ::unlink( tmp.cstr() );
+        log( "Cannot write " + tmp, Log::Error );
+        return false;
+    }
+    ::close( fd );
+
+    if ( ::rename( tmp.cstr(), File::chrooted( name ).cstr() ) < 0 ) {
+        ::unlink( tmp.cstr() );
+        log( "Cannot rename " + tmp + " to " + name, Log::Error );
+        return false;
+    }
+    return true;
+}
+
+
+/*! Returns the blob identified by \a hash. If \a ok is non-null, *\a
+    ok is set to true if the blob was read, and to false if it doesn't
+    exist or can't be read.
+*/
+
+EString BlobStore::fetch( const EString & hash, bool * ok )
+{
+    if ( ok )
+        *ok = false;
+    EString name = fileName( hash );
+    if ( name.isEmpty() )
+        return "";
+
+    struct stat st;
+    if ( ::stat( File::chrooted( name ).cstr(), &st ) < 0 )
+        return "";
+
+    File f( name );
+    if ( !f.valid() || f.contents().length() != (uint)st.st_size )
+        return "";
+    if ( ok )
+        *ok = true;
+    return f.contents();
+}
+
+
+/*! Removes each stored blob which isn't in \a used and is older than
+    \a minimumAge seconds, along with any leftover temporary files of
+    that age. The age limit protects the blobs of injections that are
+    still in progress. Returns the number of files removed.
+*/
+
+uint BlobStore::removeUnused( const Dict<void> & used, uint minimumAge )
+{
+    if ( !enabled() )
+        return 0;
+
+    EString root = Configuration::text( Configuration::BlobDirectory );
+    uint limit = (uint)time( 0 ) - minimumAge;
+    uint removed = 0;
+
+    DIR * top = ::opendir( File::chrooted( root ).cstr() );
+    if ( !top )
+        return 0;
+    struct dirent * t;
+    while ( ( t = ::readdir( top ) ) != 0 ) {
+        EString sub( t->d_name );
+        if ( sub.length() != 2 )
+            continue;
+        EString dir = File::chrooted( root + "/" + sub );
+        DIR * d = ::opendir( dir.cstr() );
+        if ( !d )
+            continue;
+        EStringList unused;
+        struct dirent * e;
+        while ( ( e = ::readdir( d ) ) != 0 ) {
+            EString name( e->d_name );
+            if ( name.startsWith( "." ) ||
+                 ( name.length() == 32 && used.contains( name ) ) )
+                continue;
+            EString path = dir + "/" + name;
+            struct stat st;
+            if ( ::stat( path.cstr(), &st ) == 0 &&
+                 (uint)st.st_mtime < limit )
+                unused.append( path );
+        }
+        ::closedir( d );
+
+        EStringList::Iterator i( unused );
+        while ( i ) {
+            // store() may have reused the blob since we looked
+            struct stat st;
+            if ( ::stat( i->cstr(), &st ) == 0 &&
+                 (uint)st.st_mtime < limit &&
+                 ::unlink( i->cstr() ) == 0 )
+                removed++;
+            ++i;
+        }
+    }
+    ::closedir( top );
+    return removed;
+}
@@ -0,0 +1,26 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include "estring.h"
+#include "dict.h"
+
+
+class BlobStore
+{
+public:
+    static bool enabled();
+    static bool wants( const EString & );
+
+    static bool store( const EString &, const EString & );
+    static EString fetch( const EString &, bool * = 0 );
+
+    static uint removeUnused( const Dict<void> &, uint );
+
+private:
+    static EString fileName( const EString & );
+};
+
+
+#endif
@@ -9,10 +9,11 @@
 #include "bodypart.h"
 #include "selector.h"
 #include "postgres.h"
+#include "sharedcache.h"
+#include "blobstore.h"
 #include "mailbox.h"
 #include "message.h"
 #include "ustring.h"
-#include "buffer.h"
 #include "query.h"
 #include "scope.h"
 #include "timer.h"
@@ -41,7 +42,7 @@ public:
           lastBatchStarted( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
-          partnumbers( 0 ),
+          partnumbers( 0 ), structures( 0 ), rawtext( 0 ),
           throttler( 0 )
     {}
 
@@ -57,6 +58,7 @@ public:
     uint batchSize;
     bool uniqueDatabaseIds;
     uint lastBatchStarted;
+    EString error;
 
     class Decoder
         : public EventHandler
@@ -81,6 +83,8 @@ public:
     Decoder * body;
     Decoder * trivia;
     Decoder * partnumbers;
+    Decoder * structures;
+    Decoder * rawtext;
 
     class TriviaDecoder
         : public Decoder
@@ -93,6 +97,26 @@ public:
         bool isDone( Message * ) const;
     };
 
+    class StructureDecoder
+        : public Decoder
+    {
+    public:
+        StructureDecoder( FetcherData * fd ): Decoder( fd ) {}
+        void decode( Message *, List<Row> * );
+        void setDone( Message * );
+        bool isDone( Message * ) const;
+    };
+
+    class RawTextDecoder
+        : public Decoder
+    {
+    public:
+        RawTextDecoder( FetcherData * fd ): Decoder( fd ) {}
+        void decode( Message *, List<Row> * );
+        void setDone( Message * );
+        bool isDone( Message * ) const;
+    };
+
     class AddressDecoder
         : public Decoder
     {
@@ -134,6 +158,9 @@ public:
     };
 
     Connection * throttler;
+
+    static void decodePart( Message *, const EString &,
+                            int, int, int, const EString *, const UString * );
 };
 
 
@@ -224,6 +251,28 @@ bool Fetcher::done() const
 }
 
 
+/*! Returns true if some of the requested data could not be read,
+    and false if everything went well. The messages are still marked
+    as fetched, so the owner should check this before using them.
+
+    \sa error()
+*/
+
+bool Fetcher::failed() const
+{
+    return !d->error.isEmpty();
+}
+
+
+/*! Returns a description of the first problem this Fetcher ran
+    into, or an empty string if there hasn't been any. */
+
+EString Fetcher::error() const
+{
+    return d->error;
+}
+
+
 void Fetcher::execute()
 {
     Scope x( log() );
@@ -281,6 +330,14 @@ void Fetcher::start()
         n++;
         what.append( "bytes/lines" );
     }
+    if ( d->structures ) {
+        n++;
+        what.append( "structures" );
+    }
+    if ( d->rawtext ) {
+        n++;
+        what.append( "raw" );
+    }
 
     if ( n < 1 || d->messages.isEmpty() ) {
         // nothing to do.
@@ -327,6 +384,10 @@ void Fetcher::waitForEnd()
         decoders.append( d->trivia );
     if ( d->partnumbers )
         decoders.append( d->partnumbers );
+    if ( d->structures )
+        decoders.append( d->structures );
+    if ( d->rawtext )
+        decoders.append( d->rawtext );
 
     List<FetcherData::Decoder>::Iterator i( decoders );
     while ( i ) {
@@ -361,8 +422,7 @@ void Fetcher::waitForEnd()
         d->throttler = 0;
     }
     else if ( d->throttler &&
-              d->throttler->writeBuffer() &&
-              d->throttler->writeBuffer()->size() > 1024*1024 ) {
+              d->throttler->writeBacklog() > 1024*1024 ) {
         (void)new Timer( this, 2 );
     }
     else {
@@ -495,6 +555,14 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
                 if ( m->hasTrivia() )
                     need = false;
                 break;
+            case Structures:
+                if ( m->hasImapStructures() )
+                    need = false;
+                break;
+            case RawText:
+                if ( m->hasRawText() )
+                    need = false;
+                break;
             }
             if ( need && m->databaseId() )
                 l.add( m->databaseId() );
@@ -504,6 +572,129 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
 }
 
 
+/*! Appends \a s to \a r such that nextCached() can retrieve it. */
+
+static void appendCached( EString & r, const EString & s )
+{
+    r.appendNumber( s.length() );
+    r.append( ':' );
+    r.append( s );
+}
+
+
+/*! Returns the string at position \a i in \a s, which must have been
+    stored using appendCached(), and steps \a i past it.
+*/
+
+static EString nextCached( const EString & s, uint & i )
+{
+    uint l = 0;
+    while ( i < s.length() && s[i] >= '0' && s[i] <= '9' )
+        l = l * 10 + s[i++] - '0';
+    i++;
+    EString r = s.mid( i, l );
+    i += l;
+    return r;
+}
+
+
+/*! Adds the header field \a name with \a value at \a position to the
+    header of \a part in \a m.
+*/
+
+static void decodeHeaderField( Message * m, const EString & part,
+                           uint position,
+                           const EString & name, const UString & value )
+{
+    Header * h = m->header();
+    if ( part.endsWith( ".rfc822" ) ) {
+        Bodypart * bp =
+            m->bodypart( part.mid( 0, part.length()-7 ), true );
+        if ( !bp->message() ) {
+            bp->setMessage( new Message );
+            bp->message()->setParent( bp );
+        }
+        h = bp->message()->header();
+        (void)m->bodypart( part.mid( 0, part.length()-7 ) + ".1" );
+    }
+    else if ( part.isEmpty() ) {
+        (void)m->bodypart( "1" );
+    }
+    else {
+        h = m->bodypart( part, true )->header();
+    }
+    HeaderField * f = HeaderField::assemble( name, value );
+    f->setPosition( position );
+    h->add( f );
+}
+
+
+/*! Looks up the headers and bodies of the messages in the current
+    batch in the SharedCache, so that bindIds() won't ask the database
+    for what another server process has already fetched.
+*/
+
+void Fetcher::findShared()
+{
+    if ( !SharedCache::enabled() || ( !d->otherheader && !d->body ) )
+        return;
+
+    Utf8Codec c;
+    Map< List<Message> >::Iterator bi( d->batch );
+    while ( bi ) {
+        List<Message>::Iterator li( *bi );
+        ++bi;
+        while ( li ) {
+            Message * m = li;
+            ++li;
+            if ( !m->databaseId() )
+                continue;
+            if ( d->otherheader && !m->hasHeaders() ) {
+                EString s = SharedCache::find( SharedCache::Headers,
+                                               m->databaseId() );
+                uint i = 0;
+                while ( i < s.length() ) {
+                    EString part = nextCached( s, i );
+                    uint position = nextCached( s, i ).number( 0 );
+                    EString name = nextCached( s, i );
+                    UString value = c.toUnicode( nextCached( s, i ) );
+                    decodeHeaderField( m, part, position, name, value );
+                }
+                if ( !s.isEmpty() )
+                    m->setHeadersFetched();
+            }
+            if ( d->body && !m->hasBodies() ) {
+                EString s = SharedCache::find( SharedCache::Bodies,
+                                               m->databaseId() );
+                uint i = 0;
+                while ( i < s.length() ) {
+                    EString part = nextCached( s, i );
+                    EString bytes = nextCached( s, i );
+                    EString lines = nextCached( s, i );
+                    EString rawbytes = nextCached( s, i );
+                    EString kind = nextCached( s, i );
+                    EString data = nextCached( s, i );
+                    UString text;
+                    if ( kind == "t" )
+                        text = c.toUnicode( data );
+                    FetcherData::decodePart(
+                        m, part,
+                        bytes.isEmpty() ? -1 : (int)bytes.number( 0 ),
+                        lines.isEmpty() ? -1 : (int)lines.number( 0 ),
+                        rawbytes.isEmpty() ? -1 : (int)rawbytes.number( 0 ),
+                        kind == "d" ? &data : 0,
+                        kind == "t" ? &text : 0 );
+                }
+                if ( !s.isEmpty() ) {
+                    m->setBodiesFetched();
+                    m->setBytesAndLinesFetched();
+                }
+            }
+        }
+    }
+}
+
+
 /*! Issues the necessary selects to retrieve data and feed the
     decoders. This function does some optimisation of the generated
     SQL.
@@ -511,6 +702,8 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
 
 void Fetcher::makeQueries()
 {
+    findShared();
+
     EStringList wanted;
     wanted.append( "mailbox" );
     wanted.append( "uid" );
@@ -539,6 +732,25 @@ void Fetcher::makeQueries()
         d->trivia->q = q;
     }
 
+    if ( d->structures ) {
+        q = new Query( "select message, envelope, body, bodystructure "
+                       "from message_structures where message=any($1)",
+                       d->structures );
+        bindIds( q, 1, Structures );
+        submit( q );
+        d->structures->q = q;
+    }
+
+    if ( d->rawtext ) {
+        q = new Query( "select m.id as message, r.data "
+                       "from messages m join raw_messages r "
+                       "on (m.raw=r.hash) where m.id=any($1)",
+                       d->rawtext );
+        bindIds( q, 1, RawText );
+        submit( q );
+        d->rawtext->q = q;
+    }
+
     if ( d->addresses ) {
         q = new Query( "select af.message, "
                        "af.part, af.position, af.field, af.number, "
@@ -567,6 +779,7 @@ void Fetcher::makeQueries()
 
     if ( d->body ) {
         q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
+                       "bp.compression, bp.hash, bp.external, "
                        "bp.bytes as rawbytes, pn.bytes, pn.lines "
                        "from part_numbers pn "
                        "left join bodyparts bp on (pn.bodypart=bp.id) "
@@ -626,6 +839,7 @@ void FetcherData::Decoder::process()
 
 void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
 {
+    EString cached;
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
@@ -634,28 +848,17 @@ void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
         EString part = r->getEString( "part" );
         EString name = r->getEString( "name" );
         UString value = r->getUString( "value" );
+        uint position = r->getInt( "position" );
+        decodeHeaderField( m, part, position, name, value );
 
-        Header * h = m->header();
-        if ( part.endsWith( ".rfc822" ) ) {
-            Bodypart * bp =
-                m->bodypart( part.mid( 0, part.length()-7 ), true );
-            if ( !bp->message() ) {
-                bp->setMessage( new Message );
-                bp->message()->setParent( bp );
-            }
-            h = bp->message()->header();
-            (void)m->bodypart( part.mid( 0, part.length()-7 ) + ".1" );
-        }
-        else if ( part.isEmpty() ) {
-            (void)m->bodypart( "1" );
-        }
-        else {
-            h = m->bodypart( part, true )->header();
+        if ( SharedCache::enabled() ) {
+            appendCached( cached, part );
+            appendCached( cached, fn( position ) );
+            appendCached( cached, name );
+            appendCached( cached, value.utf8() );
         }
-        HeaderField * f = HeaderField::assemble( name, value );
-        f->setPosition( r->getInt( "position" ) );
-        h->add( f );
     }
+    SharedCache::insert( SharedCache::Headers, m->databaseId(), cached );
 }
 
 
@@ -737,27 +940,82 @@ bool FetcherData::AddressDecoder::isDone( Message * m ) const
 
 void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
 {
-    PartNumberDecoder::decode( m, rows );
-
+    EString cached;
+    bool unreadable = false;
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
         ++i;
 
-    EString part = r->getEString( "part" );
-
-    if ( !part.endsWith( ".rfc822" ) ) {
-        Bodypart * bp = m->bodypart( part, true );
-
-        if ( !r->isNull( "data" ) )
-            bp->setData( r->getEString( "data" ) );
-        else if ( !r->isNull( "text" ) )
-            bp->setText( r->getUString( "text" ) );
-
+        EString part = r->getEString( "part" );
+        int bytes = -1;
+        if ( !r->isNull( "bytes" ) )
+            bytes = r->getInt( "bytes" );
+        int lines = -1;
+        if ( !r->isNull( "lines" ) )
+            lines = r->getInt( "lines" );
+        int rawbytes = -1;
         if ( !r->isNull( "rawbytes" ) )
-            bp->setNumBytes( r->getInt( "rawbytes" ) );
-    }
+            rawbytes = r->getInt( "rawbytes" );
+        EString data;
+        UString text;
+        EString kind;
+        if ( !r->isNull( "external" ) && r->getBoolean( "external" ) ) {
+            bool ok = false;
+            data = BlobStore::fetch( r->getEString( "hash" ), &ok );
+            if ( !ok ) {
+                log( "Cannot read bodypart " + part +
+                     " of message " + fn( m->databaseId() ) +
+                     " from the blob directory", Log::Error );
+                if ( d->error.isEmpty() )
+                    d->error = "Cannot read the stored body of message " +
+                               fn( m->databaseId() );
+                unreadable = true;
+                continue;
+            }
+            kind = "d";
+        }
+        else if ( !r->isNull( "data" ) ) {
+            data = r->getEString( "data" );
+            if ( !r->isNull( "compression" ) ) {
+                bool ok = false;
+                data = data.uncompressed( &ok );
+                if ( !ok ) {
+                    log( "Cannot uncompress bodypart " + part +
+                         " of message " + fn( m->databaseId() ),
+                         Log::Error );
+                    if ( d->error.isEmpty() )
+                        d->error = "Cannot read the stored body "
+                                   "of message " + fn( m->databaseId() );
+                    unreadable = true;
+                    continue;
+                }
+            }
+            kind = "d";
+        }
+        else if ( !r->isNull( "text" ) ) {
+            text = r->getUString( "text" );
+            kind = "t";
+        }
+        decodePart( m, part, bytes, lines, rawbytes,
+                    kind == "d" ? &data : 0, kind == "t" ? &text : 0 );
+
+        if ( SharedCache::enabled() ) {
+            appendCached( cached, part );
+            appendCached( cached, bytes < 0 ? EString() : fn( bytes ) );
+            appendCached( cached, lines < 0 ? EString() : fn( lines ) );
+            appendCached( cached,
+                          rawbytes < 0 ? EString() : fn( rawbytes ) );
+            appendCached( cached, kind );
+            if ( kind == "t" )
+                appendCached( cached, text.utf8() );
+            else
+                appendCached( cached, data );
+        }
     }
+    // other processes mustn't take a broken body for the real thing
+    if ( !unreadable )
+        SharedCache::insert( SharedCache::Bodies, m->databaseId(), cached );
 }
 
 
@@ -774,15 +1032,16 @@ bool FetcherData::BodyDecoder::isDone( Message * m ) const
 }
 
 
-void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
-{
-    List<Row>::Iterator i( rows );
-    while ( i ) {
-        Row * r = i;
-        ++i;
-
-    EString part = r->getEString( "part" );
+/*! Records what's known about \a part of \a m: The number of encoded
+    \a bytes and \a lines, the number of decoded \a rawbytes, and its
+    \a data or \a text. Negative numbers and null pointers mean
+    unknown.
+*/
 
+void FetcherData::decodePart( Message * m, const EString & part,
+                              int bytes, int lines, int rawbytes,
+                              const EString * data, const UString * text )
+{
     if ( part.endsWith( ".rfc822" ) ) {
         Bodypart *bp = m->bodypart( part.mid( 0, part.length()-7 ),
                                     true );
@@ -800,11 +1059,34 @@ void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
     else {
         Bodypart * bp = m->bodypart( part, true );
 
+        if ( bytes >= 0 )
+            bp->setNumEncodedBytes( bytes );
+        if ( lines >= 0 )
+            bp->setNumEncodedLines( lines );
+        if ( data )
+            bp->setData( *data );
+        else if ( text )
+            bp->setText( *text );
+        if ( rawbytes >= 0 )
+            bp->setNumBytes( rawbytes );
+    }
+}
+
+
+void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
+{
+    List<Row>::Iterator i( rows );
+    while ( i ) {
+        Row * r = i;
+        ++i;
+
+        int bytes = -1;
         if ( !r->isNull( "bytes" ) )
-            bp->setNumEncodedBytes( r->getInt( "bytes" ) );
+            bytes = r->getInt( "bytes" );
+        int lines = -1;
         if ( !r->isNull( "lines" ) )
-            bp->setNumEncodedLines( r->getInt( "lines" ) );
-    }
+            lines = r->getInt( "lines" );
+        decodePart( m, r->getEString( "part" ), bytes, lines, -1, 0, 0 );
     }
 }
 
@@ -846,6 +1128,56 @@ bool FetcherData::TriviaDecoder::isDone( Message * m ) const
 }
 
 
+void FetcherData::StructureDecoder::decode( Message * m, List<Row> * rows )
+{
+    Row * r = rows->firstElement();
+    m->setImapStructures( r->getEString( "envelope" ),
+                          r->getEString( "body" ),
+                          r->getEString( "bodystructure" ) );
+}
+
+
+void FetcherData::StructureDecoder::setDone( Message * m )
+{
+    // messages without a stored structure are done too, just empty
+    if ( !m->hasImapStructures() )
+        m->setImapStructures( "", "", "" );
+}
+
+
+bool FetcherData::StructureDecoder::isDone( Message * m ) const
+{
+    return m->hasImapStructures();
+}
+
+
+void FetcherData::RawTextDecoder::decode( Message * m, List<Row> * rows )
+{
+    Row * r = rows->firstElement();
+    bool ok = false;
+    EString raw = r->getEString( "data" ).uncompressed( &ok );
+    if ( !ok )
+        log( "Cannot uncompress the stored text of message " +
+             fn( m->databaseId() ), Log::Error );
+    m->setRawText( raw );
+}
+
+
+void FetcherData::RawTextDecoder::setDone( Message * m )
+{
+    // messages without stored text are done too, and rawText() is
+    // empty, so the caller has to fall back to the parsed message
+    if ( !m->hasRawText() )
+        m->setRawText( "" );
+}
+
+
+bool FetcherData::RawTextDecoder::isDone( Message * m ) const
+{
+    return m->hasRawText();
+}
+
+
 /*! Instructs this Fetcher to fetch data of type \a t. */
 
 void Fetcher::fetch( Type t )
@@ -873,6 +1205,14 @@ void Fetcher::fetch( Type t )
         if ( !d->partnumbers )
             d->partnumbers = new FetcherData::PartNumberDecoder( d );
         break;
+    case Structures:
+        if ( !d->structures )
+            d->structures = new FetcherData::StructureDecoder( d );
+        break;
+    case RawText:
+        if ( !d->rawtext )
+            d->rawtext = new FetcherData::RawTextDecoder( d );
+        break;
     }
 }
 
@@ -899,6 +1239,12 @@ bool Fetcher::fetching( Type t ) const
     case PartNumbers:
         return d->partnumbers != 0;
         break;
+    case Structures:
+        return d->structures != 0;
+        break;
+    case RawText:
+        return d->rawtext != 0;
+        break;
     }
     return false; // not reached
 }
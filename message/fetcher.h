@@ -4,6 +4,7 @@
 #define FETCHER_H
 
 #include "event.h"
+#include "estring.h"
 #include "list.h"
 
 
@@ -29,7 +30,9 @@ public:
         OtherHeader,
         Body,
         PartNumbers,
-        Trivia
+        Trivia,
+        Structures,
+        RawText
     };
 
     void addMessage( Message * );
@@ -41,6 +44,8 @@ public:
     void execute();
 
     bool done() const;
+    bool failed() const;
+    EString error() const;
 
     void setTransaction( class Transaction * );
 
@@ -51,6 +56,7 @@ private:
     void start();
     void prepareBatch();
     void makeQueries();
+    void findShared();
     void waitForEnd();
     void submit( Query * );
     void bindIds( Query *, uint, Type );
@@ -10,6 +10,9 @@
 #include "query.h"
 #include "flag.h"
 #include "utf.h"
+#include "graph.h"
+#include "configuration.h"
+#include "dbsignal.h"
 
 
 
@@ -428,6 +431,76 @@ Query * AnnotationNameCreator::makeCopy()
 }
 
 
+/*! \class RawMessageCreator helperrowcreator.h
+
+    The RawMessageCreator is a HelperRowCreator to insert rows into
+    the raw_messages table. The primary key is the MD5 hash of the
+    text, so if two injectors store the same message at the same
+    time, one of them loses the race, rolls back to its savepoint and
+    finds the other's row.
+*/
+
+
+/*! Creates an object to ensure that raw_messages contains a row for
+    each hash in \a h, using \a t for all its queries. \a texts maps
+    from each hash to the uncompressed text.
+*/
+
+RawMessageCreator::RawMessageCreator( const EStringList & h,
+                                      Dict<EString> * texts,
+                                      Transaction * t )
+    : HelperRowCreator( "raw_messages", t, "raw_messages_pkey" ),
+      raw( texts ), hashes( h )
+{
+}
+
+
+Query * RawMessageCreator::makeSelect()
+{
+    Query * q = new Query( "select 1 as id, hash as name "
+                           "from raw_messages where "
+                           "hash=any($1::text[])", this );
+
+    EStringList sl;
+    EStringList::Iterator it( hashes );
+    while ( it ) {
+        if ( id( *it ) == 0 )
+            sl.append( *it );
+        ++it;
+    }
+    if ( sl.isEmpty() )
+        return 0;
+
+    q->bind( 1, sl );
+    log( "Looking up " + fn( sl.count() ) + " stored messages",
+         Log::Debug );
+    return q;
+}
+
+
+Query * RawMessageCreator::makeCopy()
+{
+    Query * q = new Query( "copy raw_messages (hash,data) "
+                           "from stdin with binary", this );
+    EStringList::Iterator it( hashes );
+    uint count = 0;
+    while ( it ) {
+        if ( id( *it ) == 0 ) {
+            count++;
+            q->bind( 1, *it );
+            q->bind( 2, raw->find( *it )->compressed(), Query::Binary );
+            q->submitLine();
+        }
+        ++it;
+    }
+
+    if ( !count )
+        return 0;
+    log( "Inserting " + fn( count ) + " new raw messages" );
+    return q;
+}
+
+
 /*! \class AddressCreator helperrowcreator.h
 
     The AddressCreator ensures that a set of addresses exist in the
@@ -615,6 +688,188 @@ EString AddressCreator::key( Address * a )
 }
 
 
+class AddressIdCache
+    : public Garbage
+{
+public:
+    AddressIdCache(): Garbage(), first( 0 ), last( 0 ), count( 0 ) {}
+
+    struct Entry
+        : public Garbage
+    {
+        Entry(): Garbage(), id( 0 ), prev( 0 ), next( 0 ) {}
+        EString key;
+        uint id;
+        Entry * prev;
+        Entry * next;
+    };
+
+    void unlink( Entry * );
+    void prepend( Entry * );
+
+    Dict<Entry> entries;
+    Entry * first;
+    Entry * last;
+    uint count;
+};
+
+
+void AddressIdCache::unlink( Entry * e )
+{
+    if ( e->prev )
+        e->prev->next = e->next;
+    else
+        first = e->next;
+    if ( e->next )
+        e->next->prev = e->prev;
+    else
+        last = e->prev;
+    e->prev = 0;
+    e->next = 0;
+}
+
+
+void AddressIdCache::prepend( Entry * e )
+{
+    e->next = first;
+    if ( first )
+        first->prev = e;
+    first = e;
+    if ( !last )
+        last = e;
+}
+
+
+static AddressIdCache * idCache;
+static GraphableCounter * idHits;
+static GraphableCounter * idMisses;
+
+
+class AddressIdCacheFlusher
+    : public EventHandler
+{
+public:
+    AddressIdCacheFlusher(): EventHandler() {
+        (void)new DatabaseSignal( "addresses_removed", this );
+        (void)new DatabaseSignal( "obliterated", this );
+    }
+    void execute() {
+        AddressCreator::forgetIds();
+    }
+};
+
+
+/*! Returns the database ID of \a a if this process has seen it
+    recently, or 0 if not.
+
+    Unlike Address's own sharing of IDs, this cache isn't cleared when
+    the allocator frees memory; it keeps the address-cache-size most
+    recently used addresses. A row in the addresses table never
+    changes once committed, but "aox vacuum" may delete unused ones,
+    so the cache is flushed when it sends the addresses_removed
+    signal, and the Injector calls forgetId() for its addresses when
+    an injection fails.
+*/
+
+uint AddressCreator::cachedId( Address * a )
+{
+    if ( !::idCache )
+        return 0;
+
+    AddressIdCache::Entry * e = ::idCache->entries.find( key( a ) );
+    if ( !e ) {
+        ::idMisses->tick();
+        return 0;
+    }
+
+    ::idHits->tick();
+    if ( e != ::idCache->first ) {
+        ::idCache->unlink( e );
+        ::idCache->prepend( e );
+    }
+    return e->id;
+}
+
+
+/*! Records the Address::id() of \a a for later use by cachedId(). Does
+    nothing if \a a has no ID.
+
+    The caller must be certain that the ID has been committed to the
+    database.
+*/
+
+void AddressCreator::cacheId( Address * a )
+{
+    if ( !a->id() )
+        return;
+
+    uint max = Configuration::scalar( Configuration::AddressCacheSize );
+    if ( !max )
+        return;
+
+    if ( !::idCache ) {
+        ::idCache = new AddressIdCache;
+        Allocator::addEternal( ::idCache, "address ID cache" );
+        ::idHits = new GraphableCounter( "address-cache-hits" );
+        ::idMisses = new GraphableCounter( "address-cache-misses" );
+        (void)new AddressIdCacheFlusher;
+    }
+
+    EString k( key( a ) );
+    AddressIdCache::Entry * e = ::idCache->entries.find( k );
+    if ( e ) {
+        ::idCache->unlink( e );
+    }
+    else {
+        e = new AddressIdCache::Entry;
+        e->key = k;
+        ::idCache->entries.insert( k, e );
+        ::idCache->count++;
+    }
+    e->id = a->id();
+    ::idCache->prepend( e );
+
+    while ( ::idCache->count > max && ::idCache->last ) {
+        AddressIdCache::Entry * old = ::idCache->last;
+        ::idCache->unlink( old );
+        ::idCache->entries.remove( old->key );
+        ::idCache->count--;
+    }
+}
+
+
+/*! Removes \a a from the cache used by cachedId(), so that the next
+    injection looks up its ID in the database.
+*/
+
+void AddressCreator::forgetId( Address * a )
+{
+    if ( !::idCache )
+        return;
+
+    AddressIdCache::Entry * e = ::idCache->entries.find( key( a ) );
+    if ( !e )
+        return;
+    ::idCache->unlink( e );
+    ::idCache->entries.remove( e->key );
+    ::idCache->count--;
+}
+
+
+/*! Empties the cache used by cachedId(). */
+
+void AddressCreator::forgetIds()
+{
+    if ( !::idCache )
+        return;
+
+    ::idCache->entries.clear();
+    ::idCache->first = 0;
+    ::idCache->last = 0;
+    ::idCache->count = 0;
+}
+
+
 // this constant decides when we change to using the temptable. where's
 // the crossover point?
 
@@ -632,9 +887,14 @@ void AddressCreator::execute()
     if ( !decided ) {
         uint c = 0;
         Dict<Address>::Iterator i( a );
-        while ( c < useTempTable && i ) {
-            if ( !i->id() )
-                ++c;
+        while ( i ) {
+            if ( !i->id() ) {
+                uint id = cachedId( i );
+                if ( id )
+                    i->setId( id );
+                else
+                    ++c;
+            }
             ++i;
         }
         if ( c >= useTempTable )
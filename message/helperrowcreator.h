@@ -85,6 +85,23 @@ private:
 };
 
 
+class RawMessageCreator
+    : public HelperRowCreator
+{
+public:
+    RawMessageCreator( const EStringList &, Dict<EString> *,
+                       class Transaction * );
+
+private:
+    Query * makeSelect();
+    Query * makeCopy();
+
+private:
+    Dict<EString> * raw;
+    EStringList hashes;
+};
+
+
 class AddressCreator
     : public HelperRowCreator
 {
@@ -95,6 +112,11 @@ public:
 
     static EString key( Address * );
 
+    static uint cachedId( Address * );
+    static void cacheId( Address * );
+    static void forgetId( Address * );
+    static void forgetIds();
+
     void execute();
 
 private:
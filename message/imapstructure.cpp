@@ -0,0 +1,348 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "imapstructure.h"
+
+#include "estringlist.h"
+#include "mimefields.h"
+#include "bodypart.h"
+#include "address.h"
+#include "message.h"
+#include "ustring.h"
+#include "date.h"
+
+
+/*! \class ImapStructure imapstructure.h
+    Produces the IMAP ENVELOPE, BODY and BODYSTRUCTURE of a message.
+
+    The IMAP server uses this to answer FETCH, and the Injector uses it
+    to store the three strings with each message, so that FETCH can
+    usually send them without looking at the header fields and
+    bodyparts.
+*/
+
+
+/*! Returns \a s quoted such that an IMAP client will recover \a s.
+    The result fits the IMAP productions nstring if \a nstring is true,
+    and string if not.
+
+    We avoid using the escape characters and unusual atoms. "\"" is a
+    legal one-character string. But we're easy on the poor client
+    parser, and we make life easy for ourselves too.
+*/
+
+EString ImapStructure::quoted( const EString & s, bool nstring )
+{
+    // if we're asked for an nstring, NIL may do
+    if ( nstring && s.isEmpty() )
+        return "NIL";
+
+    // will quoted do?
+    uint i = 0;
+    while ( i < s.length() &&
+            s[i] >= ' ' && s[i] < 128 &&
+            s[i] != '\\' && s[i] != '"' )
+        i++;
+    if ( i >= s.length() ) // yes
+        return s.quoted( '"' );
+
+    EString r;
+    r.reserve( s.length() + 20 );
+    // if there's a null byte, we need to send a literal8
+    if ( s.contains( 0 ) )
+        r.append( '~' );
+    r.append( '{' );
+    r.appendNumber( s.length() );
+    r.append( "}\r\n" );
+    r.append( s );
+    return r;
+}
+
+
+static EString hf( Header * f, HeaderField::Type t, bool unicodable )
+{
+    List<Address> * a = f->addresses( t );
+    if ( !a || a->isEmpty() )
+        return "NIL ";
+    EString r;
+    r.reserve( 50 );
+    r.append( "(" );
+    List<Address>::Iterator it( a );
+    while ( it ) {
+        r.append( "(" );
+        if ( it->type() == Address::EmptyGroup ) {
+            r.append( "NIL NIL " );
+            r.append( ImapStructure::quoted( it->name( !unicodable ),
+                                             true ) );
+            r.append( " NIL)(NIL NIL NIL NIL" );
+        } else if ( it->type() == Address::Local ||
+                    it->type() == Address::Normal ) {
+            UString u = it->uname();
+            EString eu;
+            if ( u.isAscii() || unicodable )
+                eu = u.simplified().utf8();
+            else
+                eu = HeaderField::encodePhrase( u );
+            r.append( ImapStructure::quoted( eu, true ) );
+            r.append( " NIL " );
+            if ( unicodable ||
+                 ( it->localpart().isAscii() && it->domain().isAscii() ) ) {
+                r.append( ImapStructure::quoted( it->localpart().utf8(),
+                                                 true ) );
+                r.append( " " );
+                if ( it->domain().isEmpty() )
+                    r.append( "\" \"" ); // RFC 3501, page 77 near bottom
+                else
+                    r.append( ImapStructure::quoted( it->domain().utf8(),
+                                                     true ) );
+            }
+            else {
+                r.append( "noreply unicode-needed.invalid" );
+            }
+        }
+        r.append( ")" );
+        ++it;
+    }
+    r.append( ") " );
+    return r;
+}
+
+
+/*! Returns the IMAP envelope for \a m. If \a unicode is true, the
+    result may contain unencoded UTF-8, as permitted by RFC 6855.
+*/
+
+EString ImapStructure::envelope( Message * m, bool unicode )
+{
+    Header * h = m->header();
+
+    // envelope = "(" env-date SP env-subject SP env-from SP
+    //                env-sender SP env-reply-to SP env-to SP env-cc SP
+    //                env-bcc SP env-in-reply-to SP env-message-id ")"
+
+    EString r;
+    r.reserve( 300 );
+    r.append( "(" );
+
+    Date * date = h->date();
+    if ( date )
+        r.append( quoted( date->rfc822(), true ) );
+    else
+        r.append( "NIL" );
+    r.append( " " );
+
+    r.append( quoted( h->subject(), true ) + " " );
+    r.append( hf( h, HeaderField::From, unicode ) );
+    r.append( hf( h, HeaderField::Sender, unicode ) );
+    r.append( hf( h, HeaderField::ReplyTo, unicode ) );
+    r.append( hf( h, HeaderField::To, unicode ) );
+    r.append( hf( h, HeaderField::Cc, unicode ) );
+    r.append( hf( h, HeaderField::Bcc, unicode ) );
+    r.append( quoted( h->inReplyTo(), true ) + " " );
+    r.append( quoted( h->messageId(), true ) );
+
+    r.append( ")" );
+    return r;
+}
+
+
+static EString parameterEString( MimeField *mf )
+{
+    EStringList *p = 0;
+
+    if ( mf )
+        p = mf->parameters();
+    if ( !mf || !p || p->isEmpty() )
+        return "NIL";
+
+    EStringList l;
+    EStringList::Iterator it( p );
+    while ( it ) {
+        l.append( ImapStructure::quoted( *it ) );
+        l.append( ImapStructure::quoted( mf->parameter( *it ) ) );
+        ++it;
+    }
+
+    EString r = l.join( " " );
+    r.prepend( "(" );
+    r.append( ")" );
+    return r;
+}
+
+
+static EString dispositionEString( ContentDisposition *cd )
+{
+    if ( !cd )
+        return "NIL";
+
+    EString s;
+    switch ( cd->disposition() ) {
+    case ContentDisposition::Inline:
+        s = "inline";
+        break;
+    case ContentDisposition::Attachment:
+        s = "attachment";
+        break;
+    }
+
+    return "(\"" + s + "\" " + parameterEString( cd ) + ")";
+}
+
+
+static EString languageEString( ContentLanguage *cl )
+{
+    if ( !cl )
+        return "NIL";
+
+    EStringList m;
+    const EStringList *l = cl->languages();
+    EStringList::Iterator it( l );
+    while ( it ) {
+        m.append( ImapStructure::quoted( *it ) );
+        ++it;
+    }
+
+    if ( l->count() == 1 )
+        return *m.first();
+    EString r = m.join( " " );
+    r.prepend( "(" );
+    r.append( ")" );
+    return r;
+}
+
+
+/*! Returns either the IMAP BODY or BODYSTRUCTURE production for \a
+    m. If \a extended is true, BODYSTRUCTURE is returned. If it's
+    false, BODY. \a unicode is as for envelope().
+*/
+
+EString ImapStructure::bodyStructure( Multipart * m, bool extended,
+                                      bool unicode )
+{
+    EString r;
+
+    Header * hdr = m->header();
+    ContentType * ct = hdr->contentType();
+
+    if ( ct && ct->type() == "multipart" ) {
+        EStringList children;
+        List< Bodypart >::Iterator it( m->children() );
+        while ( it ) {
+            children.append( bodyStructure( it, extended, unicode ) );
+            ++it;
+        }
+
+        r = children.join( "" );
+        r.prepend( "(" );
+        r.append( " " );
+        r.append( quoted( ct->subtype() ) );
+
+        if ( extended ) {
+            r.append( " " );
+            r.append( parameterEString( ct ) );
+            r.append( " " );
+            r.append( dispositionEString( hdr->contentDisposition() ) );
+            r.append( " " );
+            r.append( languageEString( hdr->contentLanguage() ) );
+            r.append( " " );
+            r.append( quoted( hdr->contentLocation(), true ) );
+        }
+
+        r.append( ")" );
+    }
+    else {
+        r = singlePartStructure( (Bodypart*)m, extended, unicode );
+    }
+
+    return r;
+}
+
+
+/*! Returns the structure of the single-part bodypart \a mp.
+
+    If \a extended is true, extended BODYSTRUCTURE attributes are
+    included. \a unicode is as for envelope().
+*/
+
+EString ImapStructure::singlePartStructure( Multipart * mp, bool extended,
+                                            bool unicode )
+{
+    EStringList l;
+
+    if ( !mp )
+        return "";
+
+    ContentType * ct = mp->header()->contentType();
+
+    if ( ct ) {
+        l.append( quoted( ct->type() ) );
+        l.append( quoted( ct->subtype() ) );
+    }
+    else {
+        // XXX: What happens to the default if this is a /digest?
+        l.append( "\"text\"" );
+        l.append( "\"plain\"" );
+    }
+
+    l.append( parameterEString( ct ) );
+    l.append( quoted( mp->header()->messageId( HeaderField::ContentId ),
+                      true ) );
+    l.append( quoted( mp->header()->contentDescription(), true ) );
+
+    if ( mp->header()->contentTransferEncoding() ) {
+        switch( mp->header()->contentTransferEncoding()->encoding() ) {
+        case EString::Binary:
+            l.append( "\"8BIT\"" ); // hm. is this entirely sound?
+            break;
+        case EString::Uuencode:
+            l.append( "\"x-uuencode\"" ); // should never happen
+            break;
+        case EString::Base64:
+            l.append( "\"BASE64\"" );
+            break;
+        case EString::QP:
+            l.append( "\"QUOTED-PRINTABLE\"" );
+            break;
+        }
+    }
+    else {
+        l.append( "\"7BIT\"" );
+    }
+
+    Bodypart * bp = 0;
+    if ( mp->isBodypart() )
+        bp = (Bodypart*)mp;
+    else if ( mp->isMessage() )
+        bp = ((Message*)mp)->children()->first();
+
+    if ( bp ) {
+        l.append( fn( bp->numEncodedBytes() ) );
+        if ( ct && ct->type() == "message" && ct->subtype() == "rfc822" ) {
+            // body-type-msg   = media-message SP body-fields SP envelope
+            //                   SP body SP body-fld-lines
+            l.append( envelope( bp->message(), unicode ) );
+            l.append( bodyStructure( bp->message(), extended, unicode ) );
+            l.append( fn ( bp->numEncodedLines() ) );
+        }
+        else if ( !ct || ct->type() == "text" ) {
+            // body-type-text  = media-text SP body-fields SP body-fld-lines
+            l.append( fn( bp->numEncodedLines() ) );
+        }
+    }
+
+    if ( extended ) {
+        EString md5;
+        HeaderField *f = mp->header()->field( HeaderField::ContentMd5 );
+        if ( f )
+            md5 = f->rfc822( false );
+
+        l.append( quoted( md5, true ) );
+        l.append( dispositionEString( mp->header()->contentDisposition() ) );
+        l.append( languageEString( mp->header()->contentLanguage() ) );
+        l.append( quoted( mp->header()->contentLocation(), true ) );
+    }
+
+    EString r = l.join( " " );
+    r.prepend( "(" );
+    r.append( ")" );
+    return r;
+}
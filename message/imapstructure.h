@@ -0,0 +1,24 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef IMAPSTRUCTURE_H
+#define IMAPSTRUCTURE_H
+
+#include "estring.h"
+
+
+class Message;
+class Multipart;
+
+
+class ImapStructure
+{
+public:
+    static EString envelope( Message *, bool );
+    static EString bodyStructure( Multipart *, bool, bool );
+    static EString singlePartStructure( Multipart *, bool, bool );
+
+    static EString quoted( const EString &, bool = false );
+};
+
+
+#endif
@@ -7,6 +7,9 @@
 #include "flag.h"
 #include "query.h"
 #include "timer.h"
+#include "configuration.h"
+#include "allocator.h"
+#include "integerset.h"
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
@@ -16,6 +19,8 @@
 #include "mimefields.h"
 #include "messagecache.h"
 #include "helperrowcreator.h"
+#include "imapstructure.h"
+#include "blobstore.h"
 #include "addressfield.h"
 #include "transaction.h"
 #include "annotation.h"
@@ -29,9 +34,32 @@
 #include "log.h"
 #include "dsn.h"
 
+#include <time.h>
+
 
 static GraphableCounter * successes;
 static GraphableCounter * failures;
+static GraphableCounter * groupCommits;
+
+
+// Message IDs are handed out from a per-process block of nextval()s,
+// so that most injections needn't ask the database for them. The
+// block size grows when blocks are used up quickly and shrinks when
+// they last long, so a busy server rarely asks and an idle one
+// doesn't waste many IDs if it's restarted. Gaps don't matter.
+
+class IdPool
+    : public Garbage
+{
+public:
+    IdPool(): Garbage(), block( 64 ), refilled( 0 ) {}
+
+    IntegerSet ids;
+    uint block;
+    time_t refilled;
+};
+
+static IdPool * messageIds;
 
 
 struct BodypartRow
@@ -50,6 +78,71 @@ struct BodypartRow
 };
 
 
+// This helper builds a one-dimensional array in PostgreSQL's binary
+// format, so that insertBodyparts() can pass each column of its
+// bodyparts to store_bodyparts() as a single parameter.
+
+class BinaryArray
+    : public Garbage
+{
+public:
+    BinaryArray( uint elementType )
+        : Garbage(), type( elementType ), count( 0 ), nulls( false )
+    {}
+
+    void append( const EString & s ) {
+        appendInt( s.length() );
+        body.append( s );
+        count++;
+    }
+
+    void append( uint i ) {
+        appendInt( 4 );
+        appendInt( i );
+        count++;
+    }
+
+    void append( bool b ) {
+        appendInt( 1 );
+        body.append( b ? '\1' : '\0' );
+        count++;
+    }
+
+    void appendNull() {
+        appendInt( (uint)-1 );
+        nulls = true;
+        count++;
+    }
+
+    EString data() const {
+        EString r;
+        r.reserve( body.length() + 20 );
+        appendInt( r, 1 ); // dimensions
+        appendInt( r, nulls ? 1 : 0 );
+        appendInt( r, type );
+        appendInt( r, count );
+        appendInt( r, 1 ); // lower bound
+        r.append( body );
+        return r;
+    }
+
+private:
+    void appendInt( uint i ) { appendInt( body, i ); }
+
+    static void appendInt( EString & s, uint i ) {
+        s.append( (char)( i >> 24 ) );
+        s.append( (char)( i >> 16 ) );
+        s.append( (char)( i >>  8 ) );
+        s.append( (char)( i ) );
+    }
+
+    uint type;
+    uint count;
+    bool nulls;
+    EString body;
+};
+
+
 // The following is everything the Injector needs to do its work.
 
 enum State {
@@ -61,8 +154,10 @@ enum State {
     ConvertingThreadIndex,
     CreatingThreadRoots,
     InsertingBodyparts,
-    SelectingMessageIds, SelectingUids,
+    SelectingMessageIds,
     InsertingMessages,
+    SelectingUids,
+    InsertingMailboxMessages,
     AwaitingCompletion, Done
 };
 
@@ -73,11 +168,12 @@ class InjectorData
 public:
     InjectorData()
         : owner( 0 ),
-          state( Inactive ), failed( false ), retried( 0 ), transaction( 0 ),
+          state( Inactive ), failed( false ), overQuota( false ),
+          retried( 0 ), alone( false ), grouped( false ),
+          idsAssigned( false ), carrier( 0 ), transaction( 0 ),
           mailboxesCreated( 0 ),
           fieldNameCreator( 0 ), flagCreator( 0 ), annotationNameCreator( 0 ),
-          lockUidnext( 0 ), select( 0 ), insert( 0 ),
-          substate( 0 ), subtransaction( 0 ),
+          lockUidnext( 0 ), select( 0 ), bodypartIds( 0 ),
           findParents( 0 ), findReferences( 0 ),
           findBlah( 0 ), findMessagesInOutlookThreads( 0 ),
           threads( 0 )
@@ -104,7 +200,12 @@ public:
 
     State state;
     bool failed;
+    bool overQuota;
     bool retried;
+    bool alone;
+    bool grouped;
+    bool idsAssigned;
+    Injector * carrier;
 
     Transaction *transaction;
 
@@ -130,11 +231,9 @@ public:
     HelperRowCreator * annotationNameCreator;
 
     Query * lockUidnext;
+    Map<int64> quotaUsage;
     Query * select;
-    Query * insert;
-
-    uint substate;
-    Transaction * subtransaction;
+    Query * bodypartIds;
 
     Dict<BodypartRow> hashes;
     List<BodypartRow> bodyparts;
@@ -197,6 +296,185 @@ public:
 };
 
 
+/*! \class InjectionGroup injector.cpp
+    Merges concurrent injections into a single transaction.
+
+    Each Injector normally uses its own Transaction, so a burst of
+    deliveries to the same mailboxes turns into a long line of small
+    transactions, each waiting for the previous one's mailbox row locks
+    and each paying for its own commit.
+
+    Up to injection-groups groups are injected at the same time, each
+    by one carrier Injector. While all of them are busy, the Injectors
+    that arrive wait, and when a group is done, up to
+    injection-group-size of the waiting messages are injected as the
+    next group. The waiting time is thus at most the duration of the
+    shortest running transaction, one slow group cannot hold up all
+    the others, and an idle server doesn't delay anything.
+
+    If a group fails, each Injector in it is retried on its own, so
+    that one bad message (or one mailbox owner who is over quota)
+    affects only the command that submitted it.
+*/
+
+class InjectionGroup
+    : public EventHandler
+{
+public:
+    InjectionGroup(): EventHandler(), carrier( 0 ) {}
+
+    void execute();
+
+    static bool add( Injector * );
+    static void start();
+
+    Injector * carrier;
+    List<Injector> members;
+};
+
+
+static List<Injector> * waiting;
+static List<InjectionGroup> * groups;
+
+
+/*! Adds \a i to the current group and returns true, or returns false
+    if \a i must do its own work.
+*/
+
+bool InjectionGroup::add( Injector * i )
+{
+    if ( i->d->alone || i->d->transaction ||
+         Configuration::scalar( Configuration::InjectionGroupSize ) < 2 )
+        return false;
+
+    // An invalid message will make its injector fail, so there's no
+    // point in letting it fail a whole group.
+    List<Injectee>::Iterator m( i->d->messages );
+    while ( m ) {
+        if ( !m->valid() )
+            return false;
+        ++m;
+    }
+
+    if ( !::waiting ) {
+        ::waiting = new List<Injector>;
+        Allocator::addEternal( ::waiting, "injectors waiting for a group" );
+        ::groups = new List<InjectionGroup>;
+        Allocator::addEternal( ::groups, "injection groups" );
+        ::groupCommits = new GraphableCounter( "injection-groups" );
+    }
+
+    i->d->grouped = true;
+    ::waiting->append( i );
+    start();
+    return true;
+}
+
+
+/*! Starts a carrier Injector for as many of the waiting Injectors as
+    injection-group-size permits, and repeats until no more are
+    waiting or injection-groups carriers are busy.
+*/
+
+void InjectionGroup::start()
+{
+    uint size = Configuration::scalar( Configuration::InjectionGroupSize );
+    uint max = Configuration::scalar( Configuration::InjectionGroups );
+    if ( max < 1 )
+        max = 1;
+    while ( !::waiting->isEmpty() && ::groups->count() < max ) {
+        InjectionGroup * g = new InjectionGroup;
+        uint n = 0;
+        while ( !::waiting->isEmpty() &&
+                ( g->members.isEmpty() ||
+                  n + ::waiting->firstElement()->d->messages.count()
+                  <= size ) ) {
+            Injector * i = ::waiting->shift();
+            n += i->d->messages.count();
+            g->members.append( i );
+        }
+        ::groups->append( g );
+        g->carrier = new Injector( g );
+        // the carrier does the group's work, it mustn't join a group
+        g->carrier->d->alone = true;
+        List<Injector>::Iterator i( g->members );
+        while ( i ) {
+            g->carrier->addInjection( &i->d->injectables );
+            List<InjectorData::Delivery>::Iterator di( i->d->deliveries );
+            while ( di ) {
+                g->carrier->d->deliveries.append( di );
+                ++di;
+            }
+            Dict<Address>::Iterator a( i->d->addresses );
+            while ( a ) {
+                g->carrier->addAddress( a );
+                ++a;
+            }
+            ++i;
+        }
+
+        if ( g->members.count() > 1 )
+            g->log( "Injecting " + fn( n ) + " messages for " +
+                    fn( g->members.count() ) +
+                    " injectors in one transaction" );
+        ::groupCommits->tick();
+        g->carrier->execute();
+    }
+}
+
+
+/*! Reports the carrier's result to each member of the group once the
+    carrier is done, and starts the next group.
+*/
+
+void InjectionGroup::execute()
+{
+    if ( !carrier || !carrier->done() )
+        return;
+
+    Injector * c = carrier;
+    carrier = 0;
+    List<InjectionGroup>::Iterator g( ::groups->find( this ) );
+    if ( g )
+        ::groups->take( g );
+
+    if ( c->failed() && members.count() > 1 ) {
+        // The addresses may have been given IDs by the transaction
+        // that was just rolled back.
+        Dict<Address>::Iterator a( c->d->addresses );
+        while ( a ) {
+            a->setId( 0 );
+            ++a;
+        }
+
+        List<Injector>::Iterator i( members );
+        while ( i ) {
+            Injector * m = i;
+            ++i;
+            m->d->alone = true;
+            m->d->grouped = false;
+            m->d->messages.clear();
+            m->execute();
+        }
+    }
+    else {
+        List<Injector>::Iterator i( members );
+        while ( i ) {
+            Injector * m = i;
+            ++i;
+            m->d->carrier = c;
+            m->d->grouped = false;
+            m->d->failed = c->d->failed;
+            m->d->overQuota = c->d->overQuota;
+            m->d->state = Done;
+            m->execute();
+        }
+    }
+
+    start();
+}
+
+
 /*! \class Injector injector.h
     Stores message objects in the database.
 
@@ -281,6 +559,12 @@ EString Injector::error() const
     if ( !d->failed )
         return "";
 
+    if ( d->carrier )
+        return d->carrier->error();
+
+    if ( d->overQuota )
+        return "Mailbox owner is over quota";
+
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
         Message * m = it;
@@ -295,6 +579,16 @@ EString Injector::error() const
 }
 
 
+/*! Returns true if injection failed because the owner of a target
+    mailbox would have exceeded the owner's quota, and false otherwise.
+*/
+
+bool Injector::overQuota() const
+{
+    return d->overQuota;
+}
+
+
 /*! This private function advances the injector to the next state. */
 
 void Injector::next()
@@ -320,6 +614,9 @@ void Injector::execute()
 {
     Scope x( log() );
 
+    if ( d->grouped )
+        return;
+
     State last;
 
     // We start in state Inactive, and execute the functions responsible
@@ -338,6 +635,9 @@ void Injector::execute()
             if ( d->messages.isEmpty() ) {
                 d->state = Done;
             }
+            else if ( InjectionGroup::add( this ) ) {
+                return;
+            }
             else {
                 if ( !d->transaction )
                     d->transaction = new Transaction( this );
@@ -384,15 +684,20 @@ void Injector::execute()
             selectMessageIds();
             break;
 
-        case SelectingUids:
-            selectUids();
-            break;
-
         case InsertingMessages:
             insertMessages();
             insertDeliveries();
             insertThreadIndexes();
             next();
+            break;
+
+        case SelectingUids:
+            selectUids();
+            break;
+
+        case InsertingMailboxMessages:
+            insertMailboxMessages();
+            next();
             if ( !d->mailboxes.isEmpty() ) {
                 cache();
                 Mailbox::refreshMailboxes( d->transaction );
@@ -407,9 +712,21 @@ void Injector::execute()
             if ( d->failed || d->transaction->failed() ) {
                 ::failures->tick();
                 Cache::clearAllCaches( false );
+                // a cached address ID may refer to a row "aox vacuum"
+                // has deleted, so look them up afresh next time
+                Dict<Address>::Iterator ai( d->addresses );
+                while ( ai ) {
+                    AddressCreator::forgetId( ai );
+                    ++ai;
+                }
             }
             else {
                 ::successes->tick();
+                Dict<Address>::Iterator ai( d->addresses );
+                while ( ai ) {
+                    AddressCreator::cacheId( ai );
+                    ++ai;
+                }
             }
 
             next();
@@ -424,7 +741,7 @@ void Injector::execute()
     }
     while ( last != d->state && d->state != Done && !d->failed );
 
-    if ( d->state == Done && d->owner ) {
+    if ( ( d->state == Done || d->failed ) && d->owner ) {
         if ( d->failed )
             log( "Injection failed: " + error() );
         else
@@ -662,15 +979,18 @@ void Injector::addAddress( Address * a )
 
 
 /*! Returns the database ID of \a a, or 0 if this injector hasn't added
-    \a a to the database.
+    \a a to the database and this process hasn't seen it recently.
 */
 
 uint Injector::addressId( Address * a )
 {
+    if ( d->carrier )
+        return d->carrier->addressId( a );
+
     Address * a2 = d->addresses.find( AddressCreator::key( a ) );
-    if ( !a2 )
-        return 0;
-    return a2->id();
+    if ( a2 && a2->id() )
+        return a2->id();
+    return AddressCreator::cachedId( a );
 }
 
 
@@ -839,8 +1159,10 @@ void Injector::convertInReplyTo()
             // have this antecedent
             List<Message>::Iterator m( d->outlooks.find( *msgid ) );
             while ( m ) {
-                if ( !m->header()->field( HeaderField::References ) )
+                if ( !m->header()->field( HeaderField::References ) ) {
                     m->header()->add( "References", ref );
+                    m->setRawText( "" );
+                }
                 ++m;
             }
         }
@@ -857,8 +1179,10 @@ void Injector::convertInReplyTo()
         ++id;
         List<Message>::Iterator m( d->outlooks.find( msgid ) );
         while ( m ) {
-            if ( !m->header()->field( HeaderField::References ) )
+            if ( !m->header()->field( HeaderField::References ) ) {
                 m->header()->add( "References", msgid );
+                m->setRawText( "" );
+            }
             ++m;
         }
     }
@@ -896,6 +1220,7 @@ void Injector::addMoreReferences()
         while ( child ) {
             if ( !child->header()->field( HeaderField::References ) ) {
                 child->header()->add( "References", r );
+                child->setRawText( "" );
                 queue.append( child );
             }
             ++child;
@@ -1057,10 +1382,12 @@ void Injector::convertThreadIndex()
                     }
                 }
             }
-            if ( !ref.isEmpty() )
+            if ( !ref.isEmpty() ) {
                 m->header()->add( "References",
                                   ref.simplified().wrapped( 60, "", " ",
                                                             false ) );
+                m->setRawText( "" );
+            }
             ++m;
         }
         ++i;
@@ -1117,145 +1444,119 @@ void Injector::insertThreadRoots()
 
 
 /*! Inserts all unique bodyparts in the messages into the bodyparts
-    table, and updates the in-memory objects with the newly-created
-    bodyparts.ids. */
+    table. The new bodyparts.ids are read by selectMessageIds(), so
+    that both the bodyparts and the message IDs need only one round
+    trip between them.
+
+    The store_bodyparts() function does all of the work of finding
+    existing copies of each bodypart and inserting the new ones on the
+    server, so all we need to send is the bodyparts themselves, one
+    array per column.
+*/
 
 void Injector::insertBodyparts()
 {
-    uint last;
-
-    do {
-        last = d->substate;
-
-        if ( d->substate == 0 ) {
-            List<Injectee>::Iterator it( d->messages );
-            while ( it ) {
-                Message * m = it;
-                List<Bodypart>::Iterator bi( m->allBodyparts() );
-                while ( bi ) {
-                    addBodypartRow( bi );
-                    ++bi;
-                }
-                ++it;
-            }
-
-            if ( d->bodyparts.isEmpty() )
-                d->substate = 5;
-            else
-                d->substate++;
+    List<Injectee>::Iterator it( d->messages );
+    while ( it ) {
+        Message * m = it;
+        List<Bodypart>::Iterator bi( m->allBodyparts() );
+        while ( bi ) {
+            addBodypartRow( bi );
+            ++bi;
         }
+        ++it;
+    }
 
-        if ( d->substate == 1 ) {
-            Query * create =
-                new Query( "create temporary table bp ("
-                           "bid integer, bytes integer, "
-                           "hash text, text text, data bytea, "
-                           "i integer, n boolean default 'f')", 0 );
-
-            Query * copy =
-                new Query( "copy bp (bytes,hash,text,data,i) "
-                           "from stdin with binary", this );
-
-            uint i = 0;
-            List<BodypartRow>::Iterator bi( d->bodyparts );
-            while ( bi ) {
-                BodypartRow * br = bi;
-
-                copy->bind( 1, br->bytes );
-                copy->bind( 2, br->hash );
-                if ( br->text )
-                    copy->bind( 3, *br->text );
-                else
-                    copy->bindNull( 3 );
-                if ( br->data )
-                    copy->bind( 4, *br->data );
-                else
-                    copy->bindNull( 4 );
-                copy->bind( 5, i++ );
-                copy->submitLine();
-
-                ++bi;
-            }
+    if ( d->bodyparts.isEmpty() ) {
+        next();
+        return;
+    }
 
-            d->transaction->enqueue( create );
-            d->transaction->enqueue( copy );
-            d->subtransaction = d->transaction->subTransaction( this );
+    // the numbers are the type OIDs of int4, text, bytea and bool
+    BinaryArray bytes( 23 );
+    BinaryArray hashes( 25 );
+    BinaryArray texts( 25 );
+    BinaryArray data( 17 );
+    BinaryArray compression( 23 );
+    BinaryArray external( 16 );
 
-            d->substate++;
-        }
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        BodypartRow * br = bi;
 
-        if ( d->substate == 2 ) {
-            Query * setId =
-                new Query( "update bp set bid=b.id from bodyparts b where "
-                           "bp.hash=b.hash and not bp.text is distinct from "
-                           "b.text and not bp.data is distinct from b.data",
-                           0 );
-
-            Query * setNew =
-                new Query( "update bp set bid=nextval('bodypart_ids')::int, "
-                           "n='t' where bid is null", 0 );
-
-            d->insert =
-                new Query( "insert into bodyparts "
-                           "(id,bytes,hash,text,data) "
-                           "select bid,bytes,hash,text,data "
-                           "from bp where n", this );
-
-            d->substate++;
-            d->subtransaction->enqueue( setId );
-            d->subtransaction->enqueue( setNew );
-            d->subtransaction->enqueue( d->insert );
-            d->subtransaction->execute();
+        bytes.append( br->bytes );
+        hashes.append( br->hash );
+        if ( br->text )
+            texts.append( *br->text );
+        else
+            texts.appendNull();
+        EString compressed;
+        if ( br->data && BlobStore::wants( *br->data ) &&
+             BlobStore::store( br->hash, *br->data ) ) {
+            data.appendNull();
+            compression.appendNull();
+            external.append( true );
         }
-
-        if ( d->substate == 3 ) {
-            if ( !d->insert->done() )
-                return;
-
-            if ( d->insert->failed() ) {
-                // this will fail only if there is some kind of
-                // serious, serious failure, the kind where retrying
-                // will fail again.
-                d->subtransaction->commit();
-                d->substate = 100;
+        else {
+            if ( br->data )
+                compressed = compressedBodypart( *br->data );
+            if ( !compressed.isEmpty() ) {
+                data.append( compressed );
+                compression.append( 1u );
+            }
+            else if ( br->data ) {
+                data.append( *br->data );
+                compression.appendNull();
             }
             else {
-                d->substate++;
-                d->subtransaction->commit();
-                d->select =
-                    new Query( "select bid from bp order by i", this );
-                d->transaction->enqueue( d->select );
-                d->transaction->enqueue( new Query( "drop table bp", 0 ) );
-                d->transaction->execute();
+                data.appendNull();
+                compression.appendNull();
             }
+            external.appendNull();
         }
 
-        if ( d->substate == 4 ) {
-            if ( !d->select->done() )
-                return;
+        ++bi;
+    }
 
-            List<BodypartRow>::Iterator bi( d->bodyparts );
-            while ( bi ) {
-                BodypartRow * br = bi;
-                Row * r = d->select->nextRow();
-                uint id = r->getInt( "bid" );
+    d->bodypartIds =
+        new Query( "select store_bodyparts($1::integer[],$2::text[],"
+                   "$3::text[],$4::bytea[],$5::integer[],$6::boolean[]) "
+                   "as bid", this );
+    d->bodypartIds->bind( 1, bytes.data(), Query::Binary );
+    d->bodypartIds->bind( 2, hashes.data(), Query::Binary );
+    d->bodypartIds->bind( 3, texts.data(), Query::Binary );
+    d->bodypartIds->bind( 4, data.data(), Query::Binary );
+    d->bodypartIds->bind( 5, compression.data(), Query::Binary );
+    d->bodypartIds->bind( 6, external.data(), Query::Binary );
+    d->transaction->enqueue( d->bodypartIds );
+    next();
+}
 
-                List<Bodypart>::Iterator it( br->bodyparts );
-                while ( it ) {
-                    it->setId( id );
-                    ++it;
-                }
 
-                ++bi;
-            }
-            d->substate++;
+/*! Sets the ID of each bodypart from the results of the query sent by
+    insertBodyparts(), if there was one.
+*/
+
+void Injector::setBodypartIds()
+{
+    if ( !d->bodypartIds )
+        return;
+
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi && d->bodypartIds->hasResults() ) {
+        BodypartRow * br = bi;
+        Row * r = d->bodypartIds->nextRow();
+        uint id = r->getInt( "bid" );
+
+        List<Bodypart>::Iterator it( br->bodyparts );
+        while ( it ) {
+            it->setId( id );
+            ++it;
         }
-    }
-    while ( last != d->substate );
 
-    d->select = 0;
-    d->insert = 0;
-    next();
+        ++bi;
+    }
+    d->bodypartIds = 0;
 }
 
 
@@ -1272,6 +1573,27 @@ Query * Injector::selectNextvals( const EString & sequence, uint num )
 }
 
 
+/*! Returns the compressed form of the bodyparts.data value \a data,
+    or an empty string if it should be stored as it is (because
+    compress-bodyparts is disabled, or because \a data is too small or
+    doesn't compress well, as is the case for JPEGs, ZIP files etc).
+
+    The compressed form is stored with bodyparts.compression set to 1,
+    and the Fetcher uses EString::uncompressed() to read it.
+*/
+
+EString Injector::compressedBodypart( const EString & data )
+{
+    if ( !Configuration::toggle( Configuration::CompressBodyparts ) ||
+         data.length() < 256 )
+        return "";
+    EString c = data.compressed();
+    if ( c.length() > data.length() * 9 / 10 )
+        return "";
+    return c;
+}
+
+
 /*! Adds \a b to the list of bodyparts if it's not there already. */
 
 void Injector::addBodypartRow( Bodypart * b )
@@ -1350,55 +1672,159 @@ void Injector::addBodypartRow( Bodypart * b )
 }
 
 
+/*! Returns the text to be stored in raw_messages for \a m, or an
+    empty string if nothing should be stored.
+
+    The original is stored if store-raw-messages is enabled, unless
+    the message has been changed since it was parsed (whoever changes
+    it calls Message::setRawText() with an empty string), its header
+    isn't all ASCII or something in it needs unicode. Newlines are
+    converted to CRLF, as IMAP and POP require.
+*/
+
+static EString rawTextToStore( Message * m )
+{
+    if ( !Configuration::toggle( Configuration::StoreRawMessages ) )
+        return "";
+
+    EString raw = m->rawText();
+    if ( raw.isEmpty() || m->needsUnicode() )
+        return "";
+
+    raw = raw.crlf();
+    int e = raw.find( "\r\n\r\n" );
+    if ( e < 0 )
+        e = raw.length();
+    int i = 0;
+    while ( i < e ) {
+        if ( raw[i] & 0x80 )
+            return "";
+        i++;
+    }
+    return raw;
+}
+
+
 /*! This function inserts rows into the messages table for each Message
     in d->messages, and updates the objects with the newly-created ids.
-    It expects to be called repeatedly until it returns true, which it
-    does only when the work is done, or an error occurs.
+    The ids come from a per-process pool, which is refilled from
+    messages_id_seq when it runs low. It also waits for the bodypart
+    ids requested by insertBodyparts(), since insertMessages() needs
+    those.
 */
 
 void Injector::selectMessageIds()
 {
-    if ( !d->select ) {
-        d->select = selectNextvals( "messages_id_seq", d->messages.count() );
+    if ( !::messageIds ) {
+        ::messageIds = new IdPool;
+        Allocator::addEternal( ::messageIds, "message ID pool" );
+    }
+
+    uint needed = d->messages.count();
+    if ( !d->idsAssigned && !d->select &&
+         ::messageIds->ids.count() < needed ) {
+        time_t now = time( 0 );
+        if ( now < ::messageIds->refilled + 60 &&
+             ::messageIds->block < 4096 )
+            ::messageIds->block *= 2;
+        else if ( now > ::messageIds->refilled + 600 &&
+                  ::messageIds->block > 16 )
+            ::messageIds->block /= 2;
+        ::messageIds->refilled = now;
+
+        uint n = ::messageIds->block;
+        if ( n < needed )
+            n = needed;
+        d->select = selectNextvals( "messages_id_seq", n );
         d->transaction->enqueue( d->select );
         d->transaction->execute();
     }
 
-    if ( !d->select->done() )
-        return;
-
-    if ( d->select->failed() )
-        return;
+    if ( d->select ) {
+        if ( !d->select->done() )
+            return;
+        if ( d->select->failed() )
+            return;
+        while ( d->select->hasResults() )
+            ::messageIds->ids.add( d->select->nextRow()->getInt( "id" ) );
+        d->select = 0;
+        if ( ::messageIds->ids.count() < needed ) {
+            // another injector took some of them, so ask again
+            selectMessageIds();
+            return;
+        }
+    }
 
-    Query * copy
-        = new Query( "copy messages "
-                     "(id,rfc822size,idate,thread_root) "
-                     "from stdin with binary", this );
+    if ( !d->idsAssigned ) {
+        Query * copy
+            = new Query( "copy messages "
+                         "(id,rfc822size,idate,thread_root,raw) "
+                         "from stdin with binary", this );
 
-    List<Injectee>::Iterator m( d->messages );
-    while ( m && d->select->hasResults() ) {
-        Row * r = d->select->nextRow();
-        m->setDatabaseId( r->getInt( "id" ) );
-        copy->bind( 1, m->databaseId() );
-        if ( !m->hasTrivia() ) {
-            m->setRfc822Size( m->rfc822( false ).length() );
-            m->setTriviaFetched( true );
-        }
-        copy->bind( 2, m->rfc822Size() );
-        copy->bind( 3, internalDate( m ) );
-        uint tr = d->threads->id( m->header()->messageId() );
-        if ( tr ) {
-            copy->bind( 4, tr );
-            m->setThreadId( tr );
+        EStringList hashes;
+        Dict<EString> * rawTexts = new Dict<EString>;
+        List<Injectee>::Iterator m( d->messages );
+        while ( m ) {
+            uint id = ::messageIds->ids.smallest();
+            ::messageIds->ids.remove( id );
+            m->setDatabaseId( id );
+            copy->bind( 1, m->databaseId() );
+            EString raw = rawTextToStore( m );
+            m->setRawText( raw );
+            if ( !raw.isEmpty() ) {
+                // RFC822.SIZE has to match what BODY[] will return
+                m->setRfc822Size( raw.length() );
+                m->setTriviaFetched( true );
+            }
+            else if ( !m->hasTrivia() ) {
+                m->setRfc822Size( m->rfc822( false ).length() );
+                m->setTriviaFetched( true );
+            }
+            copy->bind( 2, m->rfc822Size() );
+            copy->bind( 3, internalDate( m ) );
+            uint tr = d->threads->id( m->header()->messageId() );
+            if ( tr ) {
+                copy->bind( 4, tr );
+                m->setThreadId( tr );
+            }
+            else {
+                copy->bindNull( 4 );
+            }
+            if ( raw.isEmpty() ) {
+                copy->bindNull( 5 );
+            }
+            else {
+                EString hash = MD5::hash( raw ).hex();
+                if ( !rawTexts->contains( hash ) ) {
+                    rawTexts->insert( hash, new EString( raw ) );
+                    hashes.append( hash );
+                }
+                copy->bind( 5, hash );
+            }
+            copy->submitLine();
+            ++m;
         }
-        else {
-            copy->bindNull( 4 );
+
+        if ( !hashes.isEmpty() ) {
+            // this uses a subtransaction, which blocks the copy until
+            // the raw_messages rows exist
+            RawMessageCreator * rc
+                = new RawMessageCreator( hashes, rawTexts,
+                                         d->transaction );
+            rc->execute();
         }
-        copy->submitLine();
-        ++m;
+
+        d->transaction->enqueue( copy );
+        d->idsAssigned = true;
     }
 
-    d->transaction->enqueue( copy );
+    if ( d->bodypartIds ) {
+        if ( !d->bodypartIds->done() ) {
+            d->transaction->execute();
+            return;
+        }
+        setBodypartIds();
+    }
 
     next();
 }
@@ -1429,9 +1855,19 @@ void Injector::selectUids()
     // message.
     //
     // To protect against concurrent injection into the same
-    // mailboxes, we hold a write lock on the mailboxes during
-    // injection; thus, the Injectors try to acquire locks in the same
-    // order to avoid deadlock.
+    // mailboxes, we hold a write lock on the mailboxes until we
+    // commit; thus, the Injectors try to acquire locks in the same
+    // order to avoid deadlock. The lock is what makes transactions
+    // commit in UID order, so that no client ever sees a UID appear
+    // below one it has already seen. It is taken only after
+    // insertMessages() has enqueued the bulky per-message COPYs, so
+    // what's done while holding it is just the mailbox_messages,
+    // flags and annotations rows and the commit.
+    //
+    // The same query tells us how much each mailbox owner is using
+    // (from mailbox_counters, which the database keeps up to date)
+    // and what the owner's quota is, so we can refuse an injection that
+    // would put someone over quota without any extra round trips.
 
     if ( !d->lockUidnext ) {
         if ( d->mailboxes.isEmpty() ) {
@@ -1447,8 +1883,13 @@ void Injector::selectUids()
         }
 
         d->lockUidnext = new Query(
-            "select id,uidnext,nextmodseq,first_recent from mailboxes "
-            "where id=any($1) order by id for update", this );
+            "select mb.id,mb.uidnext,mb.nextmodseq,mb.first_recent,"
+            "mb.owner,u.quota,"
+            "(select coalesce(sum(c.size),0)::bigint "
+            "from mailbox_counters c join mailboxes o on (c.mailbox=o.id) "
+            "where o.owner=mb.owner) as used "
+            "from mailboxes mb left join users u on (mb.owner=u.id) "
+            "where mb.id=any($1) order by mb.id for update of mb", this );
         d->lockUidnext->bind( 1, ids );
         d->transaction->enqueue( d->lockUidnext );
         d->transaction->execute();
@@ -1460,6 +1901,11 @@ void Injector::selectUids()
         uint uidnext = r->getInt( "uidnext" );
         int64 nextms = r->getBigint( "nextmodseq" );
 
+        if ( !r->isNull( "owner" ) && !r->isNull( "quota" ) )
+            checkQuota( r->getInt( "owner" ),
+                        r->getBigint( "quota" ) * 1024,
+                        r->getBigint( "used" ), mb->messages );
+
         if ( uidnext > 0x7ff00000 ) {
             Log::Severity level = Log::Significant;
             if ( uidnext > 0x7fffff00 )
@@ -1517,12 +1963,54 @@ void Injector::selectUids()
         d->transaction->enqueue( u );
     }
 
+    if ( d->overQuota ) {
+        d->failed = true;
+        d->state = AwaitingCompletion;
+        d->transaction->rollback();
+        return;
+    }
+
     if ( d->lockUidnext->done() )
         next();
 }
 
 
-/*! Injects messages into the correct tables. */
+/*! This private helper adds the size of \a messages to what \a owner
+    already \a uses, and notes that the injection must fail if the
+    total exceeds \a quota bytes. The total is remembered, so that
+    several target mailboxes belonging to the same owner are counted
+    together.
+*/
+
+void Injector::checkQuota( uint owner, int64 quota, int64 used,
+                           const List<Injectee> & messages )
+{
+    int64 * total = d->quotaUsage.find( owner );
+    if ( !total ) {
+        total = (int64*)Allocator::alloc( sizeof( int64 ), 0 );
+        *total = used;
+        d->quotaUsage.insert( owner, total );
+    }
+
+    List<Injectee>::Iterator it( messages );
+    while ( it ) {
+        *total += it->rfc822Size();
+        ++it;
+    }
+
+    if ( *total > quota ) {
+        log( "Refusing injection: user " + fn( owner ) +
+             " would use " + fn( *total ) + " bytes, but the quota is " +
+             fn( quota ) + " bytes" );
+        d->overQuota = true;
+    }
+}
+
+
+/*! Injects the parts of each message that don't depend on its
+    mailboxes or UIDs into the correct tables. insertMailboxMessages()
+    does the rest.
+*/
 
 void Injector::insertMessages()
 {
@@ -1538,25 +2026,15 @@ void Injector::insertMessages()
                    "from stdin with binary", 0 );
     Query * qd =
         new Query( "copy date_fields (message,value) from stdin", 0 );
-
-    Query * qm =
-        new Query( "copy mailbox_messages "
-                   "(mailbox,uid,message,modseq,seen,deleted) "
-                   "from stdin with binary", 0 );
-    Query * qf =
-        new Query( "copy flags (mailbox,uid,flag) "
-                   "from stdin with binary", 0 );
-    Query * qn =
-        new Query( "copy annotations (mailbox,uid,name,value,owner) "
-                   "from stdin with binary", 0 );
     Query * qw =
         new Query( "copy unparsed_messages (bodypart) "
                    "from stdin with binary", 0 );
+    Query * qs =
+        new Query( "copy message_structures "
+                   "(message,envelope,body,bodystructure) "
+                   "from stdin with binary", 0 );
 
-    uint flags = 0;
     uint wrapped = 0;
-    uint mailboxes = 0;
-    uint annotations = 0;
 
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
@@ -1570,6 +2048,15 @@ void Injector::insertMessages()
         addPartNumber( qp, mid, "" );
         addHeader( qh, qa, qd, mid, "", m->header() );
 
+        // FETCH ENVELOPE/BODY/BODYSTRUCTURE can use these instead of
+        // looking at everything we insert here.
+
+        qs->bind( 1, mid );
+        qs->bind( 2, ImapStructure::envelope( m, false ) );
+        qs->bind( 3, ImapStructure::bodyStructure( m, false, false ) );
+        qs->bind( 4, ImapStructure::bodyStructure( m, true, false ) );
+        qs->submitLine();
+
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
         // don't need to inject them into the database again.
@@ -1615,6 +2102,37 @@ void Injector::insertMessages()
         ++it;
     }
 
+    d->transaction->enqueue( qp );
+    d->transaction->enqueue( qh );
+    d->transaction->enqueue( qa );
+    d->transaction->enqueue( qd );
+    d->transaction->enqueue( qs );
+    if ( wrapped )
+        d->transaction->enqueue( qw );
+}
+
+
+/*! Inserts the mailbox_messages, flags and annotations rows for each
+    message, using the UIDs and modseqs assigned by selectUids().
+*/
+
+void Injector::insertMailboxMessages()
+{
+    Query * qm =
+        new Query( "copy mailbox_messages "
+                   "(mailbox,uid,message,modseq,seen,deleted) "
+                   "from stdin with binary", 0 );
+    Query * qf =
+        new Query( "copy flags (mailbox,uid,flag) "
+                   "from stdin with binary", 0 );
+    Query * qn =
+        new Query( "copy annotations (mailbox,uid,name,value,owner) "
+                   "from stdin with binary", 0 );
+
+    uint flags = 0;
+    uint mailboxes = 0;
+    uint annotations = 0;
+
     List<Injectee>::Iterator imi( d->injectables );
     while ( imi ) {
         Injectee * m = imi;
@@ -1636,18 +2154,12 @@ void Injector::insertMessages()
         }
     }
 
-    d->transaction->enqueue( qp );
-    d->transaction->enqueue( qh );
-    d->transaction->enqueue( qa );
-    d->transaction->enqueue( qd );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
         d->transaction->enqueue( qf );
     if ( annotations )
         d->transaction->enqueue( qn );
-    if ( wrapped )
-        d->transaction->enqueue( qw );
 }
 
 
@@ -1827,8 +2339,10 @@ void Injector::insertDeliveries()
     if ( d->deliveries.isEmpty() )
         return;
 
+    IntegerSet spooled;
     List<InjectorData::Delivery>::Iterator di( d->deliveries );
     while ( di ) {
+        spooled.add( di->message->databaseId() );
         Address * sender =
             d->addresses.find( AddressCreator::key( di->sender ) );
 
@@ -1888,7 +2402,16 @@ void Injector::insertDeliveries()
         ++di;
     }
 
-    d->transaction->enqueue( new Query( "notify deliveries_updated", 0 ) );
+    // The payload tells the SpoolManager which messages to schedule.
+    // PostgreSQL limits payloads to 8000 bytes; an empty payload makes
+    // it look at the entire spool instead.
+
+    EString ids = spooled.csl();
+    if ( ids.length() > 7000 )
+        ids.truncate();
+    Query * q = new Query( "select pg_notify('deliveries_updated',$1)", 0 );
+    q->bind( 1, ids );
+    d->transaction->enqueue( q );
 }
 
 
@@ -55,6 +55,7 @@ public:
 
     bool done() const;
     bool failed() const;
+    bool overQuota() const;
     EString error() const;
 
     void addInjection( List<Injectee> * );
@@ -66,10 +67,14 @@ public:
     void addAddress( Address * );
     uint addressId( Address * );
 
+    static EString compressedBodypart( const EString & );
+
 private:
     class InjectorData * d;
+    friend class InjectionGroup;
 
     void next();
+    void checkQuota( uint, int64, int64, const List<Injectee> & );
     void createMailboxes();
     void findMessages();
     void findDependencies();
@@ -82,9 +87,11 @@ private:
     void insertThreadRoots();
     void insertBodyparts();
     void addBodypartRow( Bodypart * );
+    void setBodypartIds();
     void selectMessageIds();
     void selectUids();
     void insertMessages();
+    void insertMailboxMessages();
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
     void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
@@ -28,7 +28,8 @@ public:
         : databaseId( 0 ), threadId( 0 ),
           wrapped( false ), rfc822Size( 0 ), internalDate( 0 ),
           hasHeaders( false ), hasAddresses( false ), hasBodies( false ),
-          hasTrivia( false ), hasBytesAndLines( false )
+          hasTrivia( false ), hasBytesAndLines( false ),
+          hasStructures( false ), hasRawText( false )
     {}
 
     EString error;
@@ -45,6 +46,14 @@ public:
     bool hasBodies: 1;
     bool hasTrivia : 1;
     bool hasBytesAndLines : 1;
+    bool hasStructures : 1;
+    bool hasRawText : 1;
+
+    EString envelope;
+    EString bodyStructure;
+    EString extendedBodyStructure;
+
+    EString rawText;
 };
 
 
@@ -89,6 +98,7 @@ void Message::parse( const EString & rfc2822 )
     setHeader( parseHeader( i, rfc2822.length(), rfc2822, Header::Rfc2822 ) );
     header()->repair();
     header()->repair( this, rfc2822.mid( i ) );
+    setRawText( rfc2822 );
 
     ContentType * ct = header()->contentType();
     if ( ct && ct->type() == "multipart" ) {
@@ -538,6 +548,93 @@ void Message::setTriviaFetched( bool ok )
 }
 
 
+/*! Returns true if the Fetcher has looked for this message's stored
+    ENVELOPE and BODYSTRUCTURE, and false if not. Even if this returns
+    true, imapEnvelope() may be empty, if nothing was stored.
+*/
+
+bool Message::hasImapStructures() const
+{
+    return d->hasStructures;
+}
+
+
+/*! Records the IMAP \a envelope, \a body and \a bodyStructure
+    stored for this message, and that they have been looked for. Any
+    of the three may be empty.
+*/
+
+void Message::setImapStructures( const EString & envelope,
+                                 const EString & body,
+                                 const EString & bodyStructure )
+{
+    d->envelope = envelope;
+    d->bodyStructure = body;
+    d->extendedBodyStructure = bodyStructure;
+    d->hasStructures = true;
+}
+
+
+/*! Returns the stored IMAP ENVELOPE of this message, or an empty
+    string if none is known. The stored form never contains unencoded
+    UTF-8.
+*/
+
+EString Message::imapEnvelope() const
+{
+    return d->envelope;
+}
+
+
+/*! Returns the stored IMAP BODYSTRUCTURE of this message if \a
+    extended is true, or its BODY if \a extended is false. Returns an
+    empty string if none is known.
+*/
+
+EString Message::imapBodyStructure( bool extended ) const
+{
+    if ( extended )
+        return d->extendedBodyStructure;
+    return d->bodyStructure;
+}
+
+
+/*! Returns true if this Message knows whether its original text is
+    available (because it was parse()d or the Fetcher looked for it),
+    and false if not. Even if this returns true, rawText() may be
+    empty.
+*/
+
+bool Message::hasRawText() const
+{
+    return d->hasRawText;
+}
+
+
+/*! Records that \a text is the original text of this message. An
+    empty \a text means that the original is not available, e.g.
+    because it was not stored or because the message has been changed
+    since it was parsed.
+*/
+
+void Message::setRawText( const EString & text )
+{
+    d->rawText = text;
+    d->hasRawText = true;
+}
+
+
+/*! Returns the original text of this message, as recorded by
+    setRawText(), or an empty string if it isn't known. Unlike
+    rfc822(), this is not reconstructed from the parsed message.
+*/
+
+EString Message::rawText() const
+{
+    return d->rawText;
+}
+
+
 /*! Tries to remove the prefixes and suffixes used by MUAs from \a subject
     to find a base subject that can be used to tie threads together
     linearly.
@@ -873,6 +970,7 @@ void Message::addMessageId( const EString & domain )
     header()->add( "Message-Id",
                    "<" + x.hash().e64().mid( 0, 21 ) + ".md5@" +
                    domain + ">" );
+    setRawText( "" );
 }
 
 
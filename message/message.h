@@ -61,6 +61,16 @@ public:
     bool hasBytesAndLines() const;
     void setBytesAndLinesFetched();
 
+    bool hasImapStructures() const;
+    void setImapStructures( const EString &, const EString &,
+                            const EString & );
+    EString imapEnvelope() const;
+    EString imapBodyStructure( bool ) const;
+
+    bool hasRawText() const;
+    void setRawText( const EString & );
+    EString rawText() const;
+
     static UString baseSubject( const UString & );
 
     static EString acceptableBoundary( const EString & );
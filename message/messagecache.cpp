@@ -2,32 +2,113 @@
 
 #include "messagecache.h"
 
+#include "configuration.h"
+#include "integerset.h"
+#include "bodypart.h"
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
+#include "graph.h"
 #include "map.h"
 
-#include <time.h> // time(0)
-
 
 static class MessageCache * c = 0;
 
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+static GraphableCounter * evictions = 0;
+static GraphableNumber * bytes = 0;
+
 
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData()
+        : Garbage(), first( 0 ), last( 0 ), size( 0 ), generation( 0 )
+    {}
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry( Mailbox * mb, uint u, Message * m )
+            : Garbage(), mailbox( mb ), uid( u ), message( m ),
+              cost( 0 ), pins( 0 ), pinned( 0 ),
+              prev( 0 ), next( 0 )
+        {}
+
+        Mailbox * mailbox;
+        uint uid;
+        Message * message;
+        uint cost;
+        uint pins;
+        uint pinned;
+        Entry * prev;
+        Entry * next;
+    };
+
+    Map<Map<Entry> > m;
+    Entry * first;
+    Entry * last;
+    uint size;
+    uint generation;
+
+    Entry * entry( Mailbox * mb, uint uid ) {
+        Map<Entry> * mbcache = m.find( mb->id() );
+        if ( !mbcache )
+            return 0;
+        return mbcache->find( uid );
+    }
+
+    void unlink( Entry * e ) {
+        if ( e->prev )
+            e->prev->next = e->next;
+        else
+            first = e->next;
+        if ( e->next )
+            e->next->prev = e->prev;
+        else
+            last = e->prev;
+        e->prev = 0;
+        e->next = 0;
+    }
+
+    void use( Entry * e ) {
+        if ( e == first )
+            return;
+        unlink( e );
+        e->next = first;
+        if ( first )
+            first->prev = e;
+        first = e;
+        if ( !last )
+            last = e;
+    }
 };
 
 
 /*! \class MessageCache messagecache.h
 
-  The MessageCache class caches messages until the Allocator decides
-  to clear out old Garbage. As a special feature, it can also cache
-  messages a few seconds longer, although that should be used
-  sparingly.
+  The MessageCache class caches messages across garbage collections,
+  keeping the recently used ones up to a configurable size.
+
+  Each time the Allocator frees memory, clear() estimates how much
+  memory each cached Message uses and discards the least recently used
+  messages until the total is within the message-cache-size setting
+  (in megabytes). The estimate counts headers, bodies and trivia
+  separately, so a message whose bodies have been fetched costs much
+  more than one where only the envelope is known.
+
+  Commands which work on many messages for a long time, such as Fetch,
+  can protect() their messages so they aren't evicted while in use,
+  and should release() them when done. A protection lapses after a few
+  garbage collections, so a command which dies early can't pin its
+  messages for ever.
+
+  The hit, miss and eviction counts and the estimated size are
+  available as GraphableNumber objects called message-cache-hits,
+  message-cache-misses, message-cache-evictions and message-cache-size.
 */
 
 
@@ -36,9 +117,13 @@ public:
 */
 
 MessageCache::MessageCache()
-    : Cache( 1 ), d( new MessageCacheData )
+    : Cache( 0 ), d( new MessageCacheData )
 {
-    // nothing
+    hits = new GraphableCounter( "message-cache-hits" );
+    misses = new GraphableCounter( "message-cache-misses" );
+    evictions = new GraphableCounter( "message-cache-evictions" );
+    bytes = new GraphableNumber( "message-cache-size" );
+    bytes->setValue( 0 );
 }
 
 
@@ -51,35 +136,107 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
 {
     if ( !Server::useCache() )
         return;
+    if ( !Configuration::scalar( Configuration::MessageCacheSize ) )
+        return;
     if ( !c )
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+    Map<MessageCacheData::Entry> * mbcache = c->d->m.find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
+        mbcache = new Map<MessageCacheData::Entry>;
         c->d->m.insert( mb->id(), mbcache );
     }
-    mbcache->insert( uid, m );
+    MessageCacheData::Entry * e = mbcache->find( uid );
+    if ( e ) {
+        e->message = m;
+    }
+    else {
+        e = new MessageCacheData::Entry( mb, uid, m );
+        mbcache->insert( uid, e );
+    }
+    c->d->use( e );
 }
 
 
 /*! Looks for a message in \a mailbox with \a uid in the cache and
-    returns a pointer to it, or a null pointer.
+    returns a pointer to it, or a null pointer. Each call counts as
+    either a hit or a miss.
 */
 
 class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
     if ( !c )
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
-    if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+    MessageCacheData::Entry * e = c->d->entry( mailbox, uid );
+    if ( !e ) {
+        misses->tick();
+        return 0;
+    }
+    c->d->use( e );
+    hits->tick();
+    return e->message;
 }
 
 
+/*! Estimates how many bytes \a m uses. This is very approximate, but
+    distinguishes between messages for which only the trivia are
+    known, those with headers and those with bodies.
+*/
+
+static uint cost( Message * m )
+{
+    uint n = 512; // the Message itself, its trivia and our Entry
+    if ( m->hasHeaders() || m->hasAddresses() ) {
+        List<HeaderField> * fields = m->header()->fields();
+        if ( fields )
+            n += 128 * fields->count();
+    }
+    if ( m->hasBodies() ) {
+        List<Bodypart>::Iterator i( m->allBodyparts() );
+        while ( i ) {
+            n += i->data().length() + 4 * i->text().length();
+            ++i;
+        }
+    }
+    return n;
+}
+
+
+/*! Discards the least recently used messages until the cache fits
+    within its configured size. Messages which are protect()ed are
+    kept unless they have been protected for more than a few garbage
+    collections.
+*/
+
 void MessageCache::clear()
 {
-    d->m.clear();
+    d->generation++;
+
+    d->size = 0;
+    MessageCacheData::Entry * e = d->first;
+    while ( e ) {
+        e->cost = ::cost( e->message );
+        d->size += e->cost;
+        e = e->next;
+    }
+
+    uint budget = 1024 * 1024 *
+                  Configuration::scalar( Configuration::MessageCacheSize );
+    e = d->last;
+    while ( e && d->size > budget ) {
+        MessageCacheData::Entry * p = e->prev;
+        if ( !e->pins || d->generation - e->pinned > 4 ) {
+            d->unlink( e );
+            Map<MessageCacheData::Entry> * mbcache
+                = d->m.find( e->mailbox->id() );
+            if ( mbcache )
+                mbcache->remove( e->uid );
+            d->size -= e->cost;
+            evictions->tick();
+        }
+        e = p;
+    }
+
+    bytes->setValue( d->size );
 }
 
 
@@ -96,3 +253,39 @@ class Message * MessageCache::provide( class Mailbox * mailbox, uint uid )
     insert( mailbox, uid, m );
     return m;
 }
+
+
+/*! Records that the messages in \a mailbox with the UIDs in \a uids
+    are in use and should not be evicted until release() is called.
+*/
+
+void MessageCache::protect( class Mailbox * mailbox, const IntegerSet & uids )
+{
+    if ( !c )
+        return;
+    uint n = 1;
+    while ( n <= uids.count() ) {
+        MessageCacheData::Entry * e = c->d->entry( mailbox, uids.value( n ) );
+        if ( e ) {
+            e->pins++;
+            e->pinned = c->d->generation;
+        }
+        n++;
+    }
+}
+
+
+/*! Reverses the effect of protect() for \a uids in \a mailbox. */
+
+void MessageCache::release( class Mailbox * mailbox, const IntegerSet & uids )
+{
+    if ( !c )
+        return;
+    uint n = 1;
+    while ( n <= uids.count() ) {
+        MessageCacheData::Entry * e = c->d->entry( mailbox, uids.value( n ) );
+        if ( e && e->pins )
+            e->pins--;
+        n++;
+    }
+}
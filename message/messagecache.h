@@ -6,6 +6,9 @@
 #include "cache.h"
 
 
+class IntegerSet;
+
+
 class MessageCache
     : public Cache
 {
@@ -17,6 +20,9 @@ public:
     static class Message * find( class Mailbox *, uint );
     static class Message * provide( class Mailbox *, uint );
 
+    static void protect( class Mailbox *, const IntegerSet & );
+    static void release( class Mailbox *, const IntegerSet & );
+
     void clear();
 
 private:
@@ -14,6 +14,9 @@
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
+#include "allocator.h"
+#include "resolver.h"
+#include "dict.h"
 // time
 #include <time.h>
 
@@ -28,7 +31,10 @@ public:
           wbt( 0 ), wbs( 0 ),
           enhancedstatuscodes( false ),
           unicode( false ),
-          size( false )
+          size( false ), pipelining( false ), chunking( false ),
+          closed( false ), idle( false ), greeted( false ),
+          batched( 0 ), skip( 0 ), closeTimer( 0 ), successor( 0 ),
+          failureRecorded( false )
     {}
 
     enum State { Invalid,
@@ -52,6 +58,14 @@ public:
     bool enhancedstatuscodes;
     bool unicode;
     bool size;
+    bool pipelining;
+    bool chunking;
+    bool closed;
+    bool idle;
+    bool greeted;
+    EString destination;
+    uint batched;
+    uint skip;
     Timer * closeTimer;
     class TimerCloser
         : public EventHandler
@@ -62,9 +76,153 @@ public:
         SmtpClient * t;
     };
     TimerCloser * timerCloser;
+    SmtpClient * successor;
+    bool failureRecorded;
 };
 
 
+class SmtpDestination
+    : public EventHandler
+{
+public:
+    SmtpDestination()
+        : EventHandler(), lookup( 0 ), result( 0 ), resolved( 0 ),
+          next( 0 ), tried( 0 ), failures( 0 ), until( 0 )
+    {}
+
+    void execute();
+
+    EStringList exchangers() const;
+
+    MxLookup * lookup;
+    MxLookup * result;
+    uint resolved;
+    uint next;
+    uint tried;
+    uint failures;
+    uint until;
+    List<EventHandler> waiting;
+};
+
+
+/*! Takes over the result of the MX lookup once it's done, and lets
+    everyone waiting for this destination try again.
+*/
+
+void SmtpDestination::execute()
+{
+    if ( !lookup || !lookup->done() )
+        return;
+
+    result = lookup;
+    lookup = 0;
+    resolved = (uint)::time( 0 );
+    next = 0;
+    tried = 0;
+
+    List<EventHandler> w;
+    w.append( waiting );
+    waiting.clear();
+    List<EventHandler>::Iterator i( w );
+    while ( i ) {
+        i->notify();
+        ++i;
+    }
+}
+
+
+/*! Returns the mail exchangers found by the most recent MX lookup, or
+    an empty list if there are none.
+*/
+
+EStringList SmtpDestination::exchangers() const
+{
+    if ( !result )
+        return EStringList();
+    return result->exchangers();
+}
+
+
+static SmtpDestination * smarthost = 0;
+static Dict<SmtpDestination> * destinations = 0;
+
+
+/*! Returns the queue and MX state for \a domain, or for the
+    smarthost if \a domain is empty.
+*/
+
+static SmtpDestination * destination( const EString & domain )
+{
+    if ( domain.isEmpty() ) {
+        if ( !::smarthost ) {
+            ::smarthost = new SmtpDestination;
+            Allocator::addEternal( ::smarthost, "smarthost queue" );
+        }
+        return ::smarthost;
+    }
+
+    if ( !::destinations ) {
+        ::destinations = new Dict<SmtpDestination>;
+        Allocator::addEternal( ::destinations, "outgoing mail domains" );
+    }
+    SmtpDestination * dest = ::destinations->find( domain );
+    if ( !dest ) {
+        dest = new SmtpDestination;
+        ::destinations->insert( domain, dest );
+    }
+    return dest;
+}
+
+
+/*! Records that a connection to \a domain failed before the server
+    greeted us. The next connection will use the next MX.
+
+    Once every MX has failed since the last success, no new connection
+    is made for a while: one minute after the first such round,
+    doubling with each subsequent one up to an hour.
+*/
+
+static void recordFailure( const EString & domain )
+{
+    if ( domain.isEmpty() )
+        return;
+    SmtpDestination * dest = destination( domain );
+    dest->next++;
+    dest->tried++;
+    if ( dest->tried < dest->exchangers().count() )
+        return;
+
+    dest->tried = 0;
+    uint backoff = 60;
+    uint i = 0;
+    while ( i < dest->failures && backoff < 3600 ) {
+        backoff *= 2;
+        i++;
+    }
+    if ( backoff > 3600 )
+        backoff = 3600;
+    dest->failures++;
+    dest->until = (uint)::time( 0 ) + backoff;
+    ::log( "Will not connect to " + domain + " for " + fn( backoff ) +
+           " seconds", Log::Info );
+}
+
+
+/*! Records that a server for \a domain greeted us, and that the
+    domain can be used freely.
+*/
+
+static void recordSuccess( const EString & domain )
+{
+    if ( domain.isEmpty() )
+        return;
+    SmtpDestination * dest = destination( domain );
+    dest->failures = 0;
+    dest->tried = 0;
+    dest->until = 0;
+}
+
+
 /*! \class SmtpClient smtpclient.h
 
     The SmtpClient class provides an SMTP client, as the alert reader
@@ -72,6 +230,27 @@ public:
 
     Archiveopteryx uses it to send outgoing messages to a smarthost.
 
+    The clients form a pool: provide() hands out an idle client if
+    there is one, opens a new connection if there are fewer than
+    smarthost-connections, and otherwise asks the caller to wait. Each
+    connection is reused for as many messages as possible.
+
+    Normally all mail goes to the smarthost. If use-smarthost is
+    disabled, DeliveryAgent asks for a client for each recipient
+    domain instead, and provide() connects to the domain's MX hosts,
+    in order of preference. Each domain has its own pool, limited to
+    domain-connections. The MX records are looked up by MxLookup,
+    without blocking. If an MX can't be reached, the message is handed
+    to a new client for the next MX at once. Once all of them have
+    failed, destinationStatus() reports the domain as unavailable for
+    a while, longer after each failure, so its messages are deferred
+    without anyone having to wait for a connection.
+
+    If the server supports PIPELINING (RFC 2920), SmtpClient sends the
+    entire envelope and the DATA command in one write and matches up
+    the responses afterwards. If it supports CHUNKING (RFC 3030), it
+    sends the message using BDAT instead of DATA, which avoids both
+    dot-stuffing and a round-trip.
 */
 
 /*! Constructs an SMTP client which will immediately connect to \a
@@ -99,6 +278,7 @@ void SmtpClient::react( Event e )
     Connection::State s1 = Connection::state();
     SmtpClientData::State s2 = d->state;
     EString s3 = d->error;
+    bool closed = d->closed;
     switch ( e ) {
     case Read:
         parse();
@@ -134,7 +314,9 @@ void SmtpClient::react( Event e )
         }
         log( "SMTP server timed out", Log::Error );
         d->error = "Server timeout.";
-        finish( "4.4.1" );
+        d->closed = true;
+        if ( !handOver() )
+            finish( "4.4.1" );
         close();
         break;
 
@@ -145,15 +327,18 @@ void SmtpClient::react( Event e )
 
     case Error:
     case Close:
+        d->closed = true;
         if ( state() == Connecting ) {
             d->error = "Connection refused by SMTP/LMTP server";
-            finish( "4.4.1" );
+            if ( !handOver() )
+                finish( "4.4.1" );
         }
         else if ( d->state != SmtpClientData::Invalid &&
                   d->sent != "quit" ) {
             log( "Unexpected close by server", Log::Error );
             d->error = "Unexpected close by server.";
-            finish( "4.4.2" );
+            if ( !handOver() )
+                finish( "4.4.2" );
         }
         break;
 
@@ -166,6 +351,46 @@ void SmtpClient::react( Event e )
     if ( d->owner &&
          ( s1 != Connection::state() || s2 != d->state || s3 != d->error ) )
         d->owner->notify();
+
+    // A closed connection leaves room in the pool for another. If
+    // the server never greeted us, everyone waiting for this
+    // destination should try the next MX, or learn that it's
+    // unavailable.
+    if ( d->closed && !closed ) {
+        d->idle = false;
+        if ( !d->greeted && !d->failureRecorded )
+            recordFailure( d->destination );
+        wakeWaiters( d->destination, !d->greeted );
+    }
+}
+
+
+/*! Gives the message this client is sending to a new client for the
+    next MX, if this client's server never greeted us and another MX
+    may be tried at once. Returns true if a new client took over the
+    message, and false if the caller should finish() as usual.
+*/
+
+bool SmtpClient::handOver()
+{
+    if ( d->greeted || d->failureRecorded || !d->dsn ||
+         d->destination.isEmpty() )
+        return false;
+
+    recordFailure( d->destination );
+    d->failureRecorded = true;
+    SmtpClient * c = connectToExchanger( d->destination );
+    if ( !c )
+        return false;
+
+    log( "Trying the next MX for " + d->destination );
+    d->successor = c;
+    c->send( d->dsn, d->owner );
+    d->dsn = 0;
+    d->dotted.truncate();
+    d->owner = 0;
+    d->log = 0;
+    return true;
 }
 
 
@@ -192,14 +417,25 @@ void SmtpClient::parse()
                 recordExtension( *s );
             }
         }
+        else if ( (*s)[3] == ' ' && d->skip ) {
+            // the response to a pipelined command that we no longer
+            // care about, because the transaction failed earlier.
+            d->skip--;
+            log( "Ignoring response to pipelined command", Log::Debug );
+        }
         else if ( (*s)[3] == ' ' ) {
+            if ( d->batched )
+                d->batched--;
             switch ( response/100 ) {
             case 1:
                 d->error = "Server sent 1xx response: " + *s;
                 break;
             case 2:
-                if ( d->state == SmtpClientData::Connected )
+                if ( d->state == SmtpClientData::Connected ) {
                     d->state = SmtpClientData::Banner;
+                    d->greeted = true;
+                    recordSuccess( d->destination );
+                }
                 if ( d->state == SmtpClientData::Hello )
                     recordExtension( *s );
                 SmtpHelo::setUnicodeSupported( d->unicode );
@@ -228,6 +464,7 @@ void SmtpClient::parse()
                 handleFailure( *s );
                 if ( response == 421 ) {
                     log( "Closing because the SMTP server sent 421" );
+                    d->closed = true;
                     close();
                     d->state = SmtpClientData::Invalid;
                 }
@@ -253,6 +490,8 @@ void SmtpClient::parse()
 void SmtpClient::sendCommand()
 {
     EString send;
+    EString payload;
+    uint batch = 0;
 
     switch( d->state ) {
     case SmtpClientData::Invalid:
@@ -277,13 +516,15 @@ void SmtpClient::sendCommand()
         if ( d->dsn->sender()->type() == Address::Normal )
             send.append( d->dsn->sender()->lpdomain() );
         send.append( ">" );
-        if ( d->dsn->message()->needsUnicode() ) {
+        if ( d->dsn->message()->needsUnicode() )
             send.append( " smtputf8" );
-            if ( d->dotted.isEmpty() )
-                d->dotted = dotted( d->dsn->message()->rfc822( false ) );
-        }
-        else if ( d->dotted.isEmpty() ) {
-            d->dotted = dotted( d->dsn->message()->rfc822( true ) );
+        if ( d->dotted.isEmpty() ) {
+            EString m( d->dsn->message()->rfc822(
+                           !d->dsn->message()->needsUnicode() ) );
+            if ( d->chunking )
+                d->dotted = crlf( m, false );
+            else
+                d->dotted = dotted( m );
         }
         if ( d->size ) {
             send.append( " size=" );
@@ -291,6 +532,30 @@ void SmtpClient::sendCommand()
         }
 
         d->state = SmtpClientData::MailFrom;
+
+        if ( d->pipelining ) {
+            // Send the whole envelope at once; parse() and
+            // handleFailure() walk through the responses in order.
+            batch = 1;
+            List<Recipient>::Iterator i( d->dsn->recipients() );
+            while ( i ) {
+                if ( i->action() == Recipient::Unknown ) {
+                    send.append( "\r\nrcpt to:<" +
+                                 i->finalRecipient()->lpdomain() + ">" );
+                    batch++;
+                }
+                ++i;
+            }
+            if ( d->chunking ) {
+                send.append( "\r\nbdat " + fn( d->dotted.length() ) +
+                             " last" );
+                payload = d->dotted;
+            }
+            else {
+                send.append( "\r\ndata" );
+            }
+            batch++;
+        }
         break;
 
     case SmtpClientData::MailFrom:
@@ -308,7 +573,12 @@ void SmtpClient::sendCommand()
             send = "rcpt to:<" + d->rcptTo->finalRecipient()->lpdomain() + ">";
         }
         else {
-            if ( !d->accepted.isEmpty() ) {
+            if ( !d->accepted.isEmpty() && d->chunking ) {
+                send = "bdat " + fn( d->dotted.length() ) + " last";
+                payload = d->dotted;
+                d->state = SmtpClientData::Body;
+            }
+            else if ( !d->accepted.isEmpty() ) {
                 send = "data";
                 d->state = SmtpClientData::Data;
             }
@@ -333,18 +603,16 @@ void SmtpClient::sendCommand()
                 ++i;
             }
         }
+        // The server has reset its state after the body, so there's
+        // no need to send rset and wait for the response.
         finish( "4.5.0" );
-        send = "rset";
         d->state = SmtpClientData::Rset;
-        break;
+        idle();
+        return;
 
     case SmtpClientData::Rset:
         finish( "4.5.0" );
-        delete d->closeTimer;
-        if ( idleClient() == this )
-            d->closeTimer = new Timer( d->timerCloser, 298 );
-        else
-            d->closeTimer = new Timer( d->timerCloser, 15 );
+        idle();
         return;
 
     case SmtpClientData::Error:
@@ -361,9 +629,25 @@ void SmtpClient::sendCommand()
     if ( send.isEmpty() )
         return;
 
+    if ( d->batched ) {
+        // The command was sent as part of a pipelined batch, unless
+        // it's an rset to abandon the transaction, in which case the
+        // responses to the rest of the batch don't matter.
+        if ( send != "rset" )
+            return;
+        d->skip = d->batched;
+        d->batched = 0;
+    }
+
     log( "Sending: " + send, Log::Debug );
     enqueue( send + "\r\n" );
+    if ( !payload.isEmpty() ) {
+        enqueue( payload );
+        d->wbs = writeBuffer()->size();
+        d->wbt = (uint)::time( 0 );
+    }
     d->sent = send;
+    d->batched = batch;
     setTimeoutAfter( 300 );
 }
 
@@ -374,8 +658,22 @@ void SmtpClient::sendCommand()
 */
 
 EString SmtpClient::dotted( const EString & s )
+{
+    EString r( crlf( s, true ) );
+    r.append( ".\r\n" );
+    return r;
+}
+
+
+/*! Returns a version of \a s in which each line ends with CRLF, as
+    BDAT requires, and which has dots escaped if \a escape is true.
+    A lone CR is treated like CRLF.
+*/
+
+EString SmtpClient::crlf( const EString & s, bool escape )
 {
     EString r;
+    r.reserve( s.length() + s.length() / 50 + 5 );
     uint i = 0;
     uint sol = true;
     while ( i < s.length() ) {
@@ -390,7 +688,7 @@ EString SmtpClient::dotted( const EString & s )
             r.append( "\r\n" );
         }
         else {
-            if ( sol && s[i] == '.' )
+            if ( escape && sol && s[i] == '.' )
                 r.append( '.' );
             r.append( s[i] );
             sol = false;
@@ -399,7 +697,6 @@ EString SmtpClient::dotted( const EString & s )
     }
     if ( !sol )
         r.append( "\r\n" );
-    r.append( ".\r\n" );
 
     return r;
 }
@@ -588,6 +885,7 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
     d->dotted.truncate();
     d->owner = user;
     d->sentMail = false;
+    d->idle = false;
     delete d->closeTimer;
     d->closeTimer = 0;
     if ( d->state == SmtpClientData::Rset )
@@ -618,6 +916,48 @@ void SmtpClient::finish( const char * status )
     d->dotted.truncate();
     d->owner = 0;
     d->log = 0;
+    d->accepted.clear();
+    d->rcptTo = List<Recipient>::Iterator();
+}
+
+
+/*! Marks this client as idle and available for the next message, and
+    gives it to one of the event handlers waiting for a client, if
+    any. Idle clients eventually log out.
+*/
+
+void SmtpClient::idle()
+{
+    d->idle = true;
+    delete d->closeTimer;
+    if ( idleClient( d->destination ) == this )
+        d->closeTimer = new Timer( d->timerCloser, 298 );
+    else
+        d->closeTimer = new Timer( d->timerCloser, 15 );
+    wakeWaiters( d->destination, false );
+}
+
+
+/*! Notifies the event handler that has waited longest for a client
+    for \a domain, if any, or all of them if \a all is true.
+*/
+
+void SmtpClient::wakeWaiters( const EString & domain, bool all )
+{
+    SmtpDestination * dest = destination( domain );
+    if ( all ) {
+        List<EventHandler> waiting;
+        waiting.append( dest->waiting );
+        dest->waiting.clear();
+        List<EventHandler>::Iterator i( waiting );
+        while ( i ) {
+            i->notify();
+            ++i;
+        }
+    }
+    else if ( !dest->waiting.isEmpty() ) {
+        dest->waiting.shift()->notify();
+    }
 }
 
 
@@ -640,9 +980,16 @@ void SmtpClient::recordExtension( const EString & line )
     else if ( w == "smtputf8" ) {
         d->unicode = true;
     }
+    else if ( w == "pipelining" ) {
+        d->pipelining = true;
+    }
+    else if ( w == "chunking" ) {
+        d->chunking = true;
+    }
     else if ( w == "size" ) {
         d->size = true;
-        ::observedSize = l.section( " ", 2 ).number( 0 );
+        if ( d->destination.isEmpty() )
+            ::observedSize = l.section( " ", 2 ).number( 0 );
     }
 }
 
@@ -665,6 +1012,8 @@ void SmtpClient::logout( uint t )
     if ( d->log )
         x.setLog( d->log );
     d->state = SmtpClientData::Quit;
+    d->idle = false;
+    d->closed = true;
     log( "Sending: quit", Log::Debug );
     enqueue( "quit\r\n" );
     d->sent = "quit";
@@ -682,30 +1031,156 @@ EString SmtpClient::error() const
 }
 
 
-/*! Provides an SMTP client.
+/*! Provides an SMTP client for mail to \a domain, or to the
+    smarthost if \a domain is empty.
 
     If one is idly waiting now, provide() returns its address. If not,
-    provide() makes one and then returns it.
+    and there are fewer than smarthost-connections (or
+    domain-connections) clients, provide() makes one and then returns
+    it. Otherwise provide() returns a null pointer, and notifies \a
+    user once a client is available, after which \a user should call
+    provide() again.
+
+    provide() also returns a null pointer (without notifying \a user
+    later) if \a domain cannot be reached at present. The caller
+    should check destinationStatus() if provide() returns null.
 */
 
-SmtpClient * SmtpClient::provide()
+SmtpClient * SmtpClient::provide( EventHandler * user,
+                                  const EString & domain )
 {
-    SmtpClient * c = idleClient();
+    SmtpClient * c = idleClient( domain );
     if ( c )
         return c;
 
-    Endpoint e( Configuration::SmartHostAddress,
-                Configuration::SmartHostPort );
-    return new SmtpClient( e );
+    SmtpDestination * dest = destination( domain );
+    uint max = Configuration::scalar( Configuration::SmartHostConnections );
+    if ( !domain.isEmpty() )
+        max = Configuration::scalar( Configuration::DomainConnections );
+    if ( max < 1 )
+        max = 1;
+    if ( openClients( domain ) < max ) {
+        if ( domain.isEmpty() ) {
+            Endpoint e( Configuration::SmartHostAddress,
+                        Configuration::SmartHostPort );
+            return new SmtpClient( e );
+        }
+
+        if ( !destinationStatus( domain ).isEmpty() )
+            return 0;
+
+        if ( dest->resolved )
+            return connectToExchanger( domain );
+        // else the MX lookup is still running, and we wait for it
+    }
+
+    if ( !dest->waiting.find( user ) )
+        dest->waiting.append( user );
+    return 0;
+}
+
+
+/*! Connects to the next MX for \a domain that has an address, and
+    returns the new client, or a null pointer if every MX has been
+    tried and \a domain is now backing off.
+*/
+
+SmtpClient * SmtpClient::connectToExchanger( const EString & domain )
+{
+    SmtpDestination * dest = destination( domain );
+    EStringList exchangers = dest->exchangers();
+    while ( dest->until <= (uint)::time( 0 ) && !exchangers.isEmpty() ) {
+        EStringList::Iterator x( exchangers );
+        uint n = dest->next % exchangers.count();
+        while ( n ) {
+            ++x;
+            n--;
+        }
+        EStringList addresses = dest->result->addresses( *x );
+        Endpoint e;
+        if ( !addresses.isEmpty() )
+            e = Endpoint( *addresses.firstElement(),
+                          Configuration::scalar( Configuration::MxPort ) );
+        if ( e.valid() ) {
+            SmtpClient * c = new SmtpClient( e );
+            c->d->destination = domain;
+            return c;
+        }
+        ::log( "Cannot find an address for " + *x + ", MX for " + domain );
+        recordFailure( domain );
+    }
+    return 0;
+}
+
+
+/*! Returns an empty string if mail for \a domain can be sent now, and
+    an enhanced status code describing the problem if not. An empty
+    \a domain refers to the smarthost, which is always available.
+
+    Starts looking up the domain's MX records if necessary. Lookups
+    are repeated after an hour, or after five minutes if they failed.
+    While the first lookup is in progress, destinationStatus() returns
+    an empty string, and provide() makes its caller wait.
+*/
+
+EString SmtpClient::destinationStatus( const EString & domain )
+{
+    if ( domain.isEmpty() )
+        return "";
+
+    SmtpDestination * dest = destination( domain );
+    uint now = (uint)::time( 0 );
+    uint ttl = 3600;
+    if ( dest->exchangers().isEmpty() )
+        ttl = 300;
+    if ( !dest->lookup && ( !dest->resolved || dest->resolved + ttl < now ) ) {
+        dest->lookup = new MxLookup( domain, dest );
+        dest->execute();
+    }
+
+    if ( !dest->resolved )
+        return "";
+    if ( dest->exchangers().isEmpty() && dest->result->permanent() )
+        return "5.1.2";
+    if ( dest->exchangers().isEmpty() )
+        return "4.4.3";
+    if ( dest->until > now )
+        return "4.4.1";
+    return "";
+}
+
+
+/*! Returns the number of SmtpClient objects for \a domain whose
+    connections are open or being opened.
+*/
+
+uint SmtpClient::openClients( const EString & domain )
+{
+    uint n = 0;
+    List<Connection>::Iterator c( EventLoop::global()->connections() );
+    while ( c ) {
+        if ( c->type() == Connection::SmtpClient ) {
+            Connection * tmp = c;
+            SmtpClient * sc = (SmtpClient*)tmp;
+            if ( !sc->d->closed && sc->d->destination == domain )
+                n++;
+        }
+        ++c;
+    }
+    return n;
 }
 
 
 /*! Returns true if the most recent transmission attempt worked for at
-    least one recipient, and false if not.
+    least one recipient, and false if not. If this client couldn't
+    reach its server and handed the message to a client for the next
+    MX, sent() reports on that client.
 */
 
 bool SmtpClient::sent() const
 {
+    if ( d->successor )
+        return d->successor->sent();
     return d->sentMail;
 }
 
@@ -720,18 +1195,20 @@ DSN * SmtpClient::sending() const
 }
 
 
-/*! This private helper returns a pointer to an idle SMTP client, or a
-    null pointer if none are idle.
+/*! This private helper returns a pointer to an idle SMTP client for
+    \a domain, or a null pointer if none are idle.
 */
 
-SmtpClient * SmtpClient::idleClient()
+SmtpClient * SmtpClient::idleClient( const EString & domain )
 {
     List<Connection>::Iterator c( EventLoop::global()->connections() );
     while ( c ) {
         if ( c->type() == Connection::SmtpClient ) {
             Connection * tmp = c;
             SmtpClient * sc = (SmtpClient*)tmp;
-            if ( sc->d->state == SmtpClientData::Rset )
+            if ( sc->d->idle && !sc->d->closed &&
+                 sc->d->destination == domain &&
+                 sc->d->state == SmtpClientData::Rset )
                 return sc;
         }
         ++c;
@@ -4,11 +4,11 @@
 #define SMTPCLIENT_H
 
 #include "connection.h"
+#include "estring.h"
 #include "event.h"
 
 
 class DSN;
-class EString;
 class Message;
 class Address;
 class Recipient;
@@ -22,7 +22,8 @@ public:
 
     void react( Event );
 
-    static SmtpClient * provide();
+    static SmtpClient * provide( EventHandler *, const EString & = "" );
+    static EString destinationStatus( const EString & );
 
     bool ready() const;
     void send( DSN *, EventHandler * );
@@ -42,11 +43,17 @@ private:
     void sendCommand();
     void handleFailure( const EString & );
     void finish( const char * status );
+    void idle();
     void recordExtension( const EString & );
+    bool handOver();
 
     static EString dotted( const EString & );
+    static EString crlf( const EString &, bool );
 
-    static SmtpClient * idleClient();
+    static SmtpClient * idleClient( const EString & );
+    static SmtpClient * connectToExchanger( const EString & );
+    static uint openClients( const EString & );
+    static void wakeWaiters( const EString &, bool );
 };
 
 
@@ -29,7 +29,8 @@ public:
           m( 0 ), r( 0 ),
           user( 0 ), mailbox( 0 ), permissions( 0 ),
           session( 0 ), sentFetch( false ), started( false ),
-          message( 0 ), n( 0 ), findIds( 0 ), map( 0 )
+          fetchingParts( false ), fetcher( 0 ), message( 0 ), n( 0 ),
+          findIds( 0 ), map( 0 )
     {}
 
     POP * pop;
@@ -47,6 +48,8 @@ public:
     IntegerSet set;
     bool sentFetch;
     bool started;
+    bool fetchingParts;
+    Fetcher * fetcher;
     Message * message;
     int n;
 
@@ -649,7 +652,21 @@ bool PopCommand::retr( bool lines )
         }
 
         d->started = true;
+        if ( !d->message->hasRawText() ) {
+            Fetcher * f = new Fetcher( d->message, this );
+            f->fetch( Fetcher::RawText );
+            f->execute();
+        }
+    }
+
+    if ( !d->message->hasRawText() )
+        return false;
+
+    EString raw = d->message->rawText();
+    if ( raw.isEmpty() && !d->fetchingParts ) {
+        d->fetchingParts = true;
         Fetcher * f = new Fetcher( d->message, this );
+        d->fetcher = f;
         if ( !d->message->hasBodies() )
             f->fetch( Fetcher::Body );
         if ( !d->message->hasHeaders() )
@@ -659,11 +676,17 @@ bool PopCommand::retr( bool lines )
         f->execute();
     }
 
-    if ( !( d->message->hasBodies() &&
+    if ( raw.isEmpty() &&
+         !( d->message->hasBodies() &&
             d->message->hasHeaders() &&
             d->message->hasAddresses() ) )
         return false;
 
+    if ( d->fetcher && d->fetcher->failed() ) {
+        d->pop->err( "Cannot read message" );
+        return true;
+    }
+
     if ( d->message->rfc822Size() > 2 )
         d->pop->ok( "Done" );
     else {
@@ -673,7 +696,10 @@ bool PopCommand::retr( bool lines )
     }
 
     Buffer * b = new Buffer;
-    b->append( d->message->rfc822( true ) ); // XXX always downgrades
+    if ( !raw.isEmpty() )
+        b->append( raw );
+    else
+        b->append( d->message->rfc822( true ) ); // XXX always downgrades
 
     int ln = d->n;
     bool header = true;
@@ -472,6 +472,21 @@ Buffer *Connection::writeBuffer() const
 }
 
 
+/*! Returns the number of bytes this Connection has yet to send. The
+    default implementation returns the size of the writeBuffer();
+    subclasses which hold back output (e.g. to stream large responses
+    piecemeal) add what they hold back.
+
+    Producers such as Fetcher use this to decide when to stop
+    generating output.
+*/
+
+uint Connection::writeBacklog() const
+{
+    return d->w->size();
+}
+
+
 static union {
     struct sockaddr_in in;
     struct sockaddr_in6 in6;
@@ -56,6 +56,7 @@ public:
 
     Buffer * writeBuffer() const;
     Buffer * readBuffer() const;
+    virtual uint writeBacklog() const;
     Endpoint self() const;
     Endpoint peer() const;
     void setType( Type );
@@ -0,0 +1,304 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "parallelsearch.h"
+
+#include "configuration.h"
+#include "allocator.h"
+#include "selector.h"
+#include "estringlist.h"
+#include "mailbox.h"
+#include "query.h"
+#include "user.h"
+#include "map.h"
+
+
+static List<ParallelSearch> * active;
+
+
+class ParallelSearchPiece
+    : public Garbage
+{
+public:
+    ParallelSearchPiece(): query( 0 ), done( false ) {}
+
+    List<Mailbox> mailboxes;
+    Query * query;
+    bool done;
+};
+
+
+class ParallelSearchData
+    : public Garbage
+{
+public:
+    ParallelSearchData()
+        : selector( 0 ), user( 0 ), owner( 0 ), started( false )
+    {}
+
+    Selector * selector;
+    User * user;
+    EventHandler * owner;
+    bool started;
+
+    List<ParallelSearchPiece> pieces;
+    List<Mailbox> order;
+    Map<IntegerSet> matches;
+    EString error;
+};
+
+
+/*! \class ParallelSearch parallelsearch.h
+
+    The ParallelSearch class runs a Selector over many mailboxes at
+    once, e.g. for ESEARCH (RFC 7377).
+
+    Instead of one large query covering every mailbox, the mailboxes
+    are split into pieces of roughly equal size (small mailboxes are
+    grouped, large ones searched alone), and each piece is searched
+    using a separate Query. Up to concurrency() of those queries run
+    at the same time for each user, so the database can use several
+    handles and CPUs for one search, and one user can't monopolise
+    all handles.
+
+    The results are made available in the order of the mailbox list
+    as soon as each mailbox and all preceding ones are done; the owner
+    is notified whenever there may be more, and should call
+    nextMailbox() and matches() until nextMailbox() returns null.
+*/
+
+
+/*! Constructs a search for the messages matching \a selector in
+    each of \a mailboxes, on behalf of \a user, and notifies \a owner
+    when there are results. \a user is used to apply the concurrency
+    limit and may be null.
+*/
+
+ParallelSearch::ParallelSearch( Selector * selector,
+                                List<Mailbox> * mailboxes,
+                                User * user, EventHandler * owner )
+    : EventHandler(), d( new ParallelSearchData )
+{
+    d->selector = selector;
+    d->user = user;
+    d->owner = owner;
+    split( mailboxes );
+}
+
+
+/*! Returns the largest number of queries which may run for one user
+    at the same time, as set by search-concurrency. The result is
+    always at least 1.
+*/
+
+uint ParallelSearch::concurrency()
+{
+    uint c = Configuration::scalar( Configuration::SearchConcurrency );
+    if ( !c )
+        return 1;
+    return c;
+}
+
+
+/*! Splits \a mailboxes into pieces, using uidnext as an estimate of
+    each mailbox's size. Each piece is about 1/4 of the work allotted
+    to a single query by concurrency(), so that the pieces can be
+    spread evenly over the handles even if the estimate is poor.
+*/
+
+void ParallelSearch::split( List<Mailbox> * mailboxes )
+{
+    uint total = 0;
+    List<Mailbox>::Iterator i( mailboxes );
+    while ( i ) {
+        if ( i->id() && !i->deleted() ) {
+            d->order.append( i );
+            total += i->uidnext();
+        }
+        ++i;
+    }
+
+    uint target = total / ( concurrency() * 4 ) + 1;
+    ParallelSearchPiece * p = 0;
+    uint size = 0;
+    i = d->order.first();
+    while ( i ) {
+        if ( !p || size + i->uidnext() > target ) {
+            p = new ParallelSearchPiece;
+            d->pieces.append( p );
+            size = 0;
+        }
+        p->mailboxes.append( i );
+        size += i->uidnext();
+        ++i;
+    }
+}
+
+
+/*! Returns the number of queries currently running for this search's
+    user, by any ParallelSearch.
+*/
+
+uint ParallelSearch::running() const
+{
+    uint n = 0;
+    List<ParallelSearch>::Iterator s( ::active );
+    while ( s ) {
+        if ( s->d->user == d->user ) {
+            List<ParallelSearchPiece>::Iterator p( s->d->pieces );
+            while ( p ) {
+                if ( p->query && !p->done )
+                    n++;
+                ++p;
+            }
+        }
+        ++s;
+    }
+    return n;
+}
+
+
+void ParallelSearch::execute()
+{
+    if ( !::active ) {
+        ::active = new List<ParallelSearch>;
+        Allocator::addEternal( ::active, "active parallel searches" );
+    }
+    if ( !d->started ) {
+        d->started = true;
+        ::active->append( this );
+    }
+
+    bool progress = false;
+    List<ParallelSearchPiece>::Iterator p( d->pieces );
+    while ( p ) {
+        if ( p->query && !p->done && p->query->done() ) {
+            p->done = true;
+            progress = true;
+            if ( p->query->failed() && d->error.isEmpty() )
+                d->error = p->query->error();
+            Row * r;
+            while ( (r=p->query->nextRow()) != 0 ) {
+                uint m = r->getInt( "mailbox" );
+                IntegerSet * s = d->matches.find( m );
+                if ( !s ) {
+                    s = new IntegerSet;
+                    d->matches.insert( m, s );
+                }
+                s->add( r->getInt( "uid" ) );
+            }
+        }
+        ++p;
+    }
+
+    uint c = concurrency();
+    uint n = running();
+    p = d->pieces.first();
+    while ( p && n < c && d->error.isEmpty() ) {
+        if ( !p->query ) {
+            Selector * s = new Selector( Selector::And );
+            Selector * o = new Selector( Selector::Or );
+            List<Mailbox>::Iterator m( p->mailboxes );
+            while ( m ) {
+                Mailbox * mb = m;
+                o->add( new Selector( mb, false ) );
+                ++m;
+            }
+            s->add( o );
+            s->add( d->selector );
+            EStringList wanted;
+            wanted.append( "mailbox" );
+            wanted.append( "uid" );
+            p->query = s->query( 0, 0, 0, this, false, &wanted );
+            p->query->execute();
+            n++;
+        }
+        ++p;
+    }
+
+    if ( done() )
+        ::active->remove( this );
+
+    if ( !progress )
+        return;
+
+    // a query finished, so other searches by the same user may start
+    // one.
+    List<ParallelSearch>::Iterator s( ::active );
+    while ( s ) {
+        ParallelSearch * o = s;
+        ++s;
+        if ( o != this && o->d->user == d->user )
+            o->execute();
+    }
+
+    if ( d->owner )
+        d->owner->execute();
+}
+
+
+/*! Returns true if all queries have finished, or if one failed and
+    the others have finished. */
+
+bool ParallelSearch::done() const
+{
+    List<ParallelSearchPiece>::Iterator p( d->pieces );
+    while ( p ) {
+        if ( p->query && !p->done )
+            return false;
+        if ( !p->query && d->error.isEmpty() )
+            return false;
+        ++p;
+    }
+    return true;
+}
+
+
+/*! Returns true if any query failed. */
+
+bool ParallelSearch::failed() const
+{
+    return !d->error.isEmpty();
+}
+
+
+/*! Returns the error message from the first query that failed, or
+    an empty string if none has failed.
+*/
+
+EString ParallelSearch::error() const
+{
+    return d->error;
+}
+
+
+/*! Returns the next mailbox whose search is complete, or a null
+    pointer if the next mailbox in the list isn't done yet (or there
+    are no more). Each mailbox is returned once, in the order of the
+    list given to the constructor, including mailboxes with no
+    matches.
+*/
+
+Mailbox * ParallelSearch::nextMailbox()
+{
+    if ( d->order.isEmpty() || failed() )
+        return 0;
+    Mailbox * m = d->order.first();
+    List<ParallelSearchPiece>::Iterator p( d->pieces );
+    while ( p && !p->mailboxes.find( m ) )
+        ++p;
+    if ( !p || !p->done )
+        return 0;
+    d->order.shift();
+    return m;
+}
+
+
+/*! Returns the UIDs of the messages in \a m that match. */
+
+IntegerSet ParallelSearch::matches( Mailbox * m ) const
+{
+    IntegerSet * s = d->matches.find( m->id() );
+    if ( !s )
+        return IntegerSet();
+    return *s;
+}
@@ -0,0 +1,41 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef PARALLELSEARCH_H
+#define PARALLELSEARCH_H
+
+#include "event.h"
+#include "integerset.h"
+#include "list.h"
+
+
+class Mailbox;
+class Selector;
+class User;
+
+
+class ParallelSearch
+    : public EventHandler
+{
+public:
+    ParallelSearch( Selector *, List<Mailbox> *, User *, EventHandler * );
+
+    void execute();
+
+    bool done() const;
+    bool failed() const;
+    EString error() const;
+
+    Mailbox * nextMailbox();
+    IntegerSet matches( Mailbox * ) const;
+
+    static uint concurrency();
+
+private:
+    class ParallelSearchData * d;
+
+    void split( List<Mailbox> * );
+    uint running() const;
+};
+
+
+#endif
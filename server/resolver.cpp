@@ -6,6 +6,13 @@
 #include <resolv.h>
 #include <netdb.h>
 #include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 
 #if !defined( T_AAAA )
 // OS X defines T_AAAA in nameser_compat.h
@@ -15,8 +22,13 @@
 #include "resolver.h"
 
 #include "dict.h"
+#include "utf.h"
+#include "event.h"
+#include "buffer.h"
 #include "endpoint.h"
+#include "eventloop.h"
 #include "allocator.h"
+#include "ustringlist.h"
 #include "configuration.h"
 
 
@@ -38,13 +50,17 @@ public:
     until the process exits. It does not consider the TTLs on the DNS
     results.
 
-    The only public functions are resolve(), which does a cache lookup
+    The main public functions are resolve(), which does a cache lookup
     and failing that, a DNS lookup, and errors(), which returns a list
     of all errors seen so far. A server can ensure that it calls
     resolve() at startup time for all required names, and if errors()
     remains empty, all is well and remains well until the end of the
     process.
 
+    MxLookup looks up MX records for outgoing mail. Unlike resolve(),
+    it doesn't block the server, its results are not cached, and its
+    errors are not reported by errors().
+
     We need a class called Revolver.
 */
 
@@ -286,3 +302,533 @@ void Resolver::query( uint type, EStringList * results )
 
     // we don't care about the NS and AD sections, so we're done
 }
+
+
+/*! Returns \a label encoded using Punycode (RFC 3492), without the
+    "xn--" prefix.
+*/
+
+static EString punycode( const UString & label )
+{
+    const uint base = 36;
+    const uint tmin = 1;
+    const uint tmax = 26;
+
+    EString r;
+    uint i = 0;
+    while ( i < label.length() ) {
+        if ( label[i] < 128 )
+            r.append( (char)label[i] );
+        i++;
+    }
+    uint b = r.length();
+    uint h = b;
+    if ( b )
+        r.append( '-' );
+
+    uint n = 128;
+    uint delta = 0;
+    uint bias = 72;
+    while ( h < label.length() ) {
+        uint m = UINT_MAX;
+        i = 0;
+        while ( i < label.length() ) {
+            if ( label[i] >= n && label[i] < m )
+                m = label[i];
+            i++;
+        }
+        delta += ( m - n ) * ( h + 1 );
+        n = m;
+        i = 0;
+        while ( i < label.length() ) {
+            if ( label[i] < n ) {
+                delta++;
+            }
+            else if ( label[i] == n ) {
+                uint q = delta;
+                uint k = base;
+                while ( true ) {
+                    uint t = tmin;
+                    if ( k >= bias + tmax )
+                        t = tmax;
+                    else if ( k > bias )
+                        t = k - bias;
+                    if ( q < t )
+                        break;
+                    uint v = t + ( q - t ) % ( base - t );
+                    r.append( (char)( v < 26 ? 'a' + v : '0' + v - 26 ) );
+                    q = ( q - t ) / ( base - t );
+                    k += base;
+                }
+                r.append( (char)( q < 26 ? 'a' + q : '0' + q - 26 ) );
+
+                // adapt the bias (RFC 3492 section 6.1)
+                if ( h == b )
+                    delta = delta / 700;
+                else
+                    delta = delta / 2;
+                delta += delta / ( h + 1 );
+                k = 0;
+                while ( delta > ( ( base - tmin ) * tmax ) / 2 ) {
+                    delta = delta / ( base - tmin );
+                    k += base;
+                }
+                bias = k + ( base - tmin + 1 ) * delta / ( delta + 38 );
+                delta = 0;
+                h++;
+            }
+            i++;
+        }
+        delta++;
+        n++;
+    }
+    return r;
+}
+
+
+/*! Returns \a domain, which is UTF-8, in the form used in DNS
+    queries: Each label that isn't ASCII is converted to an IDNA
+    A-label ("xn--" followed by Punycode), and ASCII letters are
+    lowercased. Returns an empty string if \a domain isn't valid
+    UTF-8.
+
+    This does not perform the mapping step of UTS #46; labels are
+    expected to be lowercase already.
+*/
+
+EString Resolver::asciiDomain( const EString & domain )
+{
+    Utf8Codec c;
+    UString u = c.toUnicode( domain );
+    if ( !c.valid() )
+        return "";
+    if ( u.isAscii() )
+        return domain.lower();
+
+    EString r;
+    UStringList::Iterator l( UStringList::split( '.', u ) );
+    while ( l ) {
+        if ( !r.isEmpty() )
+            r.append( "." );
+        if ( l->isAscii() )
+            r.append( l->ascii().lower() );
+        else
+            r.append( "xn--" + punycode( *l ) );
+        ++l;
+    }
+    return r;
+}
+
+
+// This is what MxLookup passes to its thread. The thread can't use
+// Allocator, so this is malloc()ed, and freed by the thread.
+class MxRequest
+{
+public:
+    char domain[NS_MAXDNAME];
+    int fd;
+    bool use4;
+    bool use6;
+};
+
+
+/*! Writes \a a, \a b and \a c as a single line to \a fd. Called in
+    an MxLookup thread.
+*/
+
+static void writeLine( int fd, const char * a,
+                       const char * b = 0, const char * c = 0 )
+{
+    char line[2 * NS_MAXDNAME + 32];
+    ::snprintf( line, sizeof( line ), "%s%s%s%s%s\n",
+                a, b ? " " : "", b ? b : "", c ? " " : "", c ? c : "" );
+    uint l = ::strlen( line );
+    uint done = 0;
+    while ( done < l ) {
+        int n = ::write( fd, line + done, l - done );
+        if ( n <= 0 )
+            return;
+        done += n;
+    }
+}
+
+
+/*! Skips the header and question section of the \a len bytes in \a
+    reply, and returns a pointer to the answer section, or a null
+    pointer if \a reply is too short. Sets *\a count to the number of
+    answers.
+*/
+
+static const u_char * firstAnswer( const u_char * reply, int len,
+                                   uint * count )
+{
+    if ( len < 12 )
+        return 0;
+    const u_char * end = reply + len;
+    uint qdcount = ( reply[4] << 8 ) + reply[5];
+    *count = ( reply[6] << 8 ) + reply[7];
+    const u_char * p = reply + 12;
+    while ( qdcount && p < end ) {
+        int n = ::dn_skipname( p, end );
+        if ( n < 0 )
+            return 0;
+        p += n + 4;
+        qdcount--;
+    }
+    if ( p > end )
+        return 0;
+    return p;
+}
+
+
+/*! Parses the resource record at \a p, which must be before \a end,
+    and returns a pointer to the next one, or a null pointer if the
+    record is truncated. Sets *\a type, *\a rdata and *\a rdlength to
+    describe the record.
+*/
+
+static const u_char * nextAnswer( const u_char * p, const u_char * end,
+                                  uint * type, const u_char ** rdata,
+                                  uint * rdlength )
+{
+    int n = ::dn_skipname( p, end );
+    if ( n < 0 || p + n + 10 > end )
+        return 0;
+    p += n;
+    *type = ( p[0] << 8 ) + p[1];
+    *rdlength = ( p[8] << 8 ) + p[9];
+    p += 10;
+    if ( p + *rdlength > end )
+        return 0;
+    *rdata = p;
+    return p + *rdlength;
+}
+
+
+/*! Looks up the \a type (T_A or T_AAAA) addresses of \a name, and
+    writes them to \a fd. Called in an MxLookup thread.
+*/
+
+static void writeAddresses( int fd, const char * name, int type )
+{
+    u_char reply[4096];
+    int len = ::res_query( name, C_IN, type, reply, sizeof( reply ) );
+    if ( len > (int)sizeof( reply ) )
+        len = sizeof( reply );
+    uint count = 0;
+    const u_char * p = firstAnswer( reply, len, &count );
+    const u_char * end = reply + len;
+    while ( p && p < end && count ) {
+        uint t = 0;
+        uint rdlength = 0;
+        const u_char * rdata = 0;
+        p = nextAnswer( p, end, &t, &rdata, &rdlength );
+        char a[INET6_ADDRSTRLEN];
+        if ( p && t == T_A && type == T_A && rdlength == 4 &&
+             ::inet_ntop( AF_INET, rdata, a, sizeof( a ) ) )
+            writeLine( fd, "address", name, a );
+        else if ( p && t == T_AAAA && type == T_AAAA && rdlength == 16 &&
+                  ::inet_ntop( AF_INET6, rdata, a, sizeof( a ) ) )
+            writeLine( fd, "address", name, a );
+        count--;
+    }
+}
+
+
+/*! This is the body of an MxLookup thread. It performs the lookups
+    for the MxRequest \a arg, writes the results to the request's fd,
+    closes that, and frees \a arg.
+*/
+
+static void * lookUpMailExchangers( void * arg )
+{
+    MxRequest * r = (MxRequest *)arg;
+
+    const uint max = 16;
+    char names[max][NS_MAXDNAME];
+    uint preferences[max];
+    uint n = 0;
+    const char * error = 0;
+
+    u_char reply[4096];
+    int len = ::res_query( r->domain, C_IN, T_MX, reply, sizeof( reply ) );
+    if ( len > (int)sizeof( reply ) )
+        len = sizeof( reply );
+    if ( len <= 0 ) {
+        if ( h_errno == NO_DATA )
+            n = 0; // the implicit MX, see below
+        else if ( h_errno == HOST_NOT_FOUND )
+            error = "permanent";
+        else
+            error = "temporary";
+    }
+    else {
+        // keep the MX records sorted by preference as we parse them
+        uint count = 0;
+        const u_char * p = firstAnswer( reply, len, &count );
+        const u_char * end = reply + len;
+        while ( p && p < end && count ) {
+            uint type = 0;
+            uint rdlength = 0;
+            const u_char * rdata = 0;
+            p = nextAnswer( p, end, &type, &rdata, &rdlength );
+            char name[NS_MAXDNAME];
+            if ( p && type == T_MX && rdlength > 2 && n < max &&
+                 ::dn_expand( reply, end, rdata + 2,
+                              name, sizeof( name ) ) >= 0 ) {
+                uint preference = ( rdata[0] << 8 ) + rdata[1];
+                uint i = n;
+                while ( i > 0 && preferences[i-1] > preference ) {
+                    preferences[i] = preferences[i-1];
+                    ::strcpy( names[i], names[i-1] );
+                    i--;
+                }
+                preferences[i] = preference;
+                ::strcpy( names[i], name );
+                n++;
+            }
+            count--;
+        }
+        if ( n == 1 && !names[0][0] )
+            error = "permanent"; // null MX, RFC 7505
+    }
+
+    if ( !error && !n ) {
+        // RFC 5321 section 5.1
+        ::strcpy( names[0], r->domain );
+        n = 1;
+    }
+
+    if ( error ) {
+        writeLine( r->fd, error );
+    }
+    else {
+        uint i = 0;
+        while ( i < n ) {
+            writeLine( r->fd, "mx", names[i] );
+            i++;
+        }
+        i = 0;
+        while ( i < n ) {
+            if ( r->use6 )
+                writeAddresses( r->fd, names[i], T_AAAA );
+            if ( r->use4 )
+                writeAddresses( r->fd, names[i], T_A );
+            i++;
+        }
+    }
+
+    ::close( r->fd );
+    ::free( r );
+    return 0;
+}
+
+
+class MxLookupData
+    : public Garbage
+{
+public:
+    MxLookupData()
+        : Garbage(), owner( 0 ), done( false ), permanent( false )
+    {}
+
+    EString domain;
+    EventHandler * owner;
+    bool done;
+    bool permanent;
+    EStringList exchangers;
+    Dict<EStringList> addresses;
+};
+
+
+/*! \class MxLookup resolver.h
+
+    The MxLookup class looks up the mail exchangers for a domain, and
+    their addresses, for sending mail to that domain.
+
+    res_query() blocks, so MxLookup calls it in a separate thread,
+    which writes its results to a socket. MxLookup reads them there
+    like any other Connection, and notifies its owner when all have
+    arrived. (On some platforms res_query() is not thread-safe, but
+    on Linux, *BSD and OS X it is.)
+
+    Domain names that aren't ASCII are converted to IDNA A-labels
+    first, using Resolver::asciiDomain().
+*/
+
+
+/*! Starts looking up the mail exchangers for \a domain, and notifies
+    \a owner when done() becomes true.
+
+    done() may be true as soon as the constructor returns, if \a
+    domain is unusable or the lookup cannot be started. \a owner is
+    not notified in that case.
+*/
+
+MxLookup::MxLookup( const EString & domain, EventHandler * owner )
+    : Connection(), d( new MxLookupData )
+{
+    d->domain = domain;
+    d->owner = owner;
+
+    EString ascii = Resolver::asciiDomain( domain );
+    if ( ascii.isEmpty() || ascii.length() >= NS_MAXDNAME ) {
+        log( "Cannot look up MX for invalid domain " + domain );
+        d->done = true;
+        d->permanent = true;
+        return;
+    }
+
+    int sv[2];
+    if ( ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 ) {
+        log( "Cannot create more FDs", Log::Error );
+        d->done = true;
+        return;
+    }
+
+    MxRequest * r = (MxRequest *)::malloc( sizeof( MxRequest ) );
+    ::strcpy( r->domain, ascii.cstr() );
+    r->fd = sv[1];
+    r->use4 = Configuration::toggle( Configuration::UseIPv4 );
+    r->use6 = Configuration::toggle( Configuration::UseIPv6 );
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    ::pthread_attr_init( &attr );
+    ::pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    int e = ::pthread_create( &thread, &attr, lookUpMailExchangers, r );
+    ::pthread_attr_destroy( &attr );
+    if ( e ) {
+        log( "pthread_create returned nonzero (" + fn( e ) + ")",
+             Log::Error );
+        ::close( sv[0] );
+        ::close( sv[1] );
+        ::free( r );
+        d->done = true;
+        return;
+    }
+
+    log( "Starting MX lookup for " + ascii, Log::Debug );
+    setType( Connection::Pipe );
+    init( sv[0] );
+    setState( Connection::Connected );
+    setTimeoutAfter( 120 );
+    EventLoop::global()->addConnection( this );
+}
+
+
+void MxLookup::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        parse();
+        break;
+
+    case Timeout:
+        log( "MX lookup for " + d->domain + " timed out" );
+        d->exchangers.clear();
+        finish();
+        close();
+        break;
+
+    case Error:
+    case Close:
+        finish();
+        break;
+
+    case Connect:
+    case Shutdown:
+        break;
+    }
+}
+
+
+/*! Reads the lines written by the lookup thread. */
+
+void MxLookup::parse()
+{
+    EString * line = readBuffer()->removeLine();
+    while ( line ) {
+        EString w = line->section( " ", 1 );
+        if ( w == "mx" ) {
+            d->exchangers.append( line->section( " ", 2 ) );
+        }
+        else if ( w == "address" ) {
+            EString name = line->section( " ", 2 );
+            EStringList * l = d->addresses.find( name );
+            if ( !l ) {
+                l = new EStringList;
+                d->addresses.insert( name, l );
+            }
+            l->append( line->section( " ", 3 ) );
+        }
+        else if ( w == "permanent" ) {
+            d->permanent = true;
+        }
+        line = readBuffer()->removeLine();
+    }
+}
+
+
+/*! Records that the lookup is over, and notifies the owner. */
+
+void MxLookup::finish()
+{
+    if ( d->done )
+        return;
+    d->done = true;
+    if ( d->permanent )
+        log( "Domain " + d->domain + " does not accept mail" );
+    else if ( d->exchangers.isEmpty() )
+        log( "DNS error while looking up MX for " + d->domain );
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+/*! Returns true if the lookup is over, and false if it's still in
+    progress.
+*/
+
+bool MxLookup::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if the lookup showed that the domain does not accept
+    mail (because it does not exist, or has a null MX as per RFC
+    7505), and false if it accepts mail or the lookup failed in a way
+    that may be temporary.
+*/
+
+bool MxLookup::permanent() const
+{
+    return d->permanent;
+}
+
+
+/*! Returns the names of the domain's mail exchangers, most preferred
+    first. If the domain exists but has no MX records, the list
+    contains just the domain (RFC 5321 section 5.1). The list is
+    empty if the lookup failed or isn't done().
+*/
+
+EStringList MxLookup::exchangers() const
+{
+    return d->exchangers;
+}
+
+
+/*! Returns the addresses of the mail exchanger \a name, which should
+    be one of exchangers(). The list is empty if the lookup found no
+    addresses.
+*/
+
+EStringList MxLookup::addresses( const EString & name ) const
+{
+    EStringList * l = d->addresses.find( name );
+    if ( !l )
+        return EStringList();
+    return *l;
+}
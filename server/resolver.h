@@ -4,6 +4,7 @@
 #define RESOLVER_H
 
 #include "estringlist.h"
+#include "connection.h"
 
 
 class Resolver
@@ -18,6 +19,7 @@ private:
 
 public:
     static EStringList resolve( const EString & );
+    static EString asciiDomain( const EString & );
     static EStringList errors();
 
 private:
@@ -25,4 +27,25 @@ private:
 };
 
 
+class MxLookup
+    : public Connection
+{
+public:
+    MxLookup( const EString &, class EventHandler * );
+
+    void react( Event );
+
+    bool done() const;
+    bool permanent() const;
+    EStringList exchangers() const;
+    EStringList addresses( const EString & ) const;
+
+private:
+    class MxLookupData * d;
+
+    void parse();
+    void finish();
+};
+
+
 #endif
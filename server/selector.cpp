@@ -16,6 +16,7 @@
 #include "transaction.h"
 #include "annotation.h"
 #include "dbsignal.h"
+#include "postgres.h"
 #include "field.h"
 #include "user.h"
 
@@ -23,6 +24,7 @@
 
 
 static bool tsearchAvailable = false;
+static bool subjectTsearchAvailable = false;
 static bool retunerCreated = false;
 
 static EString * tsconfig;
@@ -34,10 +36,13 @@ class TuningDetector
 public:
     TuningDetector(): q( 0 ) {
         ::tsearchAvailable = false;
+        ::subjectTsearchAvailable = false;
         q = new Query(
-            "select indexdef from pg_indexes where "
+            "select tablename::text, indexdef::text from pg_indexes where "
             "indexdef ilike '% USING gin (to_tsvector%'"
-            "and tablename='bodyparts' and schemaname=$1",
+            "and tablename in ('bodyparts','header_fields') "
+            "and schemaname=$1 "
+            "order by tablename",
             this
         );
         q->bind( 1, Configuration::text( Configuration::DbSchema ) );
@@ -46,22 +51,34 @@ public:
     void execute() {
         if ( !q->done() )
             return;
-        ::tsearchAvailable = q->hasResults();
-        Row * r = q->nextRow();
-        if ( r ) {
+        EString config;
+        Row * r;
+        while ( (r=q->nextRow()) != 0 ) {
             EString def( r->getEString( "indexdef" ) );
 
             uint n = 12 + def.find( "to_tsvector(" );
             def = def.mid( n, def.length()-n-1 ).section( ",", 1 );
 
-            if ( def[0] == '\'' && def.endsWith( "::regconfig" ) ) {
-                tsconfig = new EString( def );
-                Allocator::addEternal( tsconfig, "tsearch configuration" );
-            }
-            else {
-                ::tsearchAvailable = false;
-            }
+            // the query has to use the same configuration as the
+            // index, or the index can't be used.
+            if ( def[0] != '\'' || !def.endsWith( "::regconfig" ) )
+                continue;
+            if ( config.isEmpty() )
+                config = def;
+            else if ( config != def )
+                continue;
+            if ( r->getEString( "tablename" ) == "bodyparts" )
+                ::tsearchAvailable = true;
+            else
+                ::subjectTsearchAvailable = true;
         }
+        if ( config.isEmpty() )
+            return;
+        if ( !tsconfig ) {
+            tsconfig = new EString;
+            Allocator::addEternal( tsconfig, "tsearch configuration" );
+        }
+        *tsconfig = config;
     }
     Query * q;
 };
@@ -99,7 +116,9 @@ public:
           needDateFields( false ),
           needAnnotations( false ),
           needBodyparts( false ),
-          needMessages( false )
+          needMessages( false ),
+          windowOffset( 0 ), windowLimit( 0 ), windowHighest( 0 ),
+          windowDescending( false )
     {}
 
     void copy( SelectorData * o ) {
@@ -149,6 +168,11 @@ public:
     bool needAnnotations;
     bool needBodyparts;
     bool needMessages;
+
+    uint windowOffset;
+    uint windowLimit;
+    uint windowHighest;
+    bool windowDescending;
 };
 
 
@@ -599,6 +623,10 @@ Query * Selector::query( User * user, Mailbox * mailbox,
     else {
         q.append( mm() + ".uid, " + mm() + ".modseq, " + mm() + ".message" );
     }
+    if ( d->windowLimit )
+        q.append( ", count(*) over () as total,"
+                  " min(" + mm() + ".uid) over () as lowest,"
+                  " max(" + mm() + ".uid) over () as highest" );
 
     if ( deleted )
         q.append( " from deleted_messages " + mm() );
@@ -607,6 +635,15 @@ Query * Selector::query( User * user, Mailbox * mailbox,
     EString w = where();
     if ( d->a == And && w.startsWith( "(" ) && w.endsWith( ")" ) )
         w = w.mid( 1, w.length() - 2 );
+    if ( d->windowHighest ) {
+        uint h = placeHolder();
+        d->query->bind( h, d->windowHighest );
+        EString c = mm() + ".uid<=$" + fn( h );
+        if ( w == "true" )
+            w = c;
+        else
+            w = w + " and " + c;
+    }
 
     if ( wanted && wanted->contains( "m.idate" ) )
         d->needMessages = true;
@@ -698,12 +735,48 @@ Query * Selector::query( User * user, Mailbox * mailbox,
         else if ( wanted->contains( "m.idate" ) )
             q.append( " order by m.idate" );
     }
+    else if ( d->windowLimit ) {
+        q.append( " order by " + mm() + ".uid" );
+        if ( d->windowDescending )
+            q.append( " desc" );
+    }
+
+    if ( d->windowLimit ) {
+        q.append( " limit " + fn( d->windowLimit ) );
+        if ( d->windowOffset )
+            q.append( " offset " + fn( d->windowOffset ) );
+    }
 
     d->query->setString( q );
     return d->query;
 }
 
 
+/*! Instructs query() to return only \a limit of the matching rows,
+    skipping the first \a offset. Unless query() is asked to order
+    the rows some other way, they're ordered by UID, descending if \a
+    descending is true. If \a highest is nonzero, messages whose UID
+    is greater than \a highest are disregarded entirely.
+
+    When a window is set, each row also contains the total number of
+    matching messages, and the lowest and highest matching UIDs, in
+    the columns "total", "lowest" and "highest". This lets a client
+    page through a large result without the server transferring or
+    storing more than a page at a time.
+
+    A \a limit of 0 (the default) means to return all rows.
+*/
+
+void Selector::setWindow( uint offset, uint limit, bool descending,
+                          uint highest )
+{
+    d->windowOffset = offset;
+    d->windowLimit = limit;
+    d->windowDescending = descending;
+    d->windowHighest = highest;
+}
+
+
 /*! Gives an SQL string representing this condition.
 
     The string may include $n placeholders; where() and its helpers
@@ -878,7 +951,15 @@ static EString matchTsvector( const EString & col, uint n )
     s.append( *tsconfig );
     s.append( ", " );
     s.append( col );
-    s.append( ") @@ plainto_tsquery($" );
+    // the words have to be adjacent, as in the substring we're
+    // looking for. phraseto_tsquery() says that to the index, but
+    // is new in 9.6.
+    if ( Postgres::version() >= 90600 )
+        s.append( ") @@ phraseto_tsquery(" );
+    else
+        s.append( ") @@ plainto_tsquery(" );
+    s.append( *tsconfig );
+    s.append( ", $" );
     s.appendNumber( n );
     s.append( ")" );
     return s;
@@ -932,7 +1013,7 @@ EString Selector::whereHeaderField()
         j.append( " and hf" + jn + ".value=$" + fn( like ) );
     }
     else if ( t == HeaderField::Subject &&
-              ::tsearchAvailable && sensibleWords( d->s16 ) ) {
+              ::subjectTsearchAvailable && sensibleWords( d->s16 ) ) {
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and (" + matchTsvector( "hf" + jn + ".value", like ) + " "
                   "and hf" + jn + ".value ilike " + matchAny( like ) + ")" );
@@ -1133,37 +1214,28 @@ static void addAddressTerm( EStringList * terms,
             ascii = false;
         ++i;
     }
-    EString r;
-    if ( ascii )
-        r.append( "lower(" );
-    r.append( "a" );
+    // lower() on both sides, so the a_*_trgm indexes can be used
+    EString r( "lower(a" );
     r.append( jn );
     r.append( "." );
     r.append( part );
-    if ( ascii )
-        r.append( ")" );
-    uint b;
-    if ( ascii )
-        b = root->placeHolder( s.ascii().lower() );
-    else
-        b = root->placeHolder( s );
+    r.append( ")" );
+    EString v;
+    if ( ascii ) {
+        v = "$" + fn( root->placeHolder( s.ascii().lower() ) );
+    }
+    else {
+        v = "lower($" + fn( root->placeHolder( s ) ) + ")";
+    }
     if ( isPrefix && isPostfix ) {
-        if ( ascii )
-            r.append( "=" );
-        else
-            r.append( " ilike " );
-        r.append( "$" );
-        r.appendNumber( b );
+        r.append( "=" );
+        r.append( v );
     }
     else {
-        if ( ascii )
-            r.append( " like " );
-        else
-            r.append( " ilike " );
+        r.append( " like " );
         if ( !isPrefix )
             r.append( "'%'||" );
-        r.append( "$" );
-        r.appendNumber( b );
+        r.append( v );
         if ( !isPostfix )
             r.append( "||'%'" );
     }
@@ -59,6 +59,7 @@ public:
     Query * query( class User *, class Mailbox *,
                    class Session *, class EventHandler *,
                    bool = true, class EStringList * = 0, bool = false );
+    void setWindow( uint, uint, bool = false, uint = 0 );
 
     void simplify();
 
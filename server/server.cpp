@@ -46,6 +46,7 @@
 #include "eventloop.h"
 #include "allocator.h"
 #include "resolver.h"
+#include "sharedcache.h"
 #include "entropy.h"
 #include "query.h"
 
@@ -695,6 +696,8 @@ void Server::maintainChildren()
         d->children->append( new pid_t( 0 ) );
         i++;
     }
+    if ( children > 1 )
+        SharedCache::setup();
     uint failures = 0;
     while ( children > 1 && d->mainProcess ) {
         // check that all children exist
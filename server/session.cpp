@@ -16,6 +16,9 @@
 #include "map.h"
 #include "log.h"
 
+#include <string.h> // memset
+#include <limits.h> // UINT_MAX
+
 
 class SessionData
     : public Garbage
@@ -25,7 +28,7 @@ public:
         : readOnly( true ),
           mailbox( 0 ),
           uidnext( 1 ), nextModSeq( 1 ),
-          permissions( 0 )
+          permissions( 0 ), flags( new Flags )
     {}
 
     bool readOnly;
@@ -38,30 +41,118 @@ public:
     Permissions * permissions;
     IntegerSet unannounced;
 
+    class Flags
+        : public Garbage
+    {
+    public:
+        Flags(): Garbage(), loaded( false ), largest( 0 ) {}
+
+        void forget( uint );
+        void setModSeq( uint, int64 );
+        int64 modSeq( uint );
+        void add( uint, uint );
+
+        bool loaded;
+        uint largest;
+        Map<IntegerSet> flags;
+        Map<int64> modseqs;
+    };
+
+    Flags * flags;
+
     class CachedData
         : public Garbage
     {
     public:
-        CachedData(): Garbage(), uidnext( 0 ), nextModSeq( 1 ) {}
+        CachedData()
+            : Garbage(), uidvalidity( 0 ), uidnext( 0 ), nextModSeq( 1 ),
+              flags( 0 ) {}
+        uint uidvalidity;
         uint uidnext;
         int64 nextModSeq;
         IntegerSet msns;
+        Flags * flags;
     };
 
     class SessionCache
         : public Cache
     {
     public:
-        SessionCache(): Cache( 3 ) {}
+        SessionCache(): Cache( UINT_MAX ) {}
         Map<CachedData> data;
         void clear() { data.clear(); }
     };
 };
 
 
+// the last known state of each mailbox that has had a session in
+// this process: the UIDs as of some modseq, and the flags shared by
+// its sessions. it survives GC, so a new Session can start from it
+// and the SessionInitialiser need only fetch what's changed since.
+// it's cleared only when the process is short of memory.
 static SessionData::SessionCache * cache = 0;
 
 
+// the modseqs are stored in blocks of this many consecutive UIDs,
+// which costs eight bytes per message in a typical mailbox.
+static const uint modseqBlock = 128;
+
+
+/*! Removes all information about \a uid. */
+
+void SessionData::Flags::forget( uint uid )
+{
+    Map<IntegerSet>::Iterator i( flags );
+    while ( i ) {
+        i->remove( uid );
+        ++i;
+    }
+    int64 * b = modseqs.find( uid / modseqBlock );
+    if ( b )
+        b[uid % modseqBlock] = 0;
+}
+
+
+/*! Records that \a uid has modseq \a ms. */
+
+void SessionData::Flags::setModSeq( uint uid, int64 ms )
+{
+    int64 * b = modseqs.find( uid / modseqBlock );
+    if ( !b ) {
+        b = (int64*)Allocator::alloc( modseqBlock * sizeof( int64 ), 0 );
+        memset( b, 0, modseqBlock * sizeof( int64 ) );
+        modseqs.insert( uid / modseqBlock, b );
+    }
+    b[uid % modseqBlock] = ms;
+}
+
+
+/*! Returns the modseq of \a uid, or 0 if it isn't known. */
+
+int64 SessionData::Flags::modSeq( uint uid )
+{
+    int64 * b = modseqs.find( uid / modseqBlock );
+    if ( !b )
+        return 0;
+    return b[uid % modseqBlock];
+}
+
+
+/*! Records that \a uid has the flag with id \a flag. */
+
+void SessionData::Flags::add( uint uid, uint flag )
+{
+    IntegerSet * s = flags.find( flag );
+    if ( !s ) {
+        s = new IntegerSet;
+        flags.insert( flag, s );
+    }
+    s->add( uid );
+    if ( flag > largest )
+        largest = flag;
+}
+
+
 /*! \class Session session.h
     This class contains all data associated with the single use of a
     Mailbox, such as the number of messages visible, etc. Subclasses
@@ -87,13 +178,17 @@ Session::Session( Mailbox * m, bool readOnly )
         d->msns.add( other->d->msns );
         d->msns.add( other->d->unannounced );
         d->msns.remove( other->d->expunges );
+        d->flags = other->d->flags;
     }
     else if ( cache ) {
         SessionData::CachedData * cd = cache->data.find( m->id() );
-        if ( cd ) {
+        if ( cd && ( !cd->uidvalidity ||
+                     cd->uidvalidity == m->uidvalidity() ) ) {
             d->uidnext = cd->uidnext;
             d->nextModSeq = cd->nextModSeq;
             d->msns.add( cd->msns );
+            if ( cd->flags )
+                d->flags = cd->flags;
         }
     }
     (void)new SessionInitialiser( m, 0, this );
@@ -334,7 +429,7 @@ public:
           also( 0 ),
           oldUidnext( 0 ), newUidnext( 0 ),
           state( NoTransaction ),
-          changeRecent( false )
+          changeRecent( false ), loadFlags( false )
         {}
 
     Mailbox * mailbox;
@@ -357,6 +452,10 @@ public:
     State state;
 
     bool changeRecent;
+
+    List<SessionData::Flags> flags;
+    bool loadFlags;
+    IntegerSet flagged;
 };
 
 
@@ -461,6 +560,10 @@ void SessionInitialiser::findSessions()
         Session * s = i;
         ++i;
         d->sessions.append( s );
+        if ( !d->flags.find( s->d->flags ) )
+            d->flags.append( s->d->flags );
+        if ( !s->d->flags->loaded )
+            d->loadFlags = true;
         if ( s->uidnext() < d->oldUidnext )
             d->oldUidnext = s->uidnext();
         if ( s->nextModSeq() < d->oldModSeq )
@@ -470,8 +573,9 @@ void SessionInitialiser::findSessions()
     if ( d->newUidnext > d->oldUidnext ||
          d->newModSeq > d->oldModSeq )
         return;
-    // if none are, and the mailbox is ordinary, we don't need anything
-    if ( d->mailbox->ordinary() )
+    // if none are, the flags are known, and the mailbox is ordinary,
+    // we don't need anything
+    if ( d->mailbox->ordinary() && !d->loadFlags )
         d->sessions.clear();
     // otherwise we may need to do work
 }
@@ -586,10 +690,13 @@ void SessionInitialiser::findRecent()
 void SessionInitialiser::findMailboxChanges()
 {
     bool initialising = false;
-    if ( d->oldUidnext <= 1 )
+    if ( d->oldUidnext <= 1 || d->loadFlags )
         initialising = true;
-    EString msgs = "select mm.uid, mm.modseq from mailbox_messages mm "
-                  "where mm.mailbox=$1 and mm.uid<$2";
+    EString msgs = "select mm.uid, mm.modseq, mm.seen, mm.deleted, f.flag "
+                   "from mailbox_messages mm "
+                   "left join flags f on "
+                   "(f.mailbox=mm.mailbox and f.uid=mm.uid) "
+                   "where mm.mailbox=$1 and mm.uid<$2";
 
     // if we know we'll see one new modseq and at least one new
     // message, we could skip the test on mm.modseq.
@@ -626,7 +733,44 @@ void SessionInitialiser::recordMailboxChanges()
     Row * r = 0;
     while ( (r=d->messages->nextRow()) != 0 ) {
         uint uid = r->getInt( "uid" );
-        addToSessions( uid, r->getBigint( "modseq" ) );
+        if ( !d->flagged.contains( uid ) )
+            addToSessions( uid, r->getBigint( "modseq" ) );
+        recordFlags( r );
+    }
+    if ( !d->messages->done() || !d->loadFlags )
+        return;
+    List<SessionData::Flags>::Iterator f( d->flags );
+    while ( f ) {
+        f->loaded = true;
+        ++f;
+    }
+}
+
+
+/*! Records the flags and modseq in \a r in the flag state shared by
+    the sessions. There is one row per message and flag, so the first
+    row for each message replaces whatever was known before.
+*/
+
+void SessionInitialiser::recordFlags( Row * r )
+{
+    uint uid = r->getInt( "uid" );
+    bool first = !d->flagged.contains( uid );
+    if ( first )
+        d->flagged.add( uid );
+    List<SessionData::Flags>::Iterator f( d->flags );
+    while ( f ) {
+        if ( first ) {
+            f->forget( uid );
+            f->setModSeq( uid, r->getBigint( "modseq" ) );
+            if ( r->getBoolean( "seen" ) )
+                f->add( uid, Flag::id( "\\seen" ) );
+            if ( r->getBoolean( "deleted" ) )
+                f->add( uid, Flag::id( "\\deleted" ) );
+        }
+        if ( !r->isNull( "flag" ) )
+            f->add( uid, r->getInt( "flag" ) );
+        ++f;
     }
 }
 
@@ -646,6 +790,14 @@ void SessionInitialiser::recordExpunges()
     if ( uids.isEmpty() )
         return;
 
+    List<SessionData::Flags>::Iterator f( d->flags );
+    while ( f ) {
+        uint n = 1;
+        while ( n <= uids.count() )
+            f->forget( uids.value( n++ ) );
+        ++f;
+    }
+
     List<Session>::Iterator i( d->sessions );
     while ( i ) {
         Session * s = i;
@@ -660,6 +812,11 @@ void SessionInitialiser::recordExpunges()
 
 void SessionInitialiser::emitUpdates()
 {
+    if ( d->state == SessionInitialiserData::Updated &&
+         !d->messages->failed() &&
+         ( !d->expunges || !d->expunges->failed() ) )
+        recordSnapshot();
+
     List<Session>::Iterator s( d->sessions );
     while ( s ) {
         if ( s->nextModSeq() < d->newModSeq )
@@ -677,6 +834,32 @@ void SessionInitialiser::emitUpdates()
 }
 
 
+/*! Records the state of the mailbox as of the modseq we've just
+    updated to in the session cache, so that later Sessions can start
+    from there instead of loading everything.
+*/
+
+void SessionInitialiser::recordSnapshot()
+{
+    Session * s = d->sessions.firstElement();
+    if ( !s )
+        return;
+
+    if ( !::cache )
+        ::cache = new SessionData::SessionCache;
+    SessionData::CachedData * cd = new SessionData::CachedData;
+    cd->uidvalidity = d->mailbox->uidvalidity();
+    cd->uidnext = d->newUidnext;
+    cd->nextModSeq = d->newModSeq;
+    cd->msns.add( s->d->msns );
+    cd->msns.add( s->d->unannounced );
+    cd->msns.remove( s->d->expunges );
+    if ( s->d->flags->loaded )
+        cd->flags = s->d->flags;
+    ::cache->data.insert( d->mailbox->id(), cd );
+}
+
+
 /*! Adds \a uid with modseq \a ms to each session to be announced as
     changed or new.
 */
@@ -814,6 +997,51 @@ void Session::clearUnannounced()
 }
 
 
+/*! Returns true if this Session knows the flags and modseq of its
+    messages, so that flags() and modSeq() can be used instead of
+    asking the database, and false if not.
+
+    The flags are loaded by the first SessionInitialiser, kept up to
+    date by later ones, and shared by all sessions on the same mailbox.
+*/
+
+bool Session::knowsFlags() const
+{
+    return d->flags->loaded && d->flags->largest <= Flag::largestId();
+}
+
+
+/*! Returns the names of the flags set on \a uid, as of the last time
+    this Session was updated. The result is meaningful only if
+    knowsFlags() is true.
+
+    "\Recent" is not included.
+*/
+
+EStringList Session::flags( uint uid ) const
+{
+    EStringList r;
+    uint f = 0;
+    while ( f <= d->flags->largest ) {
+        IntegerSet * s = d->flags->flags.find( f );
+        if ( s && s->contains( uid ) )
+            r.append( Flag::name( f ) );
+        f++;
+    }
+    return r;
+}
+
+
+/*! Returns the modseq of \a uid as of the last time this Session was
+    updated, or 0 if it is not known.
+*/
+
+int64 Session::modSeq( uint uid ) const
+{
+    return d->flags->modSeq( uid );
+}
+
+
 /*! Does whatever is necessary to tell the client about new
     flags. This is really a hack for ImapSession.
 */
@@ -889,8 +1117,8 @@ void SessionPreloader::execute()
                  fn( s.count() ) + " can be preloaded." );
             Transaction * t = new Transaction( this );
             d->lock
-                = new Query( "select id, uidnext, nextmodseq, first_recent "
-                             "from mailboxes where id=any($1) "
+                = new Query( "select id, uidvalidity, uidnext, nextmodseq, "
+                             "first_recent from mailboxes where id=any($1) "
                              "order by id for update", 0 );
             d->lock->bind( 1, s );
             t->enqueue( d->lock );
@@ -918,6 +1146,7 @@ void SessionPreloader::execute()
             ::cache->data.insert( r->getInt( "id" ), cd );
         }
 
+        cd->uidvalidity = r->getInt( "uidvalidity" );
         cd->uidnext = r->getInt( "uidnext" );
         cd->nextModSeq = r->getBigint( "nextmodseq" );
 
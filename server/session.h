@@ -4,6 +4,7 @@
 #define SESSION_H
 
 #include "global.h"
+#include "estringlist.h"
 #include "integerset.h"
 #include "permissions.h"
 #include "event.h"
@@ -11,6 +12,7 @@
 
 class Transaction;
 class Connection;
+class Row;
 class Mailbox;
 class Message;
 class Select;
@@ -67,6 +69,10 @@ public:
     void addUnannounced( const IntegerSet & );
     void clearUnannounced();
 
+    bool knowsFlags() const;
+    EStringList flags( uint ) const;
+    int64 modSeq( uint ) const;
+
     virtual void sendFlagUpdate();
 
 private:
@@ -94,7 +100,9 @@ private:
     void recordMailboxChanges();
     void recordExpunges();
     void emitUpdates();
+    void recordSnapshot();
     void addToSessions( uint, int64 );
+    void recordFlags( Row * );
     void submit( class Query * );
 };
 
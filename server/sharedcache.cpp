@@ -0,0 +1,203 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sharedcache.h"
+
+#include "configuration.h"
+#include "graph.h"
+#include "log.h"
+
+// mmap, munmap
+#include <sys/mman.h>
+// memcpy
+#include <string.h>
+// errno
+#include <errno.h>
+
+
+struct SharedCacheSlot {
+    volatile uint seq;
+    uint kind;
+    uint id;
+    uint length;
+    int64 position;
+};
+
+
+struct SharedCacheSegment {
+    uint slots;
+    int64 size;
+    volatile int64 cursor;
+};
+
+
+static SharedCacheSegment * segment = 0;
+static SharedCacheSlot * slots = 0;
+static char * ring = 0;
+
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+
+
+/*! \class SharedCache sharedcache.h
+
+    The SharedCache class provides a cache of immutable message data
+    which is shared by all the archiveopteryx server processes.
+
+    The cache lives in an anonymous shared memory segment created by
+    setup() before the children are forked. It is keyed by the kind of
+    data and the database ID of the message: since messages, like the
+    bodyparts they refer to, never change after injection, nothing ever
+    needs to be invalidated. A message delivered to many users is
+    stored only once in the database, so one copy in the cache serves
+    all of them no matter which process they're connected to.
+
+    The segment consists of a hash table with one slot per key, and a
+    ring buffer holding the data. Newer data overwrites the oldest, and
+    a new key overwrites whatever was in its slot. Neither readers nor
+    writers lock: each slot carries a sequence number which a writer
+    makes odd while it updates the slot, and a reader checks that the
+    number is unchanged and even, and that the ring buffer hasn't
+    wrapped past its data, after copying the data out.
+
+    The cache is disabled unless shared-cache-size is set (in
+    megabytes) and server-processes is greater than 1.
+*/
+
+
+/*! Creates the shared memory segment, if the configuration asks for
+    one. Must be called before forking the server processes.
+*/
+
+void SharedCache::setup()
+{
+    if ( ::segment )
+        return;
+    uint mb = Configuration::scalar( Configuration::SharedCacheSize );
+    if ( !mb )
+        return;
+
+    int64 size = (int64)mb * 1024 * 1024;
+    uint n = (uint)( size / 16384 );
+    if ( n < 1024 )
+        n = 1024;
+    uint overhead = sizeof( SharedCacheSegment ) +
+                    n * sizeof( SharedCacheSlot );
+    if ( size < 2 * overhead )
+        size = 2 * overhead;
+
+    void * p = ::mmap( 0, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( p == MAP_FAILED ) {
+        log( "Unable to create shared cache of " + fn( mb ) +
+             "MB. Error code " + fn( errno ), Log::Error );
+        return;
+    }
+    // anonymous mappings are zeroed, so all slots start out empty.
+
+    ::segment = (SharedCacheSegment*)p;
+    ::segment->slots = n;
+    ::segment->size = size - overhead;
+    ::segment->cursor = 0;
+    ::slots = (SharedCacheSlot*)( ::segment + 1 );
+    ::ring = (char*)( ::slots + n );
+}
+
+
+/*! Returns true if setup() has created the shared segment, and false
+    if not.
+*/
+
+bool SharedCache::enabled()
+{
+    return ::segment != 0;
+}
+
+
+static SharedCacheSlot * slot( SharedCache::Kind k, uint id )
+{
+    uint h = ( id * 2654435761u ) ^ ( (uint)k << 28 );
+    return ::slots + ( h % ::segment->slots );
+}
+
+
+/*! Returns the data stored under \a kind and \a id, or an empty
+    string if there is none.
+*/
+
+EString SharedCache::find( Kind kind, uint id )
+{
+    EString r;
+    if ( !::segment )
+        return r;
+    if ( !::hits ) {
+        ::hits = new GraphableCounter( "shared-cache-hits" );
+        ::misses = new GraphableCounter( "shared-cache-misses" );
+    }
+
+    SharedCacheSlot * s = ::slot( kind, id );
+    uint seq = s->seq;
+    __sync_synchronize();
+    if ( seq & 1 || s->kind != (uint)kind || s->id != id || !s->length ) {
+        ::misses->tick();
+        return r;
+    }
+
+    uint length = s->length;
+    int64 position = s->position;
+    uint offset = (uint)( position % ::segment->size );
+    uint first = length;
+    if ( offset + first > ::segment->size )
+        first = (uint)( ::segment->size - offset );
+    r.reserve( length );
+    r.append( ::ring + offset, first );
+    if ( first < length )
+        r.append( ::ring, length - first );
+
+    __sync_synchronize();
+    if ( s->seq != seq ||
+         ::segment->cursor > position + ::segment->size ) {
+        ::misses->tick();
+        return EString();
+    }
+    ::hits->tick();
+    return r;
+}
+
+
+/*! Stores \a data under \a kind and \a id, replacing whatever was in
+    the same slot. Does nothing if another process is writing to that
+    slot at the same time, or if \a data is too large for the cache.
+*/
+
+void SharedCache::insert( Kind kind, uint id, const EString & data )
+{
+    if ( !::segment || data.isEmpty() )
+        return;
+    uint length = data.length();
+    if ( length > ::segment->size / 16 )
+        return;
+
+    SharedCacheSlot * s = ::slot( kind, id );
+    uint seq = s->seq;
+    if ( seq & 1 )
+        return;
+    if ( !__sync_bool_compare_and_swap( &s->seq, seq, seq + 1 ) )
+        return;
+
+    int64 position = __sync_fetch_and_add( &::segment->cursor,
+                                           (int64)length );
+    uint offset = (uint)( position % ::segment->size );
+    uint first = length;
+    if ( offset + first > ::segment->size )
+        first = (uint)( ::segment->size - offset );
+    memcpy( ::ring + offset, data.data(), first );
+    if ( first < length )
+        memcpy( ::ring, data.data() + first, length - first );
+
+    s->kind = kind;
+    s->id = id;
+    s->length = length;
+    s->position = position;
+    __sync_synchronize();
+    s->seq = seq + 2;
+}
@@ -0,0 +1,26 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SHAREDCACHE_H
+#define SHAREDCACHE_H
+
+#include "estring.h"
+
+
+class SharedCache
+    : public Garbage
+{
+public:
+    enum Kind { Headers = 1, Bodies = 2 };
+
+    static void setup();
+    static bool enabled();
+
+    static EString find( Kind, uint );
+    static void insert( Kind, uint, const EString & );
+
+private:
+    SharedCache();
+};
+
+
+#endif
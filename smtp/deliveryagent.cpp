@@ -8,6 +8,7 @@
 #include "smtpclient.h"
 #include "recipient.h"
 #include "injector.h"
+#include "configuration.h"
 #include "address.h"
 #include "fetcher.h"
 #include "message.h"
@@ -16,19 +17,33 @@
 #include "scope.h"
 #include "timer.h"
 #include "date.h"
+#include "dict.h"
 #include "dsn.h"
 #include "log.h"
 
 
+class DeliveryPart
+    : public Garbage
+{
+public:
+    DeliveryPart( const EString & domain, DSN * part )
+        : Garbage(), destination( domain ), dsn( part ) {}
+
+    EString destination;
+    DSN * dsn;
+};
+
+
 class DeliveryAgentData
     : public Garbage
 {
 public:
     DeliveryAgentData()
         : messageId( 0 ), t( 0 ),
-          qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), expired( false ),
-          dsn( 0 ), injector( 0 ), update( 0 ), client( 0 ),
-          updatedDelivery( false )
+          qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), fetcher( 0 ),
+          expired( false ),
+          dsn( 0 ), injector( 0 ), update( 0 ), split( false ),
+          updatedDelivery( false ), finished( false ), owner( 0 )
     {}
 
     uint messageId;
@@ -37,32 +52,45 @@ public:
     Query * qs;
     Query * qr;
     Message * message;
+    Fetcher * fetcher;
     uint deliveryId;
     bool expired;
     DSN * dsn;
     Injector * injector;
     Query * update;
-    SmtpClient * client;
+    bool split;
+    List<DeliveryPart> parts;
+    List<SmtpClient> clients;
     bool updatedDelivery;
+    bool finished;
+    EventHandler * owner;
 };
 
 
 /*! \class DeliveryAgent deliveryagent.h
     Responsible for attempting to deliver a queued message and updating
     the corresponding row in the deliveries table.
+
+    Normally the entire message is sent to the smarthost. If
+    use-smarthost is disabled, the recipients are split up by domain,
+    and each domain is handled separately by SmtpClient. The DSN for
+    each domain shares its Recipient objects with the message's DSN,
+    so the usual bounce and update logic sees the combined result.
 */
 
 /*! Creates a new DeliveryAgent object to deliver the message with the
-    given \a id.
+    given \a id. If \a owner is non-null, it is notified once the
+    attempt is over, whether it worked or not.
 */
 
-DeliveryAgent::DeliveryAgent( uint id )
+DeliveryAgent::DeliveryAgent( uint id, EventHandler * owner )
     : d( new DeliveryAgentData )
 {
     setLog( new Log );
     Scope x( log() );
     log( "Attempting delivery for message " + fn( id ) );
     d->messageId = id;
+    d->owner = owner;
 }
 
 
@@ -80,9 +108,15 @@ void DeliveryAgent::execute()
 {
     // Fetch and lock the row in deliveries matching (mailbox,uid).
 
-    if ( !d->messageId )
+    if ( d->finished )
         return;
 
+    if ( d->t && d->t->failed() && !d->updatedDelivery ) {
+        log( "Delivery attempt failed: " + d->t->error(), Log::Error );
+        finish();
+        return;
+    }
+
     if ( !d->t ) {
         d->t = new Transaction( this );
         d->qm = new Query(
@@ -128,8 +162,8 @@ void DeliveryAgent::execute()
     }
     else if ( !d->qs ) {
         d->t->rollback();
-        d->messageId = 0;
         log( "Could not find/lock deliveries row; aborting" );
+        finish();
         return;
     }
 
@@ -145,19 +179,52 @@ void DeliveryAgent::execute()
                 d->message->hasBodies() ) )
             return;
 
+        if ( d->fetcher->failed() ) {
+            d->t->rollback();
+            log( "Cannot send message: " + d->fetcher->error(),
+                 Log::Error );
+            finish();
+            return;
+        }
+
         createDSN();
 
         if ( !d->dsn->deliveriesPending() ) {
             d->t->rollback();
-            d->messageId = 0;
             log( "Delivery already completed; will do nothing", Log::Debug );
+            finish();
             return;
         }
     }
 
-    if ( !d->client && d->dsn->deliveriesPending() ) {
-        d->client = SmtpClient::provide();
-        d->client->send( d->dsn, this );
+    if ( !d->split && d->dsn->deliveriesPending() )
+        splitDelivery();
+
+    // Hand each part to an SmtpClient. If a pool is busy, we'll be
+    // notified when a client frees up, and try again. Unreachable
+    // destinations are deferred (or failed) at once.
+
+    List<DeliveryPart>::Iterator p( d->parts );
+    while ( p ) {
+        EString status = SmtpClient::destinationStatus( p->destination );
+        SmtpClient * client = 0;
+        if ( status.isEmpty() ) {
+            client = SmtpClient::provide( this, p->destination );
+            if ( !client )
+                status = SmtpClient::destinationStatus( p->destination );
+        }
+        if ( client ) {
+            client->send( p->dsn, this );
+            d->clients.append( client );
+            d->parts.take( p );
+        }
+        else if ( !status.isEmpty() ) {
+            defer( p->dsn, status );
+            d->parts.take( p );
+        }
+        else {
+            ++p;
+        }
     }
 
     // Once the SmtpClient has updated the action and status for each
@@ -201,7 +268,15 @@ void DeliveryAgent::execute()
         return;
     }
 
-    if ( d->t->failed() && d->client && d->client->sent() ) {
+    bool sent = false;
+    List<SmtpClient>::Iterator c( d->clients );
+    while ( c && !sent ) {
+        if ( c->sent() )
+            sent = true;
+        ++c;
+    }
+
+    if ( d->t->failed() && sent ) {
         // We might end up resending copies of messages that we couldn't
         // update during this transaction.
         log( "Delivery attempt worked, but database could not be updated: " +
@@ -211,7 +286,7 @@ void DeliveryAgent::execute()
         SpoolManager::shutdown();
     }
 
-    d->messageId = 0;
+    finish();
 }
 
 
@@ -227,6 +302,30 @@ bool DeliveryAgent::working() const
 }
 
 
+/*! Returns true if this DeliveryAgent has finished its attempt (or
+    given up), and false if it has not started or is still working.
+*/
+
+bool DeliveryAgent::done() const
+{
+    return d->finished;
+}
+
+
+/*! Records that this DeliveryAgent is done, and tells the owner (if
+    any) so it can reschedule the message.
+*/
+
+void DeliveryAgent::finish()
+{
+    if ( d->finished )
+        return;
+    d->finished = true;
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
 /*! Begins to fetch a message with the given \a messageId, and returns a
     pointer to the newly-created Message object, which will be filled in
     by the message fetcher.
@@ -242,6 +341,7 @@ Message * DeliveryAgent::fetchMessage( uint messageId )
     f->fetch( Fetcher::Body );
     f->setTransaction( d->t );
     f->execute();
+    d->fetcher = f;
     return m;
 }
 
@@ -300,6 +400,70 @@ void DeliveryAgent::createDSN()
 }
 
 
+/*! Decides which SmtpClient destinations the message should be sent
+    to, and creates a DeliveryPart for each.
+*/
+
+void DeliveryAgent::splitDelivery()
+{
+    d->split = true;
+
+    if ( Configuration::toggle( Configuration::UseSmartHost ) ) {
+        d->parts.append( new DeliveryPart( "", d->dsn ) );
+        return;
+    }
+
+    Dict<DeliveryPart> domains;
+    List<Recipient>::Iterator it( d->dsn->recipients() );
+    while ( it ) {
+        Recipient * r = it;
+        ++it;
+        if ( r->action() != Recipient::Unknown )
+            continue;
+        EString domain = r->finalRecipient()->domain().utf8().lower();
+        DeliveryPart * p = domains.find( domain );
+        if ( !p ) {
+            DSN * dsn = new DSN;
+            dsn->setMessage( d->dsn->message() );
+            dsn->setSender( d->dsn->sender() );
+            dsn->setEnvelopeId( d->dsn->envelopeId() );
+            p = new DeliveryPart( domain, dsn );
+            domains.insert( domain, p );
+            d->parts.append( p );
+        }
+        p->dsn->addRecipient( r );
+    }
+
+    if ( d->parts.count() > 1 )
+        log( "Sending to " + fn( d->parts.count() ) + " domains",
+             Log::Debug );
+}
+
+
+/*! Updates the unhandled recipients of \a dsn to reflect that they
+    cannot be reached now, for the reason given by the enhanced status
+    code \a status. A 5.x.x status fails them; others delay them.
+*/
+
+void DeliveryAgent::defer( DSN * dsn, const EString & status )
+{
+    Recipient::Action action = Recipient::Delayed;
+    if ( status.startsWith( "5" ) )
+        action = Recipient::Failed;
+
+    List<Recipient>::Iterator it( dsn->recipients() );
+    while ( it ) {
+        Recipient * r = it;
+        if ( r->action() == Recipient::Unknown ) {
+            r->setAction( action, status );
+            log( "Not sending to " + r->finalRecipient()->lpdomain() +
+                 " now (" + status + ")" );
+        }
+        ++it;
+    }
+}
+
+
 /*! Updates all recipients for the given \a dsn to reflect that the
     message delivery request has expired.
 */
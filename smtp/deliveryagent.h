@@ -18,23 +18,27 @@ class DeliveryAgent
     : public EventHandler
 {
 public:
-    DeliveryAgent( uint );
+    DeliveryAgent( uint, EventHandler * = 0 );
 
     uint messageId() const;
 
     void execute();
 
     bool working() const;
+    bool done() const;
 
 private:
     class DeliveryAgentData * d;
 
     Message * fetchMessage( uint );
     void createDSN();
+    void splitDelivery();
+    void defer( DSN *, const EString & );
     void expireRecipients( DSN * );
     void logDelivery( DSN * );
     Injector * injectBounce( DSN * );
     void updateDelivery();
+    void finish();
 };
 
 
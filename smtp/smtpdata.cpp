@@ -493,6 +493,7 @@ Injectee * SmtpData::message( const EString & body )
             h->repair();
             h->repair( m, "" );
             m->recomputeError();
+            m->setRawText( "" );
         }
     }
     if ( server()->dialect() == SMTP::Lmtp ) {
@@ -540,6 +541,8 @@ Injectee * SmtpData::message( const EString & body )
         // Clean up terrible mime structure if this comes from Kaitan
         // mail or a few other agents.
         m->simplifyMimeStructure();
+        // and we can no longer store the text we received
+        m->setRawText( "" );
     }
     d->message = m;
     return m;
@@ -14,34 +14,88 @@
 #include "smtpclient.h"
 #include "allocator.h"
 #include "scope.h"
+#include "graph.h"
+#include "map.h"
+
+#include <time.h>
+
 
 #define SPOOLINTERVAL    900
 #define SSPOOLINTERVAL  "900"  /* Keep this in sync with SPOOLINTERVAL */
 
+// how often to read the entire spool even if nothing says to
+#define RELOADINTERVAL  3600
+// how long to wait before retrying a failed query
+#define RETRYINTERVAL   60
+
 
 static SpoolManager * sm;
+static DatabaseSignal * spoolSignal;
 static bool shutdown;
 
 
+class SpooledMessage
+    : public Garbage
+{
+public:
+    SpooledMessage( uint m, uint d, uint s )
+        : Garbage(), message( m ), due( d ), since( s ) {}
+
+    uint message;
+    uint due;
+    uint since;
+};
+
+
 class SpoolManagerData
     : public Garbage
 {
 public:
     SpoolManagerData()
-        : q( 0 ), t( 0 ), again( false )
+        : q( 0 ), t( 0 ), reload( true ), reloading( false ),
+          reloaded( 0 ), retry( 0 ), depth( 0 ), age( 0 )
     {}
 
     Query * q;
     Timer * t;
     List<DeliveryAgent> agents;
-    bool again;
+
+    List<SpooledMessage> schedule;
+    Map<SpooledMessage> spooled;
+
+    IntegerSet refresh;
+    IntegerSet fetching;
+    IntegerSet attempted;
+    bool reload;
+    bool reloading;
+    uint reloaded;
+    uint retry;
+
+    GraphableNumber * depth;
+    GraphableNumber * age;
 };
 
 
 /*! \class SpoolManager spoolmanager.h
 
-    This class periodically attempts to deliver mail from the
-    deliveries table to a smarthost using DeliveryAgent.
+    This class attempts to deliver mail from the deliveries table to a
+    smarthost using DeliveryAgent.
+
+    The SpoolManager reads the entire spool once, at startup, and
+    keeps an in-memory schedule of when each spooled message is next
+    due, ordered by that time. Afterwards it only looks at individual
+    messages: those named by the deliveries_updated notifications the
+    Injector sends, and those a DeliveryAgent has just worked on. A
+    notification without a payload (as sent by "aox flush queue")
+    makes it read the entire spool again. As a safety net against
+    lost notifications, it also does that once an hour.
+
+    At most delivery-concurrency DeliveryAgent objects work at the
+    same time. When one finishes, the next due message is started.
+
+    The number of messages in the spool and the age of the oldest are
+    available as the "spool-queue-depth" and "spool-oldest-message"
+    statistics.
 
     Each archiveopteryx process has only one instance of this class,
     which is created by SpoolManager::setup().
@@ -52,6 +106,9 @@ SpoolManager::SpoolManager()
 {
     setLog( new Log );
 
+    d->depth = new GraphableNumber( "spool-queue-depth" );
+    d->age = new GraphableNumber( "spool-oldest-message" );
+
     Query * q = new Query( "update deliveries "
                            "set expires_at=current_timestamp+interval '"
                            SSPOOLINTERVAL " s' "
@@ -69,121 +126,293 @@ SpoolManager::SpoolManager()
 
 void SpoolManager::execute()
 {
-    // Fetch a list of spooled messages, and the next time we can try
-    // to deliver each of them.
-
-    uint delay = UINT_MAX;
-
-    if ( !d->q ) {
-        IntegerSet have;
-        List<DeliveryAgent>::Iterator a( d->agents );
-        while ( a ) {
-            if ( a->working() ) {
-                have.add( a->messageId() );
-                delay = SPOOLINTERVAL;
-                ++a;
-            }
-            else {
-                d->agents.take( a );
-            }
-        }
+    if ( ::shutdown )
+        return;
 
-        log( "Starting queue run" );
-        d->again = false;
-        reset();
-        EString s( "select d.message, "
-                   "extract(epoch from"
-                   " min(coalesce(dr.last_attempt+interval '"
-                   SSPOOLINTERVAL " s',"
-                   " d.deliver_after,"
-                   " current_timestamp)))::bigint"
-                   "-extract(epoch from current_timestamp)::bigint as delay "
-                   "from deliveries d "
-                   "join delivery_recipients dr on (d.id=dr.delivery) "
-                   "where (dr.action=$1 or dr.action=$2) " );
-        if ( !have.isEmpty() )
-            s.append( "and not d.message=any($3) " );
-        s.append( "group by d.message "
-                  "order by delay" );
-        d->q = new Query( s, this );
-        d->q->bind( 1, Recipient::Unknown );
-        d->q->bind( 2, Recipient::Delayed );
-        if ( !have.isEmpty() )
-            d->q->bind( 3, have );
-        d->q->execute();
+    // Any agent that has finished means its message needs a new
+    // place in the schedule, or none at all.
+
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        if ( a->done() ) {
+            d->refresh.add( a->messageId() );
+            d->attempted.add( a->messageId() );
+            d->agents.take( a );
+        }
+        else {
+            ++a;
+        }
     }
 
+    // Bring the schedule up to date with the database.
+
     if ( d->q && !d->q->done() )
         return;
 
-    // Is there anything we might do?
+    if ( d->q ) {
+        reschedule();
+        d->q = 0;
+    }
+
+    uint now = time( 0 );
+    if ( now >= d->reloaded + RELOADINTERVAL )
+        d->reload = true;
 
-    if ( d->q && !d->q->rows() ) {
-        // No. Just finish.
-        reset();
-        log( "Ending queue run" );
+    if ( ( d->reload || !d->refresh.isEmpty() ) && now >= d->retry ) {
+        fetch();
         return;
     }
 
-    // Yes. What?
+    // Start whatever is due, and wait for the next.
 
-    if ( d->q ) {
-        while ( d->q->hasResults() ) {
-            Row * r = d->q->nextRow();
-            int64 deliverableAt = r->getBigint( "delay" );
-            if ( deliverableAt <= 0 ) {
-                DeliveryAgent * a
-                    = new DeliveryAgent( r->getInt( "message" ) );
-                (void)new Timer( a, d->agents.count() * 5 );
-                d->agents.append( a );
+    deliver();
+    recordStatistics();
+}
+
+
+/*! Starts a query to fetch the next delivery time for the messages in
+    need of a refresh, or for all spooled messages if a full reload
+    was requested.
+*/
+
+void SpoolManager::fetch()
+{
+    d->reloading = d->reload;
+    d->reload = false;
+    d->fetching = d->refresh;
+    d->refresh.clear();
+
+    if ( d->reloading )
+        log( "Reading the entire spool" );
+    else
+        log( "Updating the schedule for " + fn( d->fetching.count() ) +
+             " spooled messages", Log::Debug );
+
+    EString s( "select d.message, "
+               "extract(epoch from"
+               " current_timestamp-d.injected_at)::bigint as age, "
+               "extract(epoch from"
+               " min(coalesce(dr.last_attempt+interval '"
+               SSPOOLINTERVAL " s',"
+               " d.deliver_after,"
+               " current_timestamp)))::bigint"
+               "-extract(epoch from current_timestamp)::bigint as delay "
+               "from deliveries d "
+               "join delivery_recipients dr on (d.id=dr.delivery) "
+               "where (dr.action=$1 or dr.action=$2) " );
+    if ( !d->reloading )
+        s.append( "and d.message=any($3) " );
+    s.append( "group by d.message, d.injected_at" );
+    d->q = new Query( s, this );
+    d->q->bind( 1, Recipient::Unknown );
+    d->q->bind( 2, Recipient::Delayed );
+    if ( !d->reloading )
+        d->q->bind( 3, d->fetching );
+    d->q->execute();
+}
+
+
+/*! Updates the in-memory schedule based on the results of the query
+    started by fetch(). Messages an agent is working on are left out;
+    they're fetched again once the agent is done.
+
+    If the query failed, the schedule is left alone, and the same
+    messages are fetched again after a while.
+*/
+
+void SpoolManager::reschedule()
+{
+    if ( d->q->failed() ) {
+        log( "Could not read the spool: " + d->q->error(), Log::Error );
+        if ( d->reloading )
+            d->reload = true;
+        else
+            d->refresh.add( d->fetching );
+        d->fetching.clear();
+        d->reloading = false;
+        d->retry = time( 0 ) + RETRYINTERVAL;
+        return;
+    }
+
+    if ( d->reloading ) {
+        d->schedule.clear();
+        d->spooled.clear();
+    }
+    else {
+        uint i = 1;
+        while ( i <= d->fetching.count() ) {
+            uint m = d->fetching.value( i );
+            SpooledMessage * s = d->spooled.find( m );
+            if ( s ) {
+                d->spooled.remove( m );
+                d->schedule.take( d->schedule.find( s ) );
             }
-            else if ( delay > deliverableAt )
-                delay = deliverableAt;
+            i++;
         }
-        if ( delay < UINT_MAX ) {
-            log( "Will process the queue again in " +
-                 fn( delay ) + " seconds" );
-            d->t = new Timer( this, delay );
-        }
-        d->q = 0;
     }
 
-    reset();
+    IntegerSet busy;
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        busy.add( a->messageId() );
+        ++a;
+    }
+
+    uint now = time( 0 );
+    while ( d->q->hasResults() ) {
+        Row * r = d->q->nextRow();
+        uint m = r->getInt( "message" );
+        if ( busy.contains( m ) || d->spooled.find( m ) )
+            continue;
+
+        int64 delay = r->getBigint( "delay" );
+        if ( delay < 0 )
+            delay = 0;
+        // A message we tried just now waits for the usual interval,
+        // even if the attempt didn't manage to update the database.
+        if ( d->attempted.contains( m ) && delay < SPOOLINTERVAL )
+            delay = SPOOLINTERVAL;
+        uint since = now;
+        if ( !r->isNull( "age" ) && r->getBigint( "age" ) > 0 )
+            since = now - r->getBigint( "age" );
+
+        SpooledMessage * s = new SpooledMessage( m, now + delay, since );
+        d->spooled.insert( m, s );
+
+        // Most messages are due later than those already scheduled,
+        // so look for the insertion point from the end.
+        List<SpooledMessage>::Iterator i( d->schedule.last() );
+        while ( i && i->due > s->due )
+            --i;
+        if ( i )
+            ++i;
+        else
+            i = d->schedule.first();
+        d->schedule.insert( i, s );
+    }
+
+    if ( d->reloading ) {
+        d->attempted.clear();
+        d->reloaded = now;
+    }
+    else
+        d->attempted.remove( d->fetching );
+    d->fetching.clear();
+    d->reloading = false;
+
+    log( "Spool contains " + fn( d->schedule.count() ) +
+         " waiting messages", Log::Debug );
+}
+
+
+/*! Starts a DeliveryAgent for each message that is due, as long as
+    delivery-concurrency permits, and arranges to be called again when
+    the next message falls due.
+*/
+
+void SpoolManager::deliver()
+{
+    delete d->t;
+    d->t = 0;
+
+    uint max = Configuration::scalar( Configuration::DeliveryConcurrency );
+    if ( max < 1 )
+        max = 1;
+
+    uint now = time( 0 );
+    while ( d->agents.count() < max &&
+            !d->schedule.isEmpty() &&
+            d->schedule.firstElement()->due <= now ) {
+        SpooledMessage * s = d->schedule.shift();
+        d->spooled.remove( s->message );
+        DeliveryAgent * a = new DeliveryAgent( s->message, this );
+        d->agents.append( a );
+        a->execute();
+    }
+
+    // Wake up for the next due message (if all agents are busy, the
+    // first one to finish wakes us instead), for a retry, or for the
+    // periodic reload, whichever comes first.
+
+    uint next = d->reloaded + RELOADINTERVAL;
+    if ( d->agents.count() < max && !d->schedule.isEmpty() &&
+         d->schedule.firstElement()->due < next )
+        next = d->schedule.firstElement()->due;
+    if ( ( d->reload || !d->refresh.isEmpty() ) && d->retry < next )
+        next = d->retry;
+
+    uint delay = 1;
+    if ( next > now )
+        delay = next - now;
+    log( "Will process the queue again in " + fn( delay ) + " seconds",
+         Log::Debug );
+    d->t = new Timer( this, delay );
 }
 
 
-/*! This function is called whenever a new row is added to the
-    deliveries table, and updates the state machine so the message
-    will be delivered soon.
+/*! Records the spool's queue depth (including the messages being
+    delivered right now) and the age of the oldest spooled message.
 */
 
-void SpoolManager::deliverNewMessage()
+void SpoolManager::recordStatistics()
 {
+    uint now = time( 0 );
+    uint oldest = now;
+    List<SpooledMessage>::Iterator i( d->schedule );
+    while ( i ) {
+        if ( i->since < oldest )
+            oldest = i->since;
+        ++i;
+    }
+    d->depth->setValue( d->schedule.count() + d->agents.count() );
+    d->age->setValue( now - oldest );
+}
+
+
+/*! This function is called whenever rows in the deliveries table are
+    added or changed, and updates the state machine so the affected
+    messages will be delivered soon. \a messages is the notification
+    payload, a comma-separated list of message IDs, or an empty string
+    if any spooled message may have changed.
+*/
+
+void SpoolManager::deliverNewMessages( const EString & messages )
+{
+    EStringList * l = EStringList::split( ',', messages );
+    EStringList::Iterator i( l );
+    while ( i ) {
+        bool ok = false;
+        uint m = i->number( &ok );
+        if ( ok && m )
+            d->refresh.add( m );
+        else if ( !i->isEmpty() )
+            d->reload = true;
+        ++i;
+    }
+    if ( messages.isEmpty() )
+        d->reload = true;
+
     if ( d->q ) {
-        d->again = true;
-        log( "New message added to spool while spool is being processed",
+        log( "Spool changed while its schedule is being updated",
              Log::Debug );
         return;
     }
-    else {
-        log( "New message added to spool; will deliver when possible" );
-        d->again = true;
-        reset();
-    }
+
+    log( "Spool changed; will deliver when possible" );
+    reset();
 }
 
 
 
 /*! Resets the perishable state of this SpoolManager, i.e. all but the
-    Timer. Provided for convenience.
+    schedule and the running agents, and arranges for execute() to be
+    called soon. Provided for convenience.
 */
 
 void SpoolManager::reset()
 {
     delete d->t;
-    d->t = 0;
-    if ( d->again )
-        d->t = new Timer( this, 1 );
+    d->t = new Timer( this, 1 );
     d->q = 0;
 }
 
@@ -193,7 +422,13 @@ class SpoolRunner
 {
 public:
     SpoolRunner(): EventHandler() {}
-    void execute() { if ( ::sm ) ::sm->deliverNewMessage(); }
+    void execute() {
+        EStringList::Iterator i( ::spoolSignal->payloads() );
+        while ( ::sm && i ) {
+            ::sm->deliverNewMessages( *i );
+            ++i;
+        }
+    }
 };
 
 
@@ -210,7 +445,9 @@ void SpoolManager::setup()
     ::sm = new SpoolManager;
     Allocator::addEternal( ::sm, "spool manager" );
     Database::notifyWhenIdle( sm );
-    (void)new DatabaseSignal( "deliveries_updated", new SpoolRunner );
+    ::spoolSignal = new DatabaseSignal( "deliveries_updated",
+                                        new SpoolRunner );
+    ::spoolSignal->setKeepingPayloads( true );
 }
 
 
@@ -17,11 +17,15 @@ public:
     static void setup();
     static void shutdown();
 
-    void deliverNewMessage();
+    void deliverNewMessages( const EString & );
 
 private:
     class SpoolManagerData * d;
     void reset();
+    void fetch();
+    void reschedule();
+    void deliver();
+    void recordStatistics();
 };
 
 